@@ -0,0 +1,129 @@
+#include "AsyncFileIo.h"
+#include <iostream>
+#include <thread>
+#include <windows.h>
+
+struct AsyncFileIo::Queue {
+  HANDLE Port;
+};
+
+struct Operation {
+  OVERLAPPED Overlapped; // first, so the port's pointer maps back
+  AsyncFileIo::Completion Done;
+};
+
+// A manual-reset event per thread for ReadSync, closed with the thread.
+struct ThreadEvent {
+  HANDLE Handle = NULL;
+  ~ThreadEvent() {
+    if (Handle)
+      CloseHandle(Handle);
+  }
+};
+
+// What ReadFile or a completion reported, with GetLastError still intact.
+static AsyncFileIo::ReadResult MakeResult(BOOL ok, DWORD bytes) {
+  AsyncFileIo::ReadResult result;
+  if (ok) {
+    result.Status = AsyncFileIo::ReadStatus::Ok;
+    result.Bytes = bytes;
+    return result;
+  }
+  result.SystemError = GetLastError();
+  if (result.SystemError == ERROR_HANDLE_EOF)
+    result.Status = AsyncFileIo::ReadStatus::EndOfFile;
+  return result;
+}
+
+static void CompletionLoop(HANDLE port) {
+  while (true) {
+    DWORD bytes = 0;
+    ULONG_PTR key = 0;
+    OVERLAPPED *overlapped = NULL;
+    BOOL ok =
+        GetQueuedCompletionStatus(port, &bytes, &key, &overlapped, INFINITE);
+    if (!overlapped) {
+      // With no timeout, a failure without a packet means the port closed.
+      if (!ok)
+        return;
+      continue;
+    }
+    Operation *op = (Operation *)overlapped;
+    op->Done(MakeResult(ok, bytes));
+    delete op;
+  }
+}
+
+AsyncFileIo::~AsyncFileIo() {
+  if (m_Queue) {
+    CloseHandle(m_Queue->Port);
+    delete m_Queue;
+  }
+}
+
+bool AsyncFileIo::Start(uint32_t threads) {
+  HANDLE port =
+      CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, threads);
+  if (!port) {
+    std::wcerr << L"CreateIoCompletionPort failed: " << GetLastError()
+               << L"; reads stay synchronous." << std::endl;
+    return false;
+  }
+  // Each thread keeps its own copy of the port, so none touches m_Queue.
+  for (uint32_t i = 0; i < threads; ++i)
+    std::thread(CompletionLoop, port).detach();
+  m_Queue = new Queue{port};
+  return true;
+}
+
+bool AsyncFileIo::Attach(NativeFile file) {
+  return m_Queue && CreateIoCompletionPort((HANDLE)file, m_Queue->Port, 0,
+                                           0) == m_Queue->Port;
+}
+
+bool AsyncFileIo::Read(NativeFile file, uint64_t offset, void *buffer,
+                       uint32_t length, Completion done) {
+  Operation *op = new Operation();
+  op->Overlapped.Offset = (DWORD)offset;
+  op->Overlapped.OffsetHigh = (DWORD)(offset >> 32);
+  op->Done = std::move(done);
+
+  // Even an immediate success queues a packet, so the callback always runs
+  // on the port.
+  if (ReadFile((HANDLE)file, buffer, length, NULL, &op->Overlapped) ||
+      GetLastError() == ERROR_IO_PENDING)
+    return true;
+  delete op;
+  return false;
+}
+
+AsyncFileIo::ReadResult AsyncFileIo::ReadSync(NativeFile file,
+                                              uint64_t offset, void *buffer,
+                                              uint32_t length) {
+  // Waiting on an event with its low bit set keeps the completion of a read
+  // on an attached handle off the port. Without one it would reach the
+  // completion threads, which take every packet for an Operation.
+  thread_local ThreadEvent event;
+  if (!event.Handle)
+    event.Handle = CreateEventW(NULL, TRUE, FALSE, NULL);
+  if (!event.Handle) {
+    ReadResult result;
+    result.SystemError = GetLastError();
+    std::wcerr << L"CreateEventW failed for a read: " << result.SystemError
+               << std::endl;
+    return result;
+  }
+
+  OVERLAPPED ov = {0};
+  ov.Offset = (DWORD)offset;
+  ov.OffsetHigh = (DWORD)(offset >> 32);
+  ov.hEvent = (HANDLE)((UINT_PTR)event.Handle | 1);
+
+  DWORD bytesRead = 0;
+  if (ReadFile((HANDLE)file, buffer, length, &bytesRead, &ov))
+    return MakeResult(TRUE, bytesRead);
+  if (GetLastError() != ERROR_IO_PENDING)
+    return MakeResult(FALSE, 0);
+  return MakeResult(GetOverlappedResult((HANDLE)file, &ov, &bytesRead, TRUE),
+                    bytesRead);
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+
+// Asynchronous positioned reads of cache files, completed on a small pool
+// of threads. Nothing here names the platform's queue: a file is attached
+// once, then reads are issued with a callback. AsyncFileIo.cpp implements
+// it on an I/O completion port; the same shape maps onto io_uring (Attach
+// registers the fd, Read submits an SQE, the pool reaps CQEs).
+class AsyncFileIo {
+public:
+  // A file as the platform opened it: its HANDLE on Windows, its fd on
+  // Linux.
+  using NativeFile = std::intptr_t;
+
+  enum class ReadStatus { Ok, EndOfFile, Failed };
+
+  struct ReadResult {
+    ReadStatus Status = ReadStatus::Failed;
+    uint32_t Bytes = 0;
+    uint32_t SystemError = 0; // Win32 error or errno, for logging
+    bool Ok() const { return Status == ReadStatus::Ok; }
+  };
+
+  using Completion = std::function<void(const ReadResult &result)>;
+
+  ~AsyncFileIo();
+
+  bool Start(uint32_t threads);
+  bool Started() const { return m_Queue != nullptr; }
+
+  // `file` must have been opened for asynchronous I/O
+  // (FILE_FLAG_OVERLAPPED on Windows).
+  bool Attach(NativeFile file);
+
+  // Queues a read; `done` runs on a completion thread. Returns false if the
+  // read could not be issued, in which case `done` is never called.
+  bool Read(NativeFile file, uint64_t offset, void *buffer, uint32_t length,
+            Completion done);
+
+  // Blocking positioned read that also works on attached files, without
+  // its completion reaching the pool.
+  static ReadResult ReadSync(NativeFile file, uint64_t offset, void *buffer,
+                             uint32_t length);
+
+private:
+  struct Queue; // the platform's completion queue, in AsyncFileIo.cpp
+
+  Queue *m_Queue = nullptr;
+};
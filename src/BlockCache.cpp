@@ -0,0 +1,145 @@
+#include "BlockCache.h"
+#include <algorithm>
+
+// Pinned central directories are small, but thousands of archives add up.
+static const size_t kMaxPinnedBytes = 16 * 1024 * 1024;
+
+void BlockCache::SetCapacity(size_t bytes) {
+  std::lock_guard<std::mutex> guard(m_Lock);
+  m_Capacity = bytes;
+  EvictLocked();
+}
+
+bool BlockCache::Read(UINT64 fileKey, UINT64 offset, void *buffer,
+                      ULONG length) {
+  m_Stats.Reads++;
+  if (length == 0)
+    return false;
+
+  std::lock_guard<std::mutex> guard(m_Lock);
+
+  auto pin = m_Pinned.find(fileKey);
+  if (pin != m_Pinned.end()) {
+    const PinnedRegion &r = pin->second;
+    if (offset >= r.Offset && offset + length <= r.Offset + r.Data.size()) {
+      memcpy(buffer, r.Data.data() + (offset - r.Offset), length);
+      m_Stats.Hits++;
+      return true;
+    }
+  }
+
+  if (m_Capacity == 0)
+    return false;
+
+  // Check every block first so a partial hit costs no copying.
+  UINT64 first = offset / kBlockSize;
+  UINT64 last = (offset + length - 1) / kBlockSize;
+  for (UINT64 i = first; i <= last; ++i) {
+    auto it = m_Index.find({fileKey, i});
+    if (it == m_Index.end())
+      return false;
+    UINT64 blockEnd = i * kBlockSize + it->second->Data.size();
+    if (i == last && blockEnd < offset + length)
+      return false;
+  }
+
+  BYTE *out = (BYTE *)buffer;
+  UINT64 pos = offset;
+  UINT64 end = offset + length;
+  for (UINT64 i = first; i <= last; ++i) {
+    auto lruIt = m_Index[{fileKey, i}];
+    m_Lru.splice(m_Lru.begin(), m_Lru, lruIt);
+    UINT64 blockStart = i * kBlockSize;
+    UINT64 copyEnd = (std::min)(end, blockStart + lruIt->Data.size());
+    memcpy(out, lruIt->Data.data() + (pos - blockStart),
+           (size_t)(copyEnd - pos));
+    out += copyEnd - pos;
+    pos = copyEnd;
+  }
+  m_Stats.Hits++;
+  return true;
+}
+
+void BlockCache::InsertSpan(UINT64 fileKey, UINT64 fileSize,
+                            UINT64 spanStart, const BYTE *span,
+                            DWORD length) {
+  for (UINT64 pos = 0; pos < length; pos += kBlockSize) {
+    UINT32 n = (UINT32)(std::min)((UINT64)kBlockSize, (UINT64)length - pos);
+    if (n < kBlockSize && spanStart + pos + n != fileSize)
+      break;
+    Insert(fileKey, (spanStart + pos) / kBlockSize, span + pos, n);
+  }
+}
+
+void BlockCache::SpanFor(UINT64 fileKey, UINT64 fileSize, UINT64 offset,
+                         ULONG length, UINT32 readAhead, UINT64 &spanStart,
+                         UINT64 &spanEnd) {
+  spanStart = offset / kBlockSize * kBlockSize;
+  UINT64 needed = (offset + length + kBlockSize - 1) / kBlockSize;
+  UINT64 wanted = (offset + length + readAhead + kBlockSize - 1) / kBlockSize;
+  if (wanted > needed) {
+    // Reading ahead into blocks a reordered load already brought in would
+    // only fetch them again.
+    std::lock_guard<std::mutex> guard(m_Lock);
+    for (UINT64 i = needed; i < wanted; ++i) {
+      if (m_Index.count({fileKey, i})) {
+        wanted = i;
+        break;
+      }
+    }
+  }
+  spanEnd = (std::min)(wanted * kBlockSize, fileSize);
+}
+
+void BlockCache::Insert(UINT64 fileKey, UINT64 blockIndex, const BYTE *data,
+                        UINT32 length) {
+  std::lock_guard<std::mutex> guard(m_Lock);
+  if (m_Capacity == 0 || length == 0)
+    return;
+
+  BlockId id{fileKey, blockIndex};
+  auto it = m_Index.find(id);
+  if (it != m_Index.end()) {
+    m_Size -= it->second->Data.size();
+    m_Lru.erase(it->second);
+    m_Index.erase(it);
+  }
+
+  m_Lru.push_front(Block{id, std::vector<BYTE>(data, data + length)});
+  m_Index[id] = m_Lru.begin();
+  m_Size += length;
+  EvictLocked();
+}
+
+void BlockCache::Pin(UINT64 fileKey, UINT64 offset, std::vector<BYTE> &&data) {
+  std::lock_guard<std::mutex> guard(m_Lock);
+  if (m_Pinned.count(fileKey) || data.size() > kMaxPinnedBytes)
+    return;
+
+  m_PinnedSize += data.size();
+  m_Pinned[fileKey] = PinnedRegion{offset, std::move(data)};
+  m_PinOrder.push_back(fileKey);
+
+  while (m_PinnedSize > kMaxPinnedBytes && !m_PinOrder.empty()) {
+    auto old = m_Pinned.find(m_PinOrder.front());
+    m_PinOrder.pop_front();
+    if (old == m_Pinned.end())
+      continue;
+    m_PinnedSize -= old->second.Data.size();
+    m_Pinned.erase(old);
+  }
+}
+
+bool BlockCache::IsPinned(UINT64 fileKey) {
+  std::lock_guard<std::mutex> guard(m_Lock);
+  return m_Pinned.count(fileKey) != 0;
+}
+
+void BlockCache::EvictLocked() {
+  while (m_Size > m_Capacity && !m_Lru.empty()) {
+    Block &victim = m_Lru.back();
+    m_Size -= victim.Data.size();
+    m_Index.erase(victim.Id);
+    m_Lru.pop_back();
+  }
+}
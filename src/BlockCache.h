@@ -0,0 +1,103 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <windows.h>
+
+// Bounded LRU cache of fixed-size blocks of cached archives, shared by all
+// open files. Each archive can additionally pin one region (its zip central
+// directory) that is kept outside the LRU.
+class BlockCache {
+public:
+  static const UINT32 kBlockSize = 64 * 1024;
+  // Largest read-ahead window an AccessPattern grows to.
+  static const UINT32 kMaxReadAhead = 1024 * 1024;
+
+  struct Stats {
+    std::atomic<UINT64> Reads{0};
+    std::atomic<UINT64> Hits{0};
+    std::atomic<UINT64> ReadSyscalls{0};
+    std::atomic<UINT64> BytesFromDisk{0};
+  };
+
+  void SetCapacity(size_t bytes);
+  bool Enabled() const { return m_Capacity > 0; }
+
+  // Copies [offset, offset + length) into buffer if it is entirely cached.
+  bool Read(UINT64 fileKey, UINT64 offset, void *buffer, ULONG length);
+  void Insert(UINT64 fileKey, UINT64 blockIndex, const BYTE *data,
+              UINT32 length);
+  // Adds the whole blocks of a span read from disk at `spanStart`. Only the
+  // block at end of file may be short.
+  void InsertSpan(UINT64 fileKey, UINT64 fileSize, UINT64 spanStart,
+                  const BYTE *span, DWORD length);
+  // The block-aligned span to read from disk for a miss on [offset,
+  // offset + length) with `readAhead` more bytes wanted after it. The
+  // read-ahead stops short of the first block already cached.
+  void SpanFor(UINT64 fileKey, UINT64 fileSize, UINT64 offset, ULONG length,
+               UINT32 readAhead, UINT64 &spanStart, UINT64 &spanEnd);
+  void Pin(UINT64 fileKey, UINT64 offset, std::vector<BYTE> &&data);
+  bool IsPinned(UINT64 fileKey);
+
+  Stats &GetStats() { return m_Stats; }
+
+private:
+  struct BlockId {
+    UINT64 Key;
+    UINT64 Index;
+    bool operator==(const BlockId &o) const {
+      return Key == o.Key && Index == o.Index;
+    }
+  };
+  struct BlockIdHash {
+    size_t operator()(const BlockId &id) const {
+      return (size_t)(id.Key ^ (id.Index * 0x9E3779B97F4A7C15ull));
+    }
+  };
+  struct Block {
+    BlockId Id;
+    std::vector<BYTE> Data;
+  };
+  struct PinnedRegion {
+    UINT64 Offset;
+    std::vector<BYTE> Data;
+  };
+
+  void EvictLocked();
+
+  std::mutex m_Lock;
+  size_t m_Capacity = 0;
+  size_t m_Size = 0;
+  std::list<Block> m_Lru; // most recently used at the front
+  std::unordered_map<BlockId, std::list<Block>::iterator, BlockIdHash> m_Index;
+
+  size_t m_PinnedSize = 0;
+  std::list<UINT64> m_PinOrder; // oldest pin at the front
+  std::unordered_map<UINT64, PinnedRegion> m_Pinned;
+
+  Stats m_Stats;
+};
+
+// Detects runs of reads that continue where the previous one ended and grows
+// a read-ahead window for them; any seek resets it.
+struct AccessPattern {
+  UINT64 NextOffset = 0;
+  UINT32 Run = 0;
+  UINT32 Window = 0;
+
+  UINT32 Update(UINT64 offset, ULONG length) {
+    if (offset == NextOffset && offset != 0) {
+      if (++Run >= 2)
+        Window = Window ? (std::min)(Window * 2, BlockCache::kMaxReadAhead)
+                        : 2 * BlockCache::kBlockSize;
+    } else {
+      Run = 0;
+      Window = 0;
+    }
+    NextOffset = offset + length;
+    return Window;
+  }
+};
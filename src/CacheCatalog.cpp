@@ -0,0 +1,474 @@
+#include "CacheCatalog.h"
+#include "CacheLayout.h"
+#include "Crc32.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+static const UINT32 kCatalogMagic = 0x4352434D; // "MCRC"
+static const UINT32 kCatalogVersion = 1;
+static const UINT32 kMinCapacity = 4096;
+// Touch stores LastAccess atomically, which needs it 8-byte aligned in the
+// mapping.
+static_assert(offsetof(CatalogEntry, LastAccess) % 8 == 0 &&
+                  sizeof(CatalogEntry) % 8 == 0,
+              "CatalogEntry::LastAccess must stay 8-byte aligned");
+
+struct CacheCatalog::Header {
+  UINT32 Magic;
+  UINT32 Version;
+  UINT32 Capacity; // slots, always a power of two
+  UINT32 EntrySize;
+  UINT32 Count;      // Downloading + Complete slots
+  UINT32 Tombstones; // Deleted slots
+  UINT32 HeaderCrc;  // covers the fields above
+  UINT32 Reserved[9];
+};
+
+static bool IsCatalogedName(const wchar_t *name) {
+  size_t len = wcslen(name);
+  return (len > 4 && _wcsicmp(name + len - 4, L".zip") == 0) ||
+         (len > 3 && _wcsicmp(name + len - 3, L".7z") == 0);
+}
+
+static UINT64 NowFileTime() {
+  FILETIME ft;
+  GetSystemTimeAsFileTime(&ft);
+  return ((UINT64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+template <size_t N>
+static bool CopyField(WCHAR (&dest)[N], const std::wstring &value) {
+  if (value.size() >= N)
+    return false;
+  memset(dest, 0, sizeof(dest));
+  memcpy(dest, value.c_str(), value.size() * sizeof(WCHAR));
+  return true;
+}
+
+CacheCatalog::~CacheCatalog() { Close(); }
+
+UINT64 CacheCatalog::HashName(PCWSTR name) {
+  // FNV-1a over the case-folded name; 0 marks a never-used slot.
+  UINT64 hash = kHashSeed;
+  for (; *name; ++name)
+    hash = HashStep(hash, *name);
+  return hash ? hash : 1;
+}
+
+UINT32 CacheCatalog::EntryChecksum(const CatalogEntry &entry) {
+  return Crc32Update(0, &entry, offsetof(CatalogEntry, EntryCrc));
+}
+
+UINT32 CacheCatalog::HeaderChecksum(const Header &header) {
+  return Crc32Update(0, &header, offsetof(Header, HeaderCrc));
+}
+
+CatalogEntry *CacheCatalog::Entries() const {
+  return (CatalogEntry *)((BYTE *)m_Header + sizeof(Header));
+}
+
+bool CacheCatalog::Open(const std::wstring &cacheDir, bool sharded) {
+  std::unique_lock<std::shared_mutex> lock(m_Lock);
+  m_CacheDir = cacheDir;
+  m_Sharded = sharded;
+  m_Path = cacheDir + L"\\mcr.catalog";
+  m_InUse = false;
+
+  auto start = std::chrono::steady_clock::now();
+  if (Map(m_Path, 0, false)) {
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+    std::wcout << L"Catalog loaded: " << m_Header->Count << L" entries in "
+               << ms << L" ms" << std::endl;
+    return true;
+  }
+  if (m_InUse) {
+    // A rebuild could not replace the file while it is mapped anyway.
+    std::wcerr << L"Catalog in use by another mcr: " << m_Path << std::endl;
+    return false;
+  }
+
+  std::wcout << L"Catalog missing or corrupt, rebuilding from " << cacheDir
+             << L"..." << std::endl;
+  std::vector<CatalogEntry> entries;
+  Scan(entries);
+  bool ok = Recreate(entries);
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  std::wcout << L"Catalog rebuilt: " << entries.size() << L" entries in " << ms
+             << L" ms" << std::endl;
+  return ok;
+}
+
+void CacheCatalog::Close() {
+  std::unique_lock<std::shared_mutex> lock(m_Lock);
+  Unmap();
+}
+
+bool CacheCatalog::Map(const std::wstring &path, UINT32 capacity,
+                       bool create) {
+  m_File = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE,
+                       FILE_SHARE_READ, NULL,
+                       create ? CREATE_ALWAYS : OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+  if (m_File == INVALID_HANDLE_VALUE) {
+    m_InUse = GetLastError() == ERROR_SHARING_VIOLATION;
+    return false;
+  }
+
+  UINT64 size = 0;
+  if (create) {
+    size = sizeof(Header) + (UINT64)capacity * sizeof(CatalogEntry);
+  } else {
+    LARGE_INTEGER li;
+    if (!GetFileSizeEx(m_File, &li) || li.QuadPart < (LONGLONG)sizeof(Header)) {
+      Unmap();
+      return false;
+    }
+    size = (UINT64)li.QuadPart;
+  }
+
+  m_Mapping = CreateFileMappingW(m_File, NULL, PAGE_READWRITE,
+                                 (DWORD)(size >> 32), (DWORD)size, NULL);
+  if (!m_Mapping) {
+    Unmap();
+    return false;
+  }
+  m_Header = (Header *)MapViewOfFile(m_Mapping, FILE_MAP_WRITE, 0, 0, 0);
+  if (!m_Header) {
+    Unmap();
+    return false;
+  }
+
+  if (create) {
+    // A freshly extended file is zero-filled, so every slot starts empty.
+    m_Header->Magic = kCatalogMagic;
+    m_Header->Version = kCatalogVersion;
+    m_Header->Capacity = capacity;
+    m_Header->EntrySize = sizeof(CatalogEntry);
+    UpdateHeader();
+    return true;
+  }
+
+  const Header &h = *m_Header;
+  bool valid = h.Magic == kCatalogMagic && h.Version == kCatalogVersion &&
+               h.EntrySize == sizeof(CatalogEntry) && h.Capacity != 0 &&
+               (h.Capacity & (h.Capacity - 1)) == 0 &&
+               size >= sizeof(Header) +
+                           (UINT64)h.Capacity * sizeof(CatalogEntry) &&
+               h.HeaderCrc == HeaderChecksum(h);
+  if (!valid) {
+    Unmap();
+    return false;
+  }
+  return true;
+}
+
+void CacheCatalog::Unmap() {
+  if (m_Header) {
+    FlushViewOfFile(m_Header, 0);
+    UnmapViewOfFile(m_Header);
+    m_Header = nullptr;
+  }
+  if (m_Mapping) {
+    CloseHandle(m_Mapping);
+    m_Mapping = NULL;
+  }
+  if (m_File != INVALID_HANDLE_VALUE) {
+    CloseHandle(m_File);
+    m_File = INVALID_HANDLE_VALUE;
+  }
+}
+
+void CacheCatalog::UpdateHeader() {
+  m_Header->HeaderCrc = HeaderChecksum(*m_Header);
+  FlushViewOfFile(m_Header, sizeof(Header));
+}
+
+bool CacheCatalog::Recreate(const std::vector<CatalogEntry> &entries) {
+  // Size for a load factor of at most 50% so the table has room to grow.
+  UINT32 capacity = kMinCapacity;
+  while (capacity < entries.size() * 2)
+    capacity <<= 1;
+
+  // Build the new table beside the old one and rename it over, so a crash
+  // mid-rebuild leaves either the old catalog or the new one.
+  std::wstring tmpPath = m_Path + L".tmp";
+  Unmap();
+  if (!Map(tmpPath, capacity, true)) {
+    std::wcerr << L"Failed to create catalog: " << tmpPath << std::endl;
+    return false;
+  }
+  for (const auto &e : entries) {
+    CatalogEntry *slot = FindSlot(e.Name, e.Hash, true);
+    if (!slot)
+      continue;
+    *slot = e;
+    slot->EntryCrc = EntryChecksum(*slot);
+    m_Header->Count++;
+  }
+  UpdateHeader();
+  FlushViewOfFile(m_Header, 0);
+  FlushFileBuffers(m_File);
+  Unmap();
+
+  if (!MoveFileExW(tmpPath.c_str(), m_Path.c_str(),
+                   MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+    std::wcerr << L"Failed to replace catalog: " << GetLastError()
+               << std::endl;
+    return false;
+  }
+  return Map(m_Path, 0, false);
+}
+
+void CacheCatalog::Scan(std::vector<CatalogEntry> &entries) {
+  std::mutex resultLock;
+  std::vector<std::wstring> subdirs;
+
+  // `dir` is the physical directory, `virtualDir` where its files appear.
+  auto scanOne = [&](const std::wstring &dir, const std::wstring &virtualDir,
+                     std::vector<std::wstring> *dirsOut) {
+    std::vector<CatalogEntry> local;
+    std::wstring search = m_CacheDir + dir + L"\\*";
+    WIN32_FIND_DATAW fd;
+    HANDLE h = FindFirstFileExW(search.c_str(), FindExInfoBasic, &fd,
+                                FindExSearchNameMatch, NULL,
+                                FIND_FIRST_EX_LARGE_FETCH);
+    if (h == INVALID_HANDLE_VALUE)
+      return;
+    do {
+      if (wcscmp(fd.cFileName, L".") == 0 || wcscmp(fd.cFileName, L"..") == 0)
+        continue;
+      std::wstring name = virtualDir + L"\\" + fd.cFileName;
+      if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+        if (dirsOut)
+          dirsOut->push_back(name);
+        continue;
+      }
+      if (!IsCatalogedName(fd.cFileName))
+        continue;
+
+      CatalogEntry e = {};
+      if (!CopyField(e.Name, name))
+        continue;
+      e.Hash = HashName(e.Name);
+      e.State = CatalogState::Complete;
+      e.Size = ((UINT64)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+      e.LastAccess = ((UINT64)fd.ftLastAccessTime.dwHighDateTime << 32) |
+                     fd.ftLastAccessTime.dwLowDateTime;
+      local.push_back(e);
+    } while (FindNextFileW(h, &fd));
+    FindClose(h);
+
+    std::lock_guard<std::mutex> guard(resultLock);
+    entries.insert(entries.end(), local.begin(), local.end());
+  };
+
+  // The root holds almost every archive; per-set directories are scanned
+  // in parallel since each one costs a separate round of directory I/O.
+  // Sharded, every archive is in a shard and shows up at the root.
+  if (m_Sharded) {
+    for (UINT32 i = 0; i < CacheLayout::kShardCount; ++i)
+      subdirs.push_back(CacheLayout::ShardDir(i));
+  } else {
+    scanOne(L"", L"", &subdirs);
+  }
+
+  std::atomic<size_t> next(0);
+  size_t workers = (std::min)(
+      subdirs.size(),
+      (size_t)(std::max)(1u, std::thread::hardware_concurrency()));
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < workers; ++i) {
+    threads.emplace_back([&]() {
+      for (size_t k = next++; k < subdirs.size(); k = next++)
+        scanOne(subdirs[k], m_Sharded ? L"" : subdirs[k], nullptr);
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+}
+
+CatalogEntry *CacheCatalog::FindSlot(PCWSTR name, UINT64 hash,
+                                     bool forInsert) {
+  UINT32 capacity = m_Header->Capacity;
+  UINT32 mask = capacity - 1;
+  CatalogEntry *entries = Entries();
+  CatalogEntry *firstFree = nullptr;
+
+  for (UINT32 i = 0; i < capacity; ++i) {
+    CatalogEntry *slot = &entries[(hash + i) & mask];
+    if (slot->Hash == 0)
+      return forInsert ? (firstFree ? firstFree : slot) : nullptr;
+    if (slot->State == CatalogState::Deleted) {
+      if (!firstFree)
+        firstFree = slot;
+      continue;
+    }
+    if (slot->Hash == hash && _wcsicmp(slot->Name, name) == 0)
+      return slot;
+  }
+  return forInsert ? firstFree : nullptr;
+}
+
+void CacheCatalog::Store(CatalogEntry *slot, const CatalogEntry &value) {
+  // A torn write leaves a checksum mismatch, which Lookup treats as a miss.
+  CatalogEntry tmp = value;
+  tmp.EntryCrc = EntryChecksum(tmp);
+  *slot = tmp;
+  FlushViewOfFile(slot, sizeof(*slot));
+}
+
+void CacheCatalog::Insert(const CatalogEntry &value) {
+  if (!m_Header)
+    return;
+
+  // Keep the load factor (tombstones included) below 70%.
+  if ((UINT64)(m_Header->Count + m_Header->Tombstones + 1) * 10 >
+      (UINT64)m_Header->Capacity * 7) {
+    std::vector<CatalogEntry> live;
+    CatalogEntry *entries = Entries();
+    for (UINT32 i = 0; i < m_Header->Capacity; ++i) {
+      const CatalogEntry &e = entries[i];
+      if (e.Hash != 0 && e.State != CatalogState::Deleted &&
+          e.EntryCrc == EntryChecksum(e))
+        live.push_back(e);
+    }
+    if (!Recreate(live))
+      return;
+  }
+
+  CatalogEntry *slot = FindSlot(value.Name, value.Hash, true);
+  if (!slot)
+    return;
+  bool isNew = slot->Hash == 0 || slot->State == CatalogState::Deleted;
+  if (slot->State == CatalogState::Deleted)
+    m_Header->Tombstones--;
+  Store(slot, value);
+  if (isNew) {
+    m_Header->Count++;
+    UpdateHeader();
+  }
+}
+
+bool CacheCatalog::Lookup(PCWSTR name, CatalogEntry *entry, UINT64 hash) {
+  if (!hash)
+    hash = HashName(name);
+  {
+    std::shared_lock<std::shared_mutex> lock(m_Lock);
+    if (!m_Header)
+      return false;
+    CatalogEntry *slot = FindSlot(name, hash, false);
+    if (!slot)
+      return false;
+    if (slot->EntryCrc == EntryChecksum(*slot)) {
+      *entry = *slot;
+      return true;
+    }
+  }
+
+  // Damaged slot (torn write before a crash): drop it so the caller falls
+  // back to the filesystem and re-adopts the file. Check again under the
+  // exclusive lock, since a Commit may have rewritten it in between.
+  std::unique_lock<std::shared_mutex> lock(m_Lock);
+  if (!m_Header)
+    return false;
+  CatalogEntry *slot = FindSlot(name, hash, false);
+  if (slot && slot->EntryCrc != EntryChecksum(*slot))
+    Tombstone(slot);
+  return false;
+}
+
+void CacheCatalog::Touch(PCWSTR name, UINT64 hash) {
+  // Every cached open touches, so this takes the shared lock like Lookup:
+  // the slot cannot move or be rewritten under it. The store is a single
+  // aligned 64-bit write, so a concurrent touch or a reader copying the
+  // entry never sees half of one.
+  std::shared_lock<std::shared_mutex> lock(m_Lock);
+  if (!m_Header)
+    return;
+  CatalogEntry *slot = FindSlot(name, hash ? hash : HashName(name), false);
+  if (slot)
+    InterlockedExchange64((volatile LONG64 *)&slot->LastAccess,
+                          (LONG64)NowFileTime());
+}
+
+void CacheCatalog::MarkDownloading(PCWSTR name) {
+  CatalogEntry value = {};
+  if (!CopyField(value.Name, name))
+    return;
+  value.Hash = HashName(name);
+  value.State = CatalogState::Downloading;
+  value.LastAccess = NowFileTime();
+
+  std::unique_lock<std::shared_mutex> lock(m_Lock);
+  Insert(value);
+}
+
+void CacheCatalog::Commit(PCWSTR name, const DownloadInfo &info) {
+  CatalogEntry value = {};
+  if (!CopyField(value.Name, name))
+    return;
+  value.Hash = HashName(name);
+  value.State = CatalogState::Complete;
+  value.Crc32 = info.Crc32;
+  value.Size = info.Validator.Size;
+  // An oversized validator is useless for revalidation; store none.
+  if (!CopyField(value.ETag, info.Validator.ETag))
+    memset(value.ETag, 0, sizeof(value.ETag));
+  if (!CopyField(value.LastModified, info.Validator.LastModified))
+    memset(value.LastModified, 0, sizeof(value.LastModified));
+  value.LastAccess = NowFileTime();
+
+  std::unique_lock<std::shared_mutex> lock(m_Lock);
+  Insert(value);
+}
+
+void CacheCatalog::Remove(PCWSTR name) {
+  std::unique_lock<std::shared_mutex> lock(m_Lock);
+  if (!m_Header)
+    return;
+  CatalogEntry *slot = FindSlot(name, HashName(name), false);
+  if (slot)
+    Tombstone(slot);
+}
+
+void CacheCatalog::Tombstone(CatalogEntry *slot) {
+  CatalogEntry value = *slot;
+  value.State = CatalogState::Deleted;
+  Store(slot, value);
+  m_Header->Count--;
+  m_Header->Tombstones++;
+  UpdateHeader();
+}
+
+void CacheCatalog::ForEach(
+    const std::function<void(const CatalogEntry &)> &fn) {
+  std::shared_lock<std::shared_mutex> lock(m_Lock);
+  if (!m_Header)
+    return;
+  CatalogEntry *entries = Entries();
+  for (UINT32 i = 0; i < m_Header->Capacity; ++i) {
+    const CatalogEntry &e = entries[i];
+    if (e.Hash != 0 && e.State == CatalogState::Complete &&
+        e.EntryCrc == EntryChecksum(e))
+      fn(e);
+  }
+}
+
+bool CacheCatalog::IsOpen() {
+  std::shared_lock<std::shared_mutex> lock(m_Lock);
+  return m_Header != nullptr;
+}
+
+UINT32 CacheCatalog::Count() {
+  std::shared_lock<std::shared_mutex> lock(m_Lock);
+  return m_Header ? m_Header->Count : 0;
+}
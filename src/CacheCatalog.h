@@ -0,0 +1,93 @@
+#pragma once
+#include "Downloader.h"
+#include <cwctype>
+#include <functional>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+#include <windows.h>
+
+enum class CatalogState : UINT32 {
+  Empty = 0,
+  Downloading = 1,
+  Complete = 2,
+  Deleted = 3, // tombstone, keeps probe chains intact
+};
+
+// One fixed-size slot of the on-disk catalog. The layout is the file format,
+// so only append fields at the end and bump kCatalogVersion.
+struct CatalogEntry {
+  UINT64 Hash;       // case-folded name hash, 0 for never-used slots
+  CatalogState State;
+  UINT32 Crc32;      // CRC-32 of the archive contents, 0 if unknown
+  UINT64 Size;
+  WCHAR Name[64];    // virtual path, e.g. \pacman.zip
+  WCHAR ETag[48];
+  WCHAR LastModified[32];
+  UINT32 EntryCrc;   // covers every field above
+  UINT32 Reserved;
+  UINT64 LastAccess; // FILETIME; not covered so touches stay cheap
+};
+
+// Persistent catalog of cached archives, kept in <cache>\mcr.catalog as a
+// memory-mapped open-addressing hash table so SOpen can answer "is it cached"
+// without touching the filesystem.
+class CacheCatalog {
+public:
+  ~CacheCatalog();
+
+  // Maps the catalog, rebuilding it from a directory scan if it is missing
+  // or its header is corrupt. `sharded` selects the CacheLayout to scan.
+  // Fails without rebuilding if another mcr has it open; see InUse.
+  bool Open(const std::wstring &cacheDir, bool sharded = false);
+  void Close();
+  // Whether the last Open failed because another process holds the file.
+  bool InUse() const { return m_InUse; }
+  bool IsOpen();
+
+  // `hash` may be passed in when the caller already has HashName(name).
+  bool Lookup(PCWSTR name, CatalogEntry *entry, UINT64 hash = 0);
+  void Touch(PCWSTR name, UINT64 hash = 0);
+  void MarkDownloading(PCWSTR name);
+  void Commit(PCWSTR name, const DownloadInfo &info);
+  void Remove(PCWSTR name);
+  void ForEach(const std::function<void(const CatalogEntry &)> &fn);
+  UINT32 Count();
+  // Lists the archives in the cache directory given to the last Open,
+  // whether or not it succeeded. This is what a rebuild starts from, and
+  // the way to list the cache without a catalog.
+  void Scan(std::vector<CatalogEntry> &entries);
+
+  static UINT64 HashName(PCWSTR name);
+  // HashName one character at a time, for callers hashing as they scan:
+  // start from kHashSeed, and map a final 0 to 1 as HashName does.
+  static const UINT64 kHashSeed = 14695981039346656037ull;
+  static UINT64 HashStep(UINT64 hash, WCHAR c) {
+    return (hash ^ (UINT64)towlower(c)) * 1099511628211ull;
+  }
+
+private:
+  struct Header;
+
+  bool Map(const std::wstring &path, UINT32 capacity, bool create);
+  void Unmap();
+  bool Recreate(const std::vector<CatalogEntry> &entries);
+  void Insert(const CatalogEntry &value);
+  CatalogEntry *FindSlot(PCWSTR name, UINT64 hash, bool forInsert);
+  CatalogEntry *Entries() const;
+  void Store(CatalogEntry *slot, const CatalogEntry &value);
+  void Tombstone(CatalogEntry *slot);
+  void UpdateHeader();
+
+  static UINT32 EntryChecksum(const CatalogEntry &entry);
+  static UINT32 HeaderChecksum(const Header &header);
+
+  std::shared_mutex m_Lock;
+  std::wstring m_CacheDir;
+  std::wstring m_Path;
+  bool m_Sharded = false;
+  bool m_InUse = false;
+  HANDLE m_File = INVALID_HANDLE_VALUE;
+  HANDLE m_Mapping = NULL;
+  Header *m_Header = nullptr;
+};
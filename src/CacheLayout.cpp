@@ -0,0 +1,183 @@
+#include "CacheLayout.h"
+#include "CacheCatalog.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cwctype>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+static const wchar_t kLayoutFile[] = L"\\mcr.layout";
+static const char kShardedTag[] = "sharded\n";
+
+static bool EndsWith(const std::wstring &s, const wchar_t *suffix) {
+  size_t n = wcslen(suffix);
+  return s.size() > n && _wcsicmp(s.c_str() + s.size() - n, suffix) == 0;
+}
+
+bool CacheLayout::IsSharded(const std::wstring &cacheDir) {
+  HANDLE h = CreateFileW((cacheDir + kLayoutFile).c_str(), GENERIC_READ,
+                         FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL, NULL);
+  if (h == INVALID_HANDLE_VALUE)
+    return false;
+  char tag[sizeof(kShardedTag)] = {0};
+  DWORD got = 0;
+  bool sharded = ReadFile(h, tag, sizeof(tag) - 1, &got, NULL) &&
+                 memcmp(tag, kShardedTag, sizeof(kShardedTag) - 1) == 0;
+  CloseHandle(h);
+  return sharded;
+}
+
+std::wstring CacheLayout::ShardDir(UINT32 index) {
+  static const wchar_t kHex[] = L"0123456789abcdef";
+  wchar_t dir[6] = {L'\\', kHex[(index >> 8) & 0xF], L'\\',
+                    kHex[(index >> 4) & 0xF], kHex[index & 0xF], 0};
+  return dir;
+}
+
+std::wstring CacheLayout::ShardDir(PCWSTR name) {
+  if (name[0] != L'\\' || wcschr(name + 1, L'\\'))
+    return L"";
+  // Top bits, so the catalog's probe order (low bits) stays independent.
+  return ShardDir((UINT32)(CacheCatalog::HashName(name) >> 52) %
+                  kShardCount);
+}
+
+static bool IsHexName(const std::wstring &path, size_t begin, size_t end) {
+  if (begin >= end)
+    return false;
+  for (size_t i = begin; i < end; ++i)
+    if (!iswxdigit(path[i]))
+      return false;
+  return true;
+}
+
+bool CacheLayout::IsLayoutDir(const std::wstring &dir) {
+  std::wstring path = dir;
+  while (!path.empty() && (path.back() == L'\\' || path.back() == L'/'))
+    path.pop_back();
+  if (GetFileAttributesW((path + kLayoutFile).c_str()) !=
+          INVALID_FILE_ATTRIBUTES ||
+      GetFileAttributesW((path + L"\\mcr.catalog").c_str()) !=
+          INVALID_FILE_ATTRIBUTES)
+    return true;
+
+  // <cache>\7\3f: a two-digit shard below a one-digit one.
+  size_t inner = path.find_last_of(L"\\/");
+  if (inner == std::wstring::npos || path.size() - inner - 1 != 2 ||
+      !IsHexName(path, inner + 1, path.size()))
+    return false;
+  size_t outer = path.find_last_of(L"\\/", inner - 1);
+  if (outer == std::wstring::npos || inner - outer - 1 != 1 ||
+      !IsHexName(path, outer + 1, inner))
+    return false;
+  return IsSharded(path.substr(0, outer));
+}
+
+// Archive a root-level file belongs to: the archive itself, or one of its
+// in-progress download files, which have to move with it.
+bool CacheLayout::ArchiveFor(const std::wstring &fileName,
+                             std::wstring &archive) {
+  static const wchar_t *kSuffixes[] = {L".part.journal.tmp", L".part.journal",
+                                       L".part"};
+  archive = fileName;
+  for (const wchar_t *suffix : kSuffixes) {
+    if (EndsWith(archive, suffix)) {
+      archive.resize(archive.size() - wcslen(suffix));
+      break;
+    }
+  }
+  return EndsWith(archive, L".zip") || EndsWith(archive, L".7z");
+}
+
+bool CacheLayout::MigrateToShards(const std::wstring &cacheDir,
+                                  UINT32 workers) {
+  auto start = std::chrono::steady_clock::now();
+  for (UINT32 i = 0; i < kShardCount; ++i) {
+    std::wstring dir = cacheDir + ShardDir(i);
+    if (i % 256 == 0)
+      CreateDirectoryW(dir.substr(0, dir.size() - 3).c_str(), NULL);
+    if (!CreateDirectoryW(dir.c_str(), NULL) &&
+        GetLastError() != ERROR_ALREADY_EXISTS) {
+      std::wcerr << L"Cannot create shard directory " << dir << L": "
+                 << GetLastError() << std::endl;
+      return false;
+    }
+  }
+
+  std::vector<std::wstring> files;
+  std::vector<std::wstring> dirs;
+  WIN32_FIND_DATAW fd;
+  HANDLE h = FindFirstFileExW((cacheDir + L"\\*").c_str(), FindExInfoBasic,
+                              &fd, FindExSearchNameMatch, NULL,
+                              FIND_FIRST_EX_LARGE_FETCH);
+  if (h != INVALID_HANDLE_VALUE) {
+    do {
+      std::wstring name = fd.cFileName;
+      if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        files.push_back(name);
+      else if (name.size() > 1 && name != L"..")
+        dirs.push_back(name); // shard names are a single character
+    } while (FindNextFileW(h, &fd));
+    FindClose(h);
+  }
+
+  std::atomic<size_t> next(0), moved(0), failed(0);
+  workers = (std::max)(1u, workers);
+  std::vector<std::thread> threads;
+  for (UINT32 w = 0; w < workers; ++w) {
+    threads.emplace_back([&]() {
+      for (size_t k = next++; k < files.size(); k = next++) {
+        std::wstring archive;
+        if (!ArchiveFor(files[k], archive))
+          continue;
+        std::wstring from = cacheDir + L"\\" + files[k];
+        std::wstring to = cacheDir + ShardDir((L"\\" + archive).c_str()) +
+                          L"\\" + files[k];
+        if (MoveFileExW(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+          moved++;
+        } else {
+          failed++;
+          std::wcerr << L"Cannot move " << from << L": " << GetLastError()
+                     << std::endl;
+        }
+      }
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+
+  // Per-set directories were only ever created empty by directory probes;
+  // anything a user put in one is left alone.
+  size_t removed = 0;
+  for (const auto &dir : dirs)
+    if (RemoveDirectoryW((cacheDir + L"\\" + dir).c_str()))
+      removed++;
+
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  std::wcout << L"Sharded cache layout: moved " << moved.load()
+             << L" files, removed "
+             << removed << L" empty directories in " << ms << L" ms"
+             << std::endl;
+  if (failed > 0) {
+    std::wcerr << failed.load()
+               << L" files could not be moved; run again to retry."
+               << std::endl;
+    return false;
+  }
+
+  h = CreateFileW((cacheDir + kLayoutFile).c_str(), GENERIC_WRITE, 0, NULL,
+                  CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (h == INVALID_HANDLE_VALUE)
+    return false;
+  DWORD written = 0;
+  bool ok = WriteFile(h, kShardedTag, sizeof(kShardedTag) - 1, &written,
+                      NULL) &&
+            written == sizeof(kShardedTag) - 1;
+  CloseHandle(h);
+  return ok;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <string>
+#include <windows.h>
+
+// Where cached archives live under the cache directory. The flat layout
+// mirrors the virtual namespace. The sharded one hashes each top-level
+// archive into one of 16 x 256 subdirectories (\7\3f\pacman.zip) so no
+// directory grows past a few dozen entries; it is recorded in mcr.layout
+// and picked up automatically from then on.
+class CacheLayout {
+public:
+  static const UINT32 kShardCount = 16 * 256;
+
+  static bool IsSharded(const std::wstring &cacheDir);
+  // Moves a flat cache over to the sharded layout using `workers` threads
+  // and records it. Safe to rerun after an interruption.
+  static bool MigrateToShards(const std::wstring &cacheDir, UINT32 workers);
+
+  // Shard directory for a virtual name, e.g. L"\\7\\3f", or empty for names
+  // that stay where they are (anything below the root).
+  static std::wstring ShardDir(PCWSTR name);
+  // Shard directory number `index`, below kShardCount.
+  static std::wstring ShardDir(UINT32 index);
+  // Whether `dir` is a cache directory or one of its shard directories,
+  // which stay even when empty and may be shared with other downloads.
+  static bool IsLayoutDir(const std::wstring &dir);
+
+private:
+  static bool ArchiveFor(const std::wstring &fileName, std::wstring &archive);
+};
@@ -0,0 +1,457 @@
+// winsock2.h must come before windows.h, which CacheServer.h pulls in.
+#include <winsock2.h>
+#include <mswsock.h>
+
+#include "CacheServer.h"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "mswsock.lib")
+
+static const size_t kMaxHeaderBytes = 16 * 1024;
+// Idle keep-alive connections are dropped after this long.
+static const DWORD kIdleTimeoutMs = 30 * 1000;
+// TransmitFile sends at most 2 GB - 2 per call.
+static const UINT64 kMaxTransmitChunk = 1024 * 1024 * 1024;
+
+static std::string Lower(std::string s) {
+  for (auto &c : s)
+    c = (char)tolower((unsigned char)c);
+  return s;
+}
+
+static std::string TrimSpaces(const std::string &s) {
+  size_t begin = s.find_first_not_of(" \t");
+  if (begin == std::string::npos)
+    return "";
+  size_t end = s.find_last_not_of(" \t");
+  return s.substr(begin, end - begin + 1);
+}
+
+static bool ParseNumber(const std::string &s, UINT64 &value) {
+  if (s.empty() || s.find_first_not_of("0123456789") != std::string::npos)
+    return false;
+  value = std::strtoull(s.c_str(), nullptr, 10);
+  return true;
+}
+
+int CacheServer::ParseRange(const std::string &spec, UINT64 size,
+                            UINT64 &first, UINT64 &length) {
+  if (Lower(spec).rfind("bytes=", 0) != 0)
+    return 0;
+  std::string range = spec.substr(6);
+  if (range.find(',') != std::string::npos)
+    return 0; // multiple ranges: the whole file is a valid answer
+  size_t dash = range.find('-');
+  if (dash == std::string::npos)
+    return 0;
+  std::string from = TrimSpaces(range.substr(0, dash));
+  std::string to = TrimSpaces(range.substr(dash + 1));
+
+  UINT64 a = 0, b = 0;
+  if (from.empty()) {
+    // Suffix range: the last b bytes.
+    if (!ParseNumber(to, b))
+      return 0;
+    if (b == 0 || size == 0)
+      return -1;
+    length = (std::min)(b, size);
+    first = size - length;
+    return 1;
+  }
+  if (!ParseNumber(from, a) || (!to.empty() && !ParseNumber(to, b)))
+    return 0;
+  if (a >= size)
+    return -1;
+  UINT64 last = to.empty() ? size - 1 : (std::min)(b, size - 1);
+  if (last < a)
+    return 0;
+  first = a;
+  length = last - a + 1;
+  return 1;
+}
+
+static std::string HttpDate(const FILETIME &ft) {
+  static const char *kDays[] = {"Sun", "Mon", "Tue", "Wed",
+                                "Thu", "Fri", "Sat"};
+  static const char *kMonths[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  SYSTEMTIME st;
+  if (!FileTimeToSystemTime(&ft, &st))
+    return "";
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%s, %02u %s %04u %02u:%02u:%02u GMT",
+           kDays[st.wDayOfWeek % 7], st.wDay, kMonths[(st.wMonth + 11) % 12],
+           st.wYear, st.wHour, st.wMinute, st.wSecond);
+  return buffer;
+}
+
+// A response without a body.
+static std::string EmptyResponse(const char *status, bool keepAlive,
+                                 const std::string &extra = "") {
+  return std::string("HTTP/1.1 ") + status + "\r\n" + extra +
+         "Content-Length: 0\r\nConnection: " +
+         (keepAlive ? "keep-alive" : "close") + "\r\n\r\n";
+}
+
+void CacheServer::Attach(PathResolver localPath, FillHandler fill,
+                         HitHandler onHit) {
+  m_LocalPath = localPath;
+  m_Fill = fill;
+  m_OnHit = onHit;
+}
+
+bool CacheServer::Start(UINT16 port) {
+  WSADATA wsa;
+  if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+    std::wcerr << L"WSAStartup failed." << std::endl;
+    return false;
+  }
+
+  SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listener == INVALID_SOCKET) {
+    std::wcerr << L"Cache server socket failed: " << WSAGetLastError()
+               << std::endl;
+    return false;
+  }
+  BOOL exclusive = TRUE;
+  setsockopt(listener, SOL_SOCKET, SO_EXCLUSIVEADDRUSE,
+             (const char *)&exclusive, sizeof(exclusive));
+
+  sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(listener, (sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+      listen(listener, SOMAXCONN) == SOCKET_ERROR) {
+    std::wcerr << L"Cache server cannot listen on port " << port << L": "
+               << WSAGetLastError() << std::endl;
+    closesocket(listener);
+    return false;
+  }
+
+  int addrLength = sizeof(addr);
+  if (getsockname(listener, (sockaddr *)&addr, &addrLength) == 0)
+    port = ntohs(addr.sin_port);
+  m_Listener = listener;
+  m_Port = port;
+  std::thread(&CacheServer::AcceptLoop, this).detach();
+  std::wcout << L"Serving the cache on port " << port
+             << L"; other instances can use -u http://<this host>:" << port
+             << L"/" << std::endl;
+  return true;
+}
+
+void CacheServer::AcceptLoop() {
+  while (true) {
+    SOCKET client = accept((SOCKET)m_Listener, NULL, NULL);
+    if (client == INVALID_SOCKET) {
+      std::wcerr << L"Cache server accept failed: " << WSAGetLastError()
+                 << std::endl;
+      Sleep(100);
+      continue;
+    }
+    // A thread per connection is plenty for a LAN of cabinets, and clients
+    // keep their connections alive across requests.
+    std::thread(&CacheServer::HandleConnection, this, (UINT_PTR)client)
+        .detach();
+  }
+}
+
+void CacheServer::HandleConnection(UINT_PTR sock) {
+  DWORD timeout = kIdleTimeoutMs;
+  setsockopt((SOCKET)sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout,
+             sizeof(timeout));
+  BOOL noDelay = TRUE;
+  setsockopt((SOCKET)sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&noDelay,
+             sizeof(noDelay));
+
+  std::string buffer;
+  Request request;
+  while (ReadRequest(sock, buffer, request)) {
+    if (++m_Requests % 100 == 0)
+      LogStats();
+    if (!Serve(sock, request) || !request.KeepAlive)
+      break;
+  }
+  closesocket((SOCKET)sock);
+}
+
+bool CacheServer::ReadRequest(UINT_PTR sock, std::string &buffer,
+                              Request &request) {
+  size_t end;
+  while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+    if (buffer.size() > kMaxHeaderBytes)
+      return false;
+    char chunk[4096];
+    int got = recv((SOCKET)sock, chunk, sizeof(chunk), 0);
+    if (got <= 0)
+      return false;
+    buffer.append(chunk, got);
+  }
+  std::string head = buffer.substr(0, end);
+  buffer.erase(0, end + 4);
+
+  request = Request();
+  size_t lineEnd = head.find("\r\n");
+  std::string line = head.substr(0, lineEnd);
+  size_t first = line.find(' ');
+  size_t last = line.rfind(' ');
+  if (first == std::string::npos || last == first)
+    return false;
+  request.Method = line.substr(0, first);
+  request.Target = line.substr(first + 1, last - first - 1);
+  request.KeepAlive = line.substr(last + 1) != "HTTP/1.0";
+
+  size_t pos = (lineEnd == std::string::npos) ? head.size() : lineEnd + 2;
+  while (pos < head.size()) {
+    size_t next = head.find("\r\n", pos);
+    if (next == std::string::npos)
+      next = head.size();
+    std::string field = head.substr(pos, next - pos);
+    pos = next + 2;
+
+    size_t colon = field.find(':');
+    if (colon == std::string::npos)
+      continue;
+    std::string name = Lower(TrimSpaces(field.substr(0, colon)));
+    std::string value = TrimSpaces(field.substr(colon + 1));
+    if (name == "range")
+      request.Range = value;
+    else if (name == "if-range")
+      request.IfRange = value;
+    else if (name == "if-none-match")
+      request.IfNoneMatch = value;
+    else if (name == "if-modified-since")
+      request.IfModifiedSince = value;
+    else if (name == "connection" && Lower(value) == "close")
+      request.KeepAlive = false;
+    else if (name == "connection" && Lower(value) == "keep-alive")
+      request.KeepAlive = true;
+  }
+  return true;
+}
+
+bool CacheServer::MapTarget(const std::string &target, std::wstring &name) {
+  std::string path = target.substr(0, target.find('?'));
+  std::string decoded;
+  for (size_t i = 0; i < path.size(); ++i) {
+    if (path[i] == '%' && i + 2 < path.size() &&
+        isxdigit((unsigned char)path[i + 1]) &&
+        isxdigit((unsigned char)path[i + 2])) {
+      decoded += (char)std::strtol(path.substr(i + 1, 2).c_str(), nullptr, 16);
+      i += 2;
+    } else {
+      decoded += path[i];
+    }
+  }
+
+  // Same layout GetRemoteUrl builds: .zip under split/, .7z under
+  // standalone/.
+  std::string rel;
+  const char *ext;
+  if (decoded.rfind("/split/", 0) == 0) {
+    rel = decoded.substr(6);
+    ext = ".zip";
+  } else if (decoded.rfind("/standalone/", 0) == 0) {
+    rel = decoded.substr(11);
+    ext = ".7z";
+  } else {
+    return false;
+  }
+  size_t extLength = strlen(ext);
+  if (rel.size() <= extLength + 1 ||
+      Lower(rel.substr(rel.size() - extLength)) != ext)
+    return false;
+  // Nothing that could step outside the cache directory.
+  if (rel.find("..") != std::string::npos ||
+      rel.find("//") != std::string::npos ||
+      rel.find_first_of(std::string("\\:*?\"<>|\0", 10)) != std::string::npos)
+    return false;
+
+  int length =
+      MultiByteToWideChar(CP_UTF8, 0, rel.c_str(), (int)rel.size(), NULL, 0);
+  if (length <= 0)
+    return false;
+  name.assign(length, L'\0');
+  MultiByteToWideChar(CP_UTF8, 0, rel.c_str(), (int)rel.size(), &name[0],
+                      length);
+  for (auto &c : name)
+    if (c == L'/')
+      c = L'\\';
+  return true;
+}
+
+bool CacheServer::Fill(const std::wstring &name) {
+  m_Fills++;
+  std::wcout << L"Cache server miss, filling from upstream: " << name
+             << std::endl;
+  bool ok = m_Fill && m_Fill(name);
+  LogStats();
+  return ok;
+}
+
+bool CacheServer::Serve(UINT_PTR sock, const Request &request) {
+  bool headOnly = request.Method == "HEAD";
+  if (!headOnly && request.Method != "GET") {
+    SendAll(sock, EmptyResponse("405 Method Not Allowed", false,
+                                "Allow: GET, HEAD\r\n"));
+    return false;
+  }
+
+  std::wstring name;
+  if (!MapTarget(request.Target, name))
+    return SendAll(sock, EmptyResponse("404 Not Found", request.KeepAlive));
+
+  std::wstring localPath = m_LocalPath(name);
+  if (GetFileAttributesW(localPath.c_str()) != INVALID_FILE_ATTRIBUTES) {
+    m_Hits++;
+    if (m_OnHit)
+      m_OnHit(name);
+  } else if (!Fill(name)) {
+    return SendAll(sock, EmptyResponse("404 Not Found", request.KeepAlive));
+  }
+
+  // Share delete so a revalidated copy can still be swapped in underneath.
+  HANDLE hFile =
+      CreateFileW(localPath.c_str(), GENERIC_READ,
+                  FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                  OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+    return SendAll(sock, EmptyResponse("404 Not Found", request.KeepAlive));
+
+  BY_HANDLE_FILE_INFORMATION info;
+  if (!GetFileInformationByHandle(hFile, &info) ||
+      (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+    CloseHandle(hFile);
+    return SendAll(sock, EmptyResponse("404 Not Found", request.KeepAlive));
+  }
+  UINT64 size = ((UINT64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+  UINT64 mtime = ((UINT64)info.ftLastWriteTime.dwHighDateTime << 32) |
+                 info.ftLastWriteTime.dwLowDateTime;
+
+  // Size and mtime change whenever a new copy is swapped in, so together
+  // they make a strong validator for If-Range and revalidation.
+  char etagBuffer[64];
+  snprintf(etagBuffer, sizeof(etagBuffer), "\"%llx-%llx\"",
+           (unsigned long long)size, (unsigned long long)mtime);
+  std::string etag = etagBuffer;
+  std::string lastModified = HttpDate(info.ftLastWriteTime);
+  std::string validators =
+      "ETag: " + etag + "\r\nLast-Modified: " + lastModified + "\r\n";
+  const char *connection = request.KeepAlive ? "Connection: keep-alive\r\n"
+                                             : "Connection: close\r\n";
+
+  bool notModified =
+      !request.IfNoneMatch.empty()
+          ? (request.IfNoneMatch == "*" ||
+             request.IfNoneMatch.find(etag) != std::string::npos)
+          : request.IfModifiedSince == lastModified;
+  if (notModified) {
+    CloseHandle(hFile);
+    return SendAll(sock, "HTTP/1.1 304 Not Modified\r\n" + validators +
+                             connection + "\r\n");
+  }
+
+  UINT64 first = 0;
+  UINT64 length = size;
+  bool partial = false;
+  if (!request.Range.empty() &&
+      (request.IfRange.empty() || request.IfRange == etag ||
+       request.IfRange == lastModified)) {
+    int result = ParseRange(request.Range, size, first, length);
+    if (result < 0) {
+      CloseHandle(hFile);
+      return SendAll(sock, EmptyResponse("416 Range Not Satisfiable",
+                                         request.KeepAlive,
+                                         "Content-Range: bytes */" +
+                                             std::to_string(size) + "\r\n"));
+    }
+    partial = result > 0;
+    if (!partial) {
+      first = 0;
+      length = size;
+    }
+  }
+
+  std::string head = std::string("HTTP/1.1 ") +
+                     (partial ? "206 Partial Content" : "200 OK") + "\r\n" +
+                     "Content-Type: application/octet-stream\r\n"
+                     "Accept-Ranges: bytes\r\n" +
+                     validators + "Content-Length: " + std::to_string(length) +
+                     "\r\n";
+  if (partial)
+    head += "Content-Range: bytes " + std::to_string(first) + "-" +
+            std::to_string(first + length - 1) + "/" + std::to_string(size) +
+            "\r\n";
+  head += std::string(connection) + "\r\n";
+
+  bool ok = headOnly ? SendAll(sock, head)
+                     : SendFile(sock, hFile, head, first, length);
+  CloseHandle(hFile);
+  if (ok && !headOnly)
+    m_BytesSent += length;
+  return ok;
+}
+
+bool CacheServer::SendFile(UINT_PTR sock, HANDLE hFile,
+                           const std::string &head, UINT64 offset,
+                           UINT64 length) {
+  // A zero byte count means "the whole file" to TransmitFile.
+  if (length == 0)
+    return SendAll(sock, head);
+
+  // TransmitFile sends from the system file cache without copying through
+  // user mode. Client editions of Windows run two at a time and queue the
+  // rest, which is still fine for a handful of cabinets.
+  WSAEVENT event = WSACreateEvent();
+  TRANSMIT_FILE_BUFFERS buffers = {0};
+  buffers.Head = (PVOID)head.data();
+  buffers.HeadLength = (DWORD)head.size();
+
+  bool ok = true;
+  bool first = true;
+  while (ok && length > 0) {
+    DWORD chunk = (DWORD)(std::min)(length, kMaxTransmitChunk);
+    OVERLAPPED ov = {0};
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    ov.hEvent = event;
+    WSAResetEvent(event);
+    if (!TransmitFile((SOCKET)sock, hFile, chunk, 0, &ov,
+                      first ? &buffers : NULL, 0)) {
+      DWORD sent = 0, flags = 0;
+      ok = WSAGetLastError() == WSA_IO_PENDING &&
+           WSAGetOverlappedResult((SOCKET)sock, &ov, &sent, TRUE, &flags);
+    }
+    offset += chunk;
+    length -= chunk;
+    first = false;
+  }
+  WSACloseEvent(event);
+  return ok;
+}
+
+bool CacheServer::SendAll(UINT_PTR sock, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    int n = send((SOCKET)sock, data.data() + sent, (int)(data.size() - sent),
+                 0);
+    if (n <= 0)
+      return false;
+    sent += n;
+  }
+  return true;
+}
+
+void CacheServer::LogStats() {
+  UINT64 hits = m_Hits;
+  UINT64 misses = m_Fills;
+  UINT64 ratio = (hits + misses) ? hits * 100 / (hits + misses) : 0;
+  std::wcout << L"Cache server: " << m_Requests << L" requests, " << ratio
+             << L"% hits, " << m_Fills << L" upstream fills, "
+             << m_BytesSent / (1024 * 1024) << L" MB sent" << std::endl;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <string>
+#include <windows.h>
+
+// Embedded HTTP server exposing the cache in the origin's layout
+// (/split/<set>.zip, /standalone/<set>.7z), so other instances on the LAN
+// can use this one as their -u base URL. Misses are filled from our own
+// upstream; Downloader makes concurrent requests for the same file, ours or
+// a local open's, share one download.
+class CacheServer {
+public:
+  using PathResolver = std::function<std::wstring(const std::wstring &)>;
+  using FillHandler = std::function<bool(const std::wstring &)>;
+  using HitHandler = std::function<void(const std::wstring &)>;
+
+  void Attach(PathResolver localPath, FillHandler fill, HitHandler onHit);
+  // Listens on all interfaces and serves from a background thread. Port 0
+  // takes any free port; Port() then tells which.
+  bool Start(UINT16 port);
+  UINT16 Port() const { return m_Port; }
+
+  // Counters since Start, as the periodic stats line reports them. A hit is
+  // a request for a file already cached, a fill one that went upstream.
+  UINT64 Requests() const { return m_Requests; }
+  UINT64 Hits() const { return m_Hits; }
+  UINT64 Fills() const { return m_Fills; }
+  UINT64 BytesSent() const { return m_BytesSent; } // response bodies
+
+  // Request parsing, public so it can be checked on its own.
+  // Parses a single "bytes=" range against `size`. Returns 1 for a usable
+  // range, 0 to ignore the header and send everything, -1 if unsatisfiable.
+  static int ParseRange(const std::string &spec, UINT64 size, UINT64 &first,
+                        UINT64 &length);
+  // Maps a target in the origin's layout to a cache name like \pacman.zip.
+  // Rejects other targets and any that could leave the cache directory.
+  static bool MapTarget(const std::string &target, std::wstring &name);
+
+private:
+  struct Request {
+    std::string Method;
+    std::string Target;
+    std::string Range;
+    std::string IfRange;
+    std::string IfNoneMatch;
+    std::string IfModifiedSince;
+    bool KeepAlive = true;
+  };
+
+  // Sockets are kept as UINT_PTR so this header doesn't need winsock2.h,
+  // which has to be included before windows.h.
+  void AcceptLoop();
+  void HandleConnection(UINT_PTR sock);
+  bool Serve(UINT_PTR sock, const Request &request);
+  bool SendFile(UINT_PTR sock, HANDLE hFile, const std::string &head,
+                UINT64 offset, UINT64 length);
+  bool Fill(const std::wstring &name);
+  void LogStats();
+
+  static bool ReadRequest(UINT_PTR sock, std::string &buffer,
+                          Request &request);
+  static bool SendAll(UINT_PTR sock, const std::string &data);
+
+  PathResolver m_LocalPath;
+  FillHandler m_Fill;
+  HitHandler m_OnHit;
+  UINT_PTR m_Listener = 0;
+  UINT16 m_Port = 0;
+
+  std::atomic<UINT64> m_Requests{0};
+  std::atomic<UINT64> m_Hits{0};
+  std::atomic<UINT64> m_Fills{0};
+  std::atomic<UINT64> m_BytesSent{0};
+};
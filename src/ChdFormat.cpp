@@ -0,0 +1,117 @@
+#include "ChdFormat.h"
+#include <cstring>
+
+static const UINT32 kHunksMagic = 0x4B4E4848; // "HHNK"
+
+// Layout of a .hunks file; the bitmap follows it.
+struct HunksHeader {
+  UINT32 Magic;
+  UINT32 BlockSize;
+  UINT64 Size;
+  WCHAR ETag[ChdFormat::kMaxETag + 1];
+  WCHAR LastModified[ChdFormat::kMaxLastModified + 1];
+};
+
+static UINT32 ReadBE32(const BYTE *p) {
+  return ((UINT32)p[0] << 24) | ((UINT32)p[1] << 16) | ((UINT32)p[2] << 8) |
+         p[3];
+}
+
+static UINT64 ReadBE64(const BYTE *p) {
+  return ((UINT64)ReadBE32(p) << 32) | ReadBE32(p + 4);
+}
+
+template <size_t N>
+static void CopyField(WCHAR (&dest)[N], const std::wstring &value) {
+  std::wstring clipped = value.substr(0, N - 1);
+  memset(dest, 0, sizeof(dest));
+  memcpy(dest, clipped.c_str(), clipped.size() * sizeof(WCHAR));
+}
+
+template <size_t N> static std::wstring ReadField(const WCHAR (&src)[N]) {
+  size_t length = 0;
+  while (length < N - 1 && src[length])
+    length++;
+  return std::wstring(src, length);
+}
+
+bool ChdFormat::ParseHeader(const BYTE *p, size_t size, Layout &layout) {
+  layout = Layout();
+  if (size < 16 || memcmp(p, "MComprHD", 8) != 0)
+    return false;
+  UINT32 length = ReadBE32(p + 8);
+  if (size < length)
+    return false;
+  layout.Version = ReadBE32(p + 12);
+
+  if (layout.Version == 5 && length >= 64) {
+    UINT64 logicalBytes = ReadBE64(p + 32);
+    layout.MapOffset = ReadBE64(p + 40);
+    layout.MetaOffset = ReadBE64(p + 48);
+    UINT32 hunkBytes = ReadBE32(p + 56);
+    if (ReadBE32(p + 16) == 0) {
+      // Uncompressed: four bytes per hunk.
+      layout.MapBytes =
+          hunkBytes ? (logicalBytes + hunkBytes - 1) / hunkBytes * 4 : 0;
+    } else {
+      // Compressed: the map's own header gives its length.
+      layout.MapLengthInMap = true;
+    }
+    return true;
+  }
+  if ((layout.Version == 3 || layout.Version == 4) && length >= 44) {
+    // The map follows the header, 16 bytes per hunk.
+    layout.MapOffset = length;
+    layout.MapBytes = (UINT64)ReadBE32(p + 24) * 16;
+    layout.MetaOffset = ReadBE64(p + 36);
+    return true;
+  }
+  return false;
+}
+
+UINT64 ChdFormat::CompressedMapBytes(const BYTE *mapHeader) {
+  // The compressed map length, plus the 16-byte map header itself.
+  return 16 + (UINT64)ReadBE32(mapHeader);
+}
+
+UINT64 ChdFormat::BitmapBytes(UINT64 size, UINT32 blockSize) {
+  if (blockSize == 0)
+    return 0;
+  UINT64 blocks = (size + blockSize - 1) / blockSize;
+  return (blocks + 7) / 8;
+}
+
+std::vector<BYTE> ChdFormat::EncodeHunks(const Hunks &hunks) {
+  HunksHeader header = {};
+  header.Magic = kHunksMagic;
+  header.BlockSize = hunks.BlockSize;
+  header.Size = hunks.Size;
+  CopyField(header.ETag, hunks.ETag);
+  CopyField(header.LastModified, hunks.LastModified);
+
+  std::vector<BYTE> data(sizeof(header));
+  memcpy(data.data(), &header, sizeof(header));
+  data.insert(data.end(), hunks.Bitmap.begin(), hunks.Bitmap.end());
+  return data;
+}
+
+bool ChdFormat::DecodeHunks(const std::vector<BYTE> &data, UINT32 blockSize,
+                            Hunks &hunks) {
+  HunksHeader header;
+  if (data.size() < sizeof(header))
+    return false;
+  memcpy(&header, data.data(), sizeof(header));
+  if (header.Magic != kHunksMagic || header.BlockSize != blockSize)
+    return false;
+  UINT64 bitmapBytes = BitmapBytes(header.Size, blockSize);
+  if (data.size() - sizeof(header) < bitmapBytes)
+    return false;
+
+  hunks.BlockSize = header.BlockSize;
+  hunks.Size = header.Size;
+  hunks.ETag = ReadField(header.ETag);
+  hunks.LastModified = ReadField(header.LastModified);
+  hunks.Bitmap.assign(data.begin() + sizeof(header),
+                      data.begin() + sizeof(header) + (size_t)bitmapBytes);
+  return true;
+}
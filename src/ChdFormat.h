@@ -0,0 +1,47 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <windows.h>
+
+// The file formats ChdStream reads and writes, kept free of I/O so they can
+// be checked on their own: the CHD header, which says where the hunk map and
+// metadata are, and the "<name>.hunks" presence bitmap.
+class ChdFormat {
+public:
+  // Where the parts of a CHD that MAME reads on open live.
+  struct Layout {
+    UINT32 Version = 0; // 0 unless a complete CHD header was found
+    UINT64 MapOffset = 0;
+    UINT64 MapBytes = 0;
+    // Compressed v5 maps give their length in their own header: read
+    // kMapHeaderBytes at MapOffset and pass them to CompressedMapBytes.
+    bool MapLengthInMap = false;
+    UINT64 MetaOffset = 0; // first metadata entry
+  };
+  static constexpr UINT32 kMapHeaderBytes = 4;
+  static constexpr UINT32 kMetaHeaderBytes = 16;
+
+  // Parses the header at the start of a v3, v4 or v5 CHD. Returns false for
+  // anything else, with Version set if only the version is unsupported.
+  static bool ParseHeader(const BYTE *data, size_t size, Layout &layout);
+  static UINT64 CompressedMapBytes(const BYTE *mapHeader);
+
+  // Longest validator strings a .hunks file keeps; longer ones are clipped.
+  static constexpr size_t kMaxETag = 47;
+  static constexpr size_t kMaxLastModified = 31;
+
+  // Contents of a .hunks file.
+  struct Hunks {
+    UINT32 BlockSize = 0;
+    UINT64 Size = 0; // of the remote file
+    std::wstring ETag;
+    std::wstring LastModified;
+    std::vector<BYTE> Bitmap; // one bit per block, set once it is on disk
+  };
+
+  static UINT64 BitmapBytes(UINT64 size, UINT32 blockSize);
+  static std::vector<BYTE> EncodeHunks(const Hunks &hunks);
+  // Fails unless `data` is a whole .hunks file written for `blockSize`.
+  static bool DecodeHunks(const std::vector<BYTE> &data, UINT32 blockSize,
+                          Hunks &hunks);
+};
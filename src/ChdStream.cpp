@@ -0,0 +1,375 @@
+#include "ChdStream.h"
+#include "ChdFormat.h"
+#include "Trace.h"
+#include <algorithm>
+#include <cwctype>
+#include <iostream>
+
+// Longest read-ahead on a sequential run, in blocks (8 MB).
+static const UINT64 kMaxReadAheadBlocks = 32;
+
+std::mutex ChdStream::m_OpenLock;
+std::condition_variable ChdStream::m_OpenDone;
+std::map<std::wstring, std::shared_ptr<ChdStream>> ChdStream::m_Streams;
+
+static bool ReadAt(HANDLE hFile, UINT64 offset, void *data, DWORD size) {
+  OVERLAPPED ov = {0};
+  ov.Offset = (DWORD)offset;
+  ov.OffsetHigh = (DWORD)(offset >> 32);
+  DWORD got = 0;
+  return ReadFile(hFile, data, size, &got, &ov) && got == size;
+}
+
+static bool WriteAt(HANDLE hFile, UINT64 offset, const void *data,
+                    DWORD size) {
+  OVERLAPPED ov = {0};
+  ov.Offset = (DWORD)offset;
+  ov.OffsetHigh = (DWORD)(offset >> 32);
+  DWORD written = 0;
+  return WriteFile(hFile, data, size, &written, &ov) && written == size;
+}
+
+// m_Streams key for a local path.
+static std::wstring StreamKey(const std::wstring &localPath) {
+  std::wstring key = localPath;
+  for (auto &c : key)
+    c = towlower(c);
+  return key;
+}
+
+std::shared_ptr<ChdStream> ChdStream::Open(const std::wstring &url,
+                                           const std::wstring &localPath) {
+  std::wstring key = StreamKey(localPath);
+
+  std::unique_lock<std::mutex> lock(m_OpenLock);
+  auto it = m_Streams.find(key);
+  if (it != m_Streams.end()) {
+    std::shared_ptr<ChdStream> stream = it->second;
+    m_OpenDone.wait(lock, [&] { return !stream->m_Loading; });
+    return stream->m_Loaded ? stream : nullptr;
+  }
+  std::shared_ptr<ChdStream> stream(new ChdStream(url, localPath));
+  m_Streams[key] = stream;
+  lock.unlock();
+
+  // Load goes to the network; other images open meanwhile.
+  bool loaded = stream->Load();
+
+  lock.lock();
+  stream->m_Loading = false;
+  stream->m_Loaded = loaded;
+  it = m_Streams.find(key);
+  if (!loaded && it != m_Streams.end() && it->second == stream)
+    m_Streams.erase(it);
+  lock.unlock();
+  m_OpenDone.notify_all();
+  return loaded ? stream : nullptr;
+}
+
+ChdStream::~ChdStream() {
+  if (m_File != INVALID_HANDLE_VALUE)
+    CloseHandle(m_File);
+}
+
+bool ChdStream::Load() {
+  bool resumed = LoadBitmap() && CreateLocalFile(false);
+  if (resumed && m_Missing == 0) {
+    std::wcout << L"CHD fully cached: " << m_LocalPath << std::endl;
+    return true;
+  }
+
+  // The first block holds the CHD header, and its response tells whether
+  // the remote is still the copy the bitmap describes.
+  HttpValidator validator;
+  std::string head;
+  if (!Downloader::FetchRanges(
+          m_Url, {{0, kBlockSize}}, validator,
+          [&head](UINT64, const BYTE *data, DWORD size) {
+            head.append((const char *)data, size);
+            return true;
+          },
+          TransferPriority::Interactive) ||
+      validator.Size == 0) {
+    std::wcerr << L"CHD not available for streaming: " << m_Url << std::endl;
+    return false;
+  }
+
+  bool same = resumed && validator.Size == m_Size &&
+              validator.ETag.substr(0, ChdFormat::kMaxETag) ==
+                  m_Validator.ETag &&
+              validator.LastModified.substr(0, ChdFormat::kMaxLastModified) ==
+                  m_Validator.LastModified;
+  m_Validator = validator;
+  if (!same) {
+    if (resumed)
+      std::wcout << L"CHD changed on the server, starting over: " << m_Url
+                 << std::endl;
+    if (m_File != INVALID_HANDLE_VALUE)
+      CloseHandle(m_File);
+    m_File = INVALID_HANDLE_VALUE;
+    m_Size = validator.Size;
+    m_Bitmap.assign((size_t)((BlockCount() + 7) / 8), 0);
+    m_Missing = BlockCount();
+    if (!CreateLocalFile(true))
+      return false;
+  }
+
+  UINT64 headLength = (std::min)(kBlockSize, m_Size);
+  if (!Present(0) && head.size() >= headLength &&
+      WriteAt(m_File, 0, head.data(), (DWORD)headLength)) {
+    m_Bitmap[0] |= 1;
+    m_Missing--;
+  }
+  FetchStructure(head);
+  if (m_Stale)
+    return false;
+  SaveBitmap();
+  std::wcout << L"Streaming CHD " << m_Url << L" (" << m_Size / (1024 * 1024)
+             << L" MB, " << (BlockCount() - m_Missing) * kBlockSize / 1024
+             << L" KB cached)" << std::endl;
+  return true;
+}
+
+void ChdStream::FetchStructure(const std::string &head) {
+  ChdFormat::Layout layout;
+  if (!ChdFormat::ParseHeader((const BYTE *)head.data(), head.size(),
+                              layout)) {
+    if (layout.Version == 0)
+      std::wcerr << L"No CHD header, streaming on demand only: " << m_Url
+                 << std::endl;
+    else
+      std::wcerr << L"Unsupported CHD version " << layout.Version
+                 << L", streaming on demand only: " << m_Url << std::endl;
+    return;
+  }
+
+  auto fetchExtent = [&](UINT64 offset, UINT64 bytes) {
+    if (offset < m_Size && bytes > 0)
+      Fetch(offset / kBlockSize,
+            ((std::min)(offset + bytes, m_Size) - 1) / kBlockSize);
+  };
+
+  if (layout.MapLengthInMap) {
+    BYTE mapHeader[ChdFormat::kMapHeaderBytes];
+    fetchExtent(layout.MapOffset, sizeof(mapHeader));
+    if (layout.MapOffset + sizeof(mapHeader) <= m_Size &&
+        Present(layout.MapOffset / kBlockSize) &&
+        ReadAt(m_File, layout.MapOffset, mapHeader, sizeof(mapHeader)))
+      layout.MapBytes = ChdFormat::CompressedMapBytes(mapHeader);
+  }
+  fetchExtent(layout.MapOffset, layout.MapBytes);
+  // The first metadata entry; the rest of the chain follows on demand.
+  fetchExtent(layout.MetaOffset, ChdFormat::kMetaHeaderBytes);
+}
+
+bool ChdStream::LoadBitmap() {
+  HANDLE h = CreateFileW((m_LocalPath + L".hunks").c_str(), GENERIC_READ,
+                         FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL, NULL);
+  if (h == INVALID_HANDLE_VALUE)
+    return false;
+  LARGE_INTEGER size;
+  std::vector<BYTE> data;
+  bool ok = GetFileSizeEx(h, &size) && size.QuadPart <= MAXDWORD;
+  if (ok) {
+    data.resize((size_t)size.QuadPart);
+    ok = data.empty() || ReadAt(h, 0, data.data(), (DWORD)data.size());
+  }
+  CloseHandle(h);
+  ChdFormat::Hunks hunks;
+  if (!ok || !ChdFormat::DecodeHunks(data, (UINT32)kBlockSize, hunks))
+    return false;
+
+  m_Size = hunks.Size;
+  m_Validator.ETag = hunks.ETag;
+  m_Validator.LastModified = hunks.LastModified;
+  m_Validator.Size = hunks.Size;
+  m_Bitmap.swap(hunks.Bitmap);
+  m_Missing = 0;
+  for (UINT64 block = 0; block < BlockCount(); ++block)
+    if (!Present(block))
+      m_Missing++;
+  return true;
+}
+
+bool ChdStream::SaveBitmap() {
+  ChdFormat::Hunks hunks;
+  hunks.BlockSize = (UINT32)kBlockSize;
+  hunks.Size = m_Size;
+  hunks.ETag = m_Validator.ETag;
+  hunks.LastModified = m_Validator.LastModified;
+  {
+    std::lock_guard<std::mutex> guard(m_Lock);
+    hunks.Bitmap = m_Bitmap;
+  }
+  std::vector<BYTE> data = ChdFormat::EncodeHunks(hunks);
+
+  HANDLE h = CreateFileW((m_LocalPath + L".hunks").c_str(), GENERIC_WRITE,
+                         FILE_SHARE_READ, NULL, OPEN_ALWAYS,
+                         FILE_ATTRIBUTE_NORMAL, NULL);
+  if (h == INVALID_HANDLE_VALUE)
+    return false;
+  bool ok = WriteAt(h, 0, data.data(), (DWORD)data.size());
+  CloseHandle(h);
+  return ok;
+}
+
+bool ChdStream::CreateLocalFile(bool reset) {
+  m_File = CreateFileW(m_LocalPath.c_str(), GENERIC_READ | GENERIC_WRITE,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                       NULL, reset ? CREATE_ALWAYS : OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m_File == INVALID_HANDLE_VALUE) {
+    if (reset)
+      std::wcerr << L"Cannot create " << m_LocalPath << L": "
+                 << GetLastError() << std::endl;
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  if (!reset) {
+    // A copy that doesn't match the bitmap can't be trusted.
+    if (GetFileSizeEx(m_File, &size) && (UINT64)size.QuadPart == m_Size)
+      return true;
+    CloseHandle(m_File);
+    m_File = INVALID_HANDLE_VALUE;
+    return false;
+  }
+
+  // Holes cost no disk space until their blocks arrive.
+  DWORD bytes = 0;
+  DeviceIoControl(m_File, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL);
+  size.QuadPart = (LONGLONG)m_Size;
+  if (!SetFilePointerEx(m_File, size, NULL, FILE_BEGIN) ||
+      !SetEndOfFile(m_File)) {
+    std::wcerr << L"Cannot size " << m_LocalPath << L": " << GetLastError()
+               << std::endl;
+    CloseHandle(m_File);
+    m_File = INVALID_HANDLE_VALUE;
+    return false;
+  }
+  return true;
+}
+
+bool ChdStream::Fetch(UINT64 firstBlock, UINT64 lastBlock) {
+  if (BlockCount() == 0)
+    return true;
+  lastBlock = (std::min)(lastBlock, BlockCount() - 1);
+  Trace::Span trace("net", "chd fetch", m_Url.c_str());
+
+  // Runs of missing blocks, each becoming one range.
+  std::vector<std::pair<UINT64, UINT64>> runs;
+  {
+    std::lock_guard<std::mutex> guard(m_Lock);
+    if (m_Stale)
+      return false;
+    for (UINT64 block = firstBlock; block <= lastBlock; ++block) {
+      if (Present(block))
+        continue;
+      if (!runs.empty() && runs.back().second + 1 == block)
+        runs.back().second = block;
+      else
+        runs.push_back({block, block});
+    }
+  }
+  if (runs.empty())
+    return true;
+
+  std::vector<std::pair<UINT64, UINT64>> ranges;
+  UINT64 bytes = 0;
+  for (const auto &run : runs) {
+    UINT64 start = run.first * kBlockSize;
+    UINT64 end = (std::min)((run.second + 1) * kBlockSize, m_Size);
+    ranges.push_back({start, end - start});
+    bytes += end - start;
+  }
+
+  // If-Range with the stream's validator keeps every block from one copy.
+  HttpValidator validator = m_Validator;
+  if (!Downloader::FetchRanges(
+          m_Url, ranges, validator,
+          [this](UINT64 offset, const BYTE *data, DWORD size) {
+            return WriteAt(m_File, offset, data, size);
+          },
+          TransferPriority::Interactive)) {
+    if (validator.ETag != m_Validator.ETag ||
+        validator.LastModified != m_Validator.LastModified) {
+      std::wcerr << L"CHD changed on the server, dropping cached blocks: "
+                 << m_Url << std::endl;
+      Invalidate();
+      return false;
+    }
+    std::wcerr << L"CHD fetch failed: " << m_Url << std::endl;
+    return false;
+  }
+  // Data first, then the bitmap that vouches for it.
+  FlushFileBuffers(m_File);
+
+  UINT64 missing;
+  {
+    std::lock_guard<std::mutex> guard(m_Lock);
+    for (const auto &run : runs) {
+      for (UINT64 block = run.first; block <= run.second; ++block) {
+        if (!Present(block)) {
+          m_Bitmap[(size_t)(block / 8)] |= (BYTE)(1 << (block % 8));
+          m_Missing--;
+        }
+      }
+    }
+    missing = m_Missing;
+  }
+  SaveBitmap();
+  std::wcout << L"CHD fetched " << bytes / 1024 << L" KB, "
+             << missing * kBlockSize / (1024 * 1024) << L" MB to go: "
+             << m_LocalPath << std::endl;
+  return true;
+}
+
+void ChdStream::Invalidate() {
+  {
+    std::lock_guard<std::mutex> guard(m_OpenLock);
+    auto it = m_Streams.find(StreamKey(m_LocalPath));
+    if (it != m_Streams.end() && it->second.get() == this)
+      m_Streams.erase(it);
+  }
+  {
+    std::lock_guard<std::mutex> guard(m_Lock);
+    m_Stale = true;
+    std::fill(m_Bitmap.begin(), m_Bitmap.end(), (BYTE)0);
+    m_Missing = BlockCount();
+  }
+  // Handles open on this stream span the old copy and keep failing; the
+  // next Open finds no bitmap and fetches the new one from scratch.
+  DeleteFileW((m_LocalPath + L".hunks").c_str());
+}
+
+bool ChdStream::Ensure(UINT64 offset, UINT64 length) {
+  if (length == 0 || offset >= m_Size)
+    return true;
+  UINT64 end = (std::min)(offset + length, m_Size);
+  UINT64 first = offset / kBlockSize;
+  UINT64 last = (end - 1) / kBlockSize;
+
+  UINT64 readAhead;
+  {
+    std::lock_guard<std::mutex> guard(m_Lock);
+    // Reads that continue where the last one ended double the window.
+    if (offset == m_NextOffset && offset != 0)
+      m_Window = m_Window ? (std::min)(m_Window * 2, kMaxReadAheadBlocks) : 1;
+    else
+      m_Window = 0;
+    m_NextOffset = end;
+    readAhead = m_Window;
+
+    bool cached = true;
+    for (UINT64 block = first; cached && block <= last; ++block)
+      cached = Present(block);
+    if (cached)
+      return true;
+  }
+
+  std::lock_guard<std::mutex> fetch(m_FetchLock);
+  // Should the read-ahead part fail, the read itself may still succeed.
+  return Fetch(first, last + readAhead) ||
+         (readAhead > 0 && Fetch(first, last));
+}
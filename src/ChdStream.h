@@ -0,0 +1,78 @@
+#pragma once
+#include "Downloader.h"
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <windows.h>
+
+// Lazily streamed CHD image. The local copy is a sparse file of the
+// remote's full size; blocks are range-fetched the first time they are
+// read and recorded in a presence bitmap kept next to it in
+// "<name>.hunks", so a multi-GB disk image starts in seconds and resumes
+// across sessions. Compressed hunks sit at arbitrary file offsets, so the
+// bitmap tracks fixed-size blocks of the file rather than CHD hunks.
+class ChdStream {
+public:
+  // Returns the shared stream for `localPath`, opening or resuming it on
+  // first use. The header, hunk map and metadata are fetched up front
+  // since MAME reads them all on open; concurrent opens of the same image
+  // wait for that one load. Returns null if the remote is unavailable or
+  // doesn't support range requests.
+  static std::shared_ptr<ChdStream> Open(const std::wstring &url,
+                                         const std::wstring &localPath);
+
+  ~ChdStream();
+
+  // Makes sure bytes [offset, offset + length) are in the local file,
+  // fetching what is missing plus read-ahead on sequential runs.
+  bool Ensure(UINT64 offset, UINT64 length);
+
+  // Granularity of fetches and of the presence bitmap.
+  static constexpr UINT64 kBlockSize = 256 * 1024;
+
+private:
+
+  ChdStream(const std::wstring &url, const std::wstring &localPath)
+      : m_Url(url), m_LocalPath(localPath) {}
+
+  bool Load();
+  // The .hunks file; see ChdFormat for its layout.
+  bool LoadBitmap();
+  bool SaveBitmap();
+  bool CreateLocalFile(bool reset);
+  // Fetches what MAME reads on open: hunk map and first metadata entry.
+  void FetchStructure(const std::string &head);
+  bool Fetch(UINT64 firstBlock, UINT64 lastBlock);
+  // The origin copy changed: nothing cached can be used with the new one.
+  void Invalidate();
+  UINT64 BlockCount() const { return (m_Size + kBlockSize - 1) / kBlockSize; }
+  bool Present(UINT64 block) const {
+    return (m_Bitmap[(size_t)(block / 8)] >> (block % 8)) & 1;
+  }
+
+  // m_Streams holds a stream from the start of its Load, so other opens
+  // find it and wait on m_OpenDone instead of loading it again.
+  static std::mutex m_OpenLock;
+  static std::condition_variable m_OpenDone;
+  static std::map<std::wstring, std::shared_ptr<ChdStream>> m_Streams;
+
+  std::wstring m_Url;
+  std::wstring m_LocalPath;
+  HttpValidator m_Validator;
+  UINT64 m_Size = 0;
+  HANDLE m_File = INVALID_HANDLE_VALUE;
+  bool m_Loading = true; // guarded by m_OpenLock, as is m_Loaded
+  bool m_Loaded = false;
+
+  std::mutex m_Lock; // bitmap and access pattern
+  std::vector<BYTE> m_Bitmap;
+  UINT64 m_Missing = 0;
+  bool m_Stale = false; // invalidated; the next Open starts a new stream
+  UINT64 m_NextOffset = 0;
+  UINT64 m_Window = 0; // read-ahead, in blocks
+
+  std::mutex m_FetchLock; // one fetch at a time per image
+};
@@ -0,0 +1,51 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <windows.h>
+
+// Standard CRC-32 (IEEE 802.3, as used by zip). Pass the previous return
+// value as `crc` to continue a running checksum; start from 0.
+inline UINT32 Crc32Update(UINT32 crc, const void *data, size_t length) {
+  struct Table {
+    UINT32 Values[256];
+    Table() {
+      for (UINT32 i = 0; i < 256; ++i) {
+        UINT32 c = i;
+        for (int k = 0; k < 8; ++k)
+          c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        Values[i] = c;
+      }
+    }
+  };
+  static const Table table;
+
+  const BYTE *p = (const BYTE *)data;
+  crc = ~crc;
+  for (size_t i = 0; i < length; ++i)
+    crc = table.Values[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+// CRC-32 of a whole file. Returns false if it cannot be read to the end.
+inline bool Crc32File(const std::wstring &path, UINT32 &crc) {
+  crc = 0;
+  HANDLE hFile = CreateFileW(path.c_str(), GENERIC_READ,
+                             FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                             OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+    return false;
+
+  std::vector<BYTE> buffer(1024 * 1024);
+  bool ok = false;
+  DWORD got = 0;
+  while (ReadFile(hFile, buffer.data(), (DWORD)buffer.size(), &got, NULL)) {
+    if (got == 0) {
+      ok = true;
+      break;
+    }
+    crc = Crc32Update(crc, buffer.data(), got);
+  }
+  CloseHandle(hFile);
+  return ok;
+}
@@ -1,188 +1,979 @@
 #include "Downloader.h"
+#include "CacheLayout.h"
+#include "Crc32.h"
+#include "Trace.h"
+#include "ZipDelta.h"
+#include <algorithm>
+#include <cwctype>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 
 #pragma comment(lib, "winhttp.lib")
 
-bool Downloader::Download(const std::wstring &url,
-                          const std::wstring &destination) {
-  std::wstring hostname = GetHostname(url);
-  std::wstring path = GetPath(url);
+// Attempts per Download() call; each retry resumes from the journal.
+static const int kMaxAttempts = 3;
+// Flush the .part file and commit a journal range every this many bytes.
+static const UINT64 kJournalInterval = 1024 * 1024;
+
+// Connection phase timestamps for one traced request, filled in by
+// TraceStatusCallback. A reused connection reports no connect phase.
+struct RequestPhases {
+  PCWSTR Url;
+  bool Secure;
+  UINT64 Connecting = 0;
+  UINT64 Connected = 0;
+  UINT64 Sending = 0;
+  UINT64 Sent = 0;
+};
+
+static void CALLBACK TraceStatusCallback(HINTERNET handle, DWORD_PTR context,
+                                         DWORD status, LPVOID information,
+                                         DWORD length) {
+  RequestPhases *phases = (RequestPhases *)context;
+  if (!phases)
+    return;
+  UINT64 now = Trace::Now();
+  switch (status) {
+  case WINHTTP_CALLBACK_STATUS_CONNECTING_TO_SERVER:
+    phases->Connecting = now;
+    break;
+  case WINHTTP_CALLBACK_STATUS_CONNECTED_TO_SERVER:
+    phases->Connected = now;
+    if (phases->Connecting)
+      Trace::Record("net", "connect", phases->Connecting, now, phases->Url);
+    break;
+  case WINHTTP_CALLBACK_STATUS_SENDING_REQUEST:
+    phases->Sending = now;
+    // WinHTTP does the TLS handshake between connecting and sending.
+    if (phases->Secure && phases->Connected)
+      Trace::Record("net", "tls", phases->Connected, now, phases->Url);
+    break;
+  case WINHTTP_CALLBACK_STATUS_REQUEST_SENT:
+    phases->Sent = now;
+    if (phases->Sending)
+      Trace::Record("net", "send", phases->Sending, now, phases->Url);
+    break;
+  }
+}
 
-  std::wcout << L"Downloader: URL=" << url << std::endl;
-  std::wcout << L"Downloader: Hostname=" << hostname << L", Path=" << path
-             << std::endl;
+// WinHTTP handles for a request. Session and Connect may be reused for
+// several requests to the same host; OpenRequest replaces Request each time.
+struct Downloader::HttpRequest {
+  HINTERNET Session = NULL;
+  HINTERNET Connect = NULL;
+  HINTERNET Request = NULL;
+
+  ~HttpRequest() { Reset(); }
+
+  void CloseRequest() {
+    if (Request)
+      WinHttpCloseHandle(Request);
+    Request = NULL;
+  }
+
+  void Reset() {
+    CloseRequest();
+    if (Connect)
+      WinHttpCloseHandle(Connect);
+    if (Session)
+      WinHttpCloseHandle(Session);
+    Connect = NULL;
+    Session = NULL;
+  }
+};
+
+static std::string NarrowAscii(const std::wstring &s) {
+  return std::string(s.begin(), s.end());
+}
+
+static std::wstring WidenAscii(const std::string &s) {
+  return std::wstring(s.begin(), s.end());
+}
 
-  HINTERNET hSession =
-      WinHttpOpen(L"MameCloudRompath/1.0", WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
-                  WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
-  if (!hSession) {
-    std::cerr << "WinHttpOpen failed: " << GetLastError() << std::endl;
+UINT64 Downloader::PartJournal::CommittedPrefix() const {
+  std::vector<std::pair<UINT64, UINT64>> sorted = Ranges;
+  std::sort(sorted.begin(), sorted.end());
+  UINT64 prefix = 0;
+  for (const auto &r : sorted) {
+    if (r.first > prefix)
+      break;
+    prefix = (std::max)(prefix, r.second);
+  }
+  return prefix;
+}
+
+void Downloader::PartJournal::Commit(UINT64 begin, UINT64 end) {
+  if (end <= begin)
+    return;
+  Ranges.emplace_back(begin, end);
+  std::sort(Ranges.begin(), Ranges.end());
+
+  // Merge overlapping and adjacent ranges so the journal stays tiny.
+  std::vector<std::pair<UINT64, UINT64>> merged;
+  for (const auto &r : Ranges) {
+    if (!merged.empty() && r.first <= merged.back().second)
+      merged.back().second = (std::max)(merged.back().second, r.second);
+    else
+      merged.push_back(r);
+  }
+  Ranges.swap(merged);
+}
+
+bool Downloader::LoadJournal(const std::wstring &path, PartJournal &journal) {
+  std::ifstream in(path);
+  if (!in.is_open())
     return false;
+
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t eq = line.find('=');
+    if (eq == std::string::npos)
+      continue;
+    std::string key = line.substr(0, eq);
+    std::string value = line.substr(eq + 1);
+    if (key == "etag") {
+      journal.Validator.ETag = WidenAscii(value);
+    } else if (key == "last-modified") {
+      journal.Validator.LastModified = WidenAscii(value);
+    } else if (key == "size") {
+      journal.Validator.Size = std::strtoull(value.c_str(), nullptr, 10);
+    } else if (key == "crc") {
+      size_t at = value.find('@');
+      if (at == std::string::npos)
+        return false;
+      journal.Crc32 = (UINT32)std::strtoul(value.c_str(), nullptr, 16);
+      journal.CrcOffset = std::strtoull(value.c_str() + at + 1, nullptr, 10);
+    } else if (key == "range") {
+      size_t dash = value.find('-');
+      if (dash == std::string::npos)
+        return false;
+      UINT64 begin = std::strtoull(value.c_str(), nullptr, 10);
+      UINT64 end = std::strtoull(value.c_str() + dash + 1, nullptr, 10);
+      journal.Commit(begin, end);
+    }
   }
+  return true;
+}
 
-  HINTERNET hConnect = WinHttpConnect(hSession, hostname.c_str(),
-                                      INTERNET_DEFAULT_HTTPS_PORT, 0);
-  if (!hConnect) {
-    std::cerr << "WinHttpConnect failed: " << GetLastError() << std::endl;
-    WinHttpCloseHandle(hSession);
+bool Downloader::SaveJournal(const std::wstring &path,
+                             const PartJournal &journal) {
+  // Write a sibling file and rename it over the journal so a crash never
+  // leaves a half-written journal behind.
+  std::wstring tmpPath = path + L".tmp";
+  {
+    std::ofstream out(tmpPath, std::ios::trunc);
+    if (!out.is_open())
+      return false;
+    out << "etag=" << NarrowAscii(journal.Validator.ETag) << "\n";
+    out << "last-modified=" << NarrowAscii(journal.Validator.LastModified)
+        << "\n";
+    out << "size=" << journal.Validator.Size << "\n";
+    out << "crc=" << std::hex << journal.Crc32 << std::dec << "@"
+        << journal.CrcOffset << "\n";
+    for (const auto &r : journal.Ranges)
+      out << "range=" << r.first << "-" << r.second << "\n";
+    if (!out.good())
+      return false;
+  }
+  return MoveFileExW(tmpPath.c_str(), path.c_str(),
+                     MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) !=
+         FALSE;
+}
+
+bool Downloader::OpenRequest(const std::wstring &url,
+                             const std::wstring &headers, HttpRequest &req,
+                             const wchar_t *verb) {
+  // Crack the URL so plain http:// and explicit ports work, e.g. another
+  // mcr instance's -serve port on the LAN.
+  URL_COMPONENTS parts = {0};
+  parts.dwStructSize = sizeof(parts);
+  parts.dwHostNameLength = (DWORD)-1;
+  parts.dwUrlPathLength = (DWORD)-1;
+  parts.dwExtraInfoLength = (DWORD)-1;
+  if (!WinHttpCrackUrl(url.c_str(), 0, 0, &parts)) {
+    std::wcerr << L"Invalid URL: " << url << std::endl;
     return false;
   }
+  std::wstring hostname(parts.lpszHostName, parts.dwHostNameLength);
+  std::wstring path(parts.lpszUrlPath,
+                    parts.dwUrlPathLength + parts.dwExtraInfoLength);
+  if (path.empty())
+    path = L"/";
+  bool secure = parts.nScheme == INTERNET_SCHEME_HTTPS;
 
-  HINTERNET hRequest = WinHttpOpenRequest(
-      hConnect, L"GET", path.c_str(), NULL, WINHTTP_NO_REFERER,
-      WINHTTP_DEFAULT_ACCEPT_TYPES, WINHTTP_FLAG_SECURE);
-  if (!hRequest) {
+  std::wcout << L"Downloader: URL=" << url << std::endl;
+  std::wcout << L"Downloader: Hostname=" << hostname << L", Port="
+             << parts.nPort << L", Path=" << path << std::endl;
+
+  req.CloseRequest();
+  if (!req.Session) {
+    req.Session = WinHttpOpen(
+        L"MameCloudRompath/1.0", WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
+        WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
+    if (!req.Session) {
+      std::cerr << "WinHttpOpen failed: " << GetLastError() << std::endl;
+      return false;
+    }
+  }
+
+  if (!req.Connect) {
+    req.Connect =
+        WinHttpConnect(req.Session, hostname.c_str(), parts.nPort, 0);
+    if (!req.Connect) {
+      std::cerr << "WinHttpConnect failed: " << GetLastError() << std::endl;
+      return false;
+    }
+  }
+
+  req.Request = WinHttpOpenRequest(
+      req.Connect, verb, path.c_str(), NULL, WINHTTP_NO_REFERER,
+      WINHTTP_DEFAULT_ACCEPT_TYPES, secure ? WINHTTP_FLAG_SECURE : 0);
+  if (!req.Request) {
     std::cerr << "WinHttpOpenRequest failed: " << GetLastError() << std::endl;
-    WinHttpCloseHandle(hConnect);
-    WinHttpCloseHandle(hSession);
     return false;
   }
 
-  bool bResults = WinHttpSendRequest(hRequest, WINHTTP_NO_ADDITIONAL_HEADERS, 0,
-                                     WINHTTP_NO_REQUEST_DATA, 0, 0, 0);
+  RequestPhases phases;
+  phases.Url = url.c_str();
+  phases.Secure = secure;
+  bool traced = Trace::Enabled();
+  if (traced) {
+    DWORD_PTR context = (DWORD_PTR)&phases;
+    WinHttpSetOption(req.Request, WINHTTP_OPTION_CONTEXT_VALUE, &context,
+                     sizeof(context));
+    WinHttpSetStatusCallback(req.Request, TraceStatusCallback,
+                             WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS, 0);
+  }
+
+  bool bResults;
+  if (headers.empty())
+    bResults = WinHttpSendRequest(req.Request, WINHTTP_NO_ADDITIONAL_HEADERS,
+                                  0, WINHTTP_NO_REQUEST_DATA, 0, 0, 0);
+  else
+    bResults = WinHttpSendRequest(req.Request, headers.c_str(), (DWORD)-1L,
+                                  WINHTTP_NO_REQUEST_DATA, 0, 0, 0);
 
   if (bResults) {
-    bResults = WinHttpReceiveResponse(hRequest, NULL);
+    bResults = WinHttpReceiveResponse(req.Request, NULL);
   } else {
     std::cerr << "WinHttpSendRequest failed: " << GetLastError() << std::endl;
   }
 
+  if (traced) {
+    // `phases` lives on this stack frame, so detach it before returning.
+    WinHttpSetStatusCallback(req.Request, NULL,
+                             WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS, 0);
+    DWORD_PTR context = 0;
+    WinHttpSetOption(req.Request, WINHTTP_OPTION_CONTEXT_VALUE, &context,
+                     sizeof(context));
+    if (bResults && phases.Sent)
+      Trace::Record("net", "wait", phases.Sent, Trace::Now(), phases.Url);
+  }
+
   if (!bResults) {
     std::cerr << "WinHttpReceiveResponse failed: " << GetLastError()
               << std::endl;
-    WinHttpCloseHandle(hRequest);
-    WinHttpCloseHandle(hConnect);
-    WinHttpCloseHandle(hSession);
     return false;
   }
+  return true;
+}
+
+std::wstring Downloader::QueryHeader(HttpRequest &req, DWORD query) {
+  DWORD dwSize = 0;
+  WinHttpQueryHeaders(req.Request, query, WINHTTP_HEADER_NAME_BY_INDEX,
+                      WINHTTP_NO_OUTPUT_BUFFER, &dwSize,
+                      WINHTTP_NO_HEADER_INDEX);
+  if (GetLastError() != ERROR_INSUFFICIENT_BUFFER || dwSize == 0)
+    return L"";
+
+  std::wstring value(dwSize / sizeof(WCHAR), L'\0');
+  if (!WinHttpQueryHeaders(req.Request, query, WINHTTP_HEADER_NAME_BY_INDEX,
+                           &value[0], &dwSize, WINHTTP_NO_HEADER_INDEX))
+    return L"";
+  value.resize(dwSize / sizeof(WCHAR));
+  return value;
+}
+
+std::mutex Downloader::m_FlightLock;
+std::condition_variable Downloader::m_FlightDone;
+std::map<std::wstring, std::shared_ptr<Downloader::Flight>>
+    Downloader::m_Flights;
+
+// Transfers land in a .part file and are only renamed into place once
+// complete, so an existing destination is never a truncated download.
+static bool AlreadyDownloaded(const std::wstring &destination) {
+  try {
+    if (std::filesystem::exists(destination) &&
+        std::filesystem::file_size(destination) > 0) {
+      std::wcout << L"Skipping download (file exists): " << destination
+                 << std::endl;
+      return true;
+    }
+  } catch (...) {
+    // Ignore errors, proceed to download
+  }
+  return false;
+}
+
+bool Downloader::Download(const std::wstring &url,
+                          const std::wstring &destination,
+                          DownloadInfo *info, TransferPriority priority) {
+  // Simple skip: If file exists and has data, assume it's good.
+  // This prevents MAME from seeing file changes/timestamp updates during
+  // re-runs, and keeps a cached file's refresh from failing this call.
+  if (AlreadyDownloaded(destination))
+    return true;
+  return RunFlight(destination, info, priority, false,
+                   [&](const TransferScheduler::SharedPriority &shared,
+                       DownloadInfo *result, bool &fetched) {
+                     // A flight that ended since the check above may have
+                     // brought it in.
+                     if (AlreadyDownloaded(destination)) {
+                       fetched = false;
+                       return true;
+                     }
+                     return Transfer(url, destination, result, shared);
+                   });
+}
+
+bool Downloader::Refresh(const std::wstring &url,
+                         const std::wstring &destination, DownloadInfo *info,
+                         TransferPriority priority) {
+  return RunFlight(destination, info, priority, true,
+                   [&](const TransferScheduler::SharedPriority &shared,
+                       DownloadInfo *result, bool &) {
+                     // Zips usually change by a member or two; try
+                     // fetching only those.
+                     return ZipDelta::Update(url, destination, result,
+                                             shared) ||
+                            Transfer(url, destination, result, shared);
+                   });
+}
+
+bool Downloader::RunFlight(const std::wstring &destination,
+                           DownloadInfo *info, TransferPriority priority,
+                           bool mustFetch, const FlightWork &work) {
+  std::wstring key = destination;
+  for (auto &c : key)
+    c = towlower(c);
+
+  while (true) {
+    std::shared_ptr<Flight> flight;
+    bool leader = false;
+    {
+      std::lock_guard<std::mutex> guard(m_FlightLock);
+      auto it = m_Flights.find(key);
+      if (it == m_Flights.end()) {
+        flight = std::make_shared<Flight>(priority);
+        m_Flights[key] = flight;
+        leader = true;
+      } else {
+        flight = it->second;
+      }
+    }
+
+    if (leader) {
+      DownloadInfo result;
+      bool fetched = true;
+      bool ok = work(flight->Priority, &result, fetched);
+      {
+        std::lock_guard<std::mutex> guard(m_FlightLock);
+        flight->Info = result;
+        flight->Ok = ok;
+        flight->Fetched = fetched;
+        flight->Done = true;
+        m_Flights.erase(key);
+      }
+      m_FlightDone.notify_all();
+      if (info)
+        *info = result;
+      return ok;
+    }
+
+    // A second transfer would fight the first over the .part file and
+    // its journal; wait for the first instead, at our priority if higher.
+    std::wcout << L"Waiting for the download already in progress: "
+               << destination << std::endl;
+    TransferScheduler::Raise(flight->Priority, priority);
+    std::unique_lock<std::mutex> lock(m_FlightLock);
+    m_FlightDone.wait(lock, [&]() { return flight->Done; });
+    if (mustFetch && !flight->Fetched)
+      continue; // it only found the copy we are replacing
+    if (info)
+      *info = flight->Info;
+    return flight->Ok;
+  }
+}
+
+bool Downloader::Transfer(const std::wstring &url,
+                          const std::wstring &destination, DownloadInfo *info,
+                          const TransferScheduler::SharedPriority &priority) {
+  Trace::Span trace("net", "download", url.c_str());
+  std::wstring partPath = destination + L".part";
+  std::wstring journalPath = destination + L".part.journal";
+
+  PartJournal journal;
+  if (!LoadJournal(journalPath, journal))
+    journal = PartJournal();
+
+  AttemptResult result = AttemptResult::Retry;
+  for (int attempt = 1; attempt <= kMaxAttempts; ++attempt) {
+    result = DownloadAttempt(url, partPath, journalPath, journal, priority);
+    if (result != AttemptResult::Retry)
+      break;
+    if (attempt < kMaxAttempts) {
+      std::wcerr << L"Download attempt " << attempt << L" failed, retrying: "
+                 << url << std::endl;
+      Sleep(1000 * attempt);
+    }
+  }
+
+  std::filesystem::path dirPath =
+      std::filesystem::path(destination).parent_path();
+  if (result != AttemptResult::Complete) {
+    UINT64 committed = journal.CommittedPrefix();
+    if (committed > 0) {
+      std::wcerr << L"Download incomplete, keeping " << committed
+                 << L" bytes for resume: " << partPath << std::endl;
+      return false;
+    }
+
+    DeleteFileW(partPath.c_str());
+    DeleteFileW(journalPath.c_str());
+
+    // Attempt to remove the parent directory if it's empty, unless it is
+    // part of the cache layout that other downloads may be writing into.
+    try {
+      if (!CacheLayout::IsLayoutDir(dirPath.wstring()) &&
+          std::filesystem::exists(dirPath) &&
+          std::filesystem::is_empty(dirPath)) {
+        std::filesystem::remove(dirPath);
+        std::wcerr << L"Removed empty parent directory: " << dirPath.wstring()
+                   << std::endl;
+      }
+    } catch (...) {
+      // Ignore errors during cleanup
+    }
+    return false;
+  }
+
+  if (!SwapIntoPlace(partPath, destination)) {
+    std::wcerr << L"Failed to move completed download into place: "
+               << destination << L" (" << GetLastError() << L")" << std::endl;
+    return false;
+  }
+  DeleteFileW(journalPath.c_str());
+
+  std::cout << "Download completed successfully. Total bytes: "
+            << journal.CommittedPrefix() << std::endl;
+  if (info) {
+    info->Validator = journal.Validator;
+    info->Validator.Size = journal.CommittedPrefix();
+    info->Crc32 = journal.Crc32;
+  }
+  return true;
+}
+
+bool Downloader::SwapIntoPlace(const std::wstring &source,
+                              const std::wstring &destination) {
+  if (MoveFileExW(source.c_str(), destination.c_str(),
+                  MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    return true;
+
+  DWORD err = GetLastError();
+  if (err != ERROR_ACCESS_DENIED && err != ERROR_SHARING_VIOLATION)
+    return false;
+
+  // The destination is still open (MAME holds it). Our own handles allow
+  // FILE_SHARE_DELETE, so a POSIX-semantics rename can replace it while
+  // existing handles keep reading the old copy (Windows 10 1709+).
+  struct RenameInfoEx {
+    DWORD Flags;
+    HANDLE RootDirectory;
+    DWORD FileNameLength;
+    WCHAR FileName[1];
+  };
+  const DWORD kReplaceIfExists = 0x1;
+  const DWORD kPosixSemantics = 0x2;
+  const int kFileRenameInfoEx = 22;
+
+  HANDLE hFile = CreateFileW(source.c_str(), DELETE | SYNCHRONIZE,
+                             FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+    return false;
+
+  size_t nameBytes = destination.size() * sizeof(WCHAR);
+  std::vector<BYTE> buffer(sizeof(RenameInfoEx) + nameBytes);
+  RenameInfoEx *rename = (RenameInfoEx *)buffer.data();
+  rename->Flags = kReplaceIfExists | kPosixSemantics;
+  rename->RootDirectory = NULL;
+  rename->FileNameLength = (DWORD)nameBytes;
+  memcpy(rename->FileName, destination.c_str(), nameBytes);
+
+  BOOL ok = SetFileInformationByHandle(
+      hFile, (FILE_INFO_BY_HANDLE_CLASS)kFileRenameInfoEx, rename,
+      (DWORD)buffer.size());
+  err = GetLastError();
+  CloseHandle(hFile);
+  SetLastError(err);
+  return ok != FALSE;
+}
+
+// Two validators describe the same origin file if their strongest common
+// field matches.
+static bool SameOriginFile(const HttpValidator &a, const HttpValidator &b) {
+  if (!a.ETag.empty() && !b.ETag.empty())
+    return a.ETag == b.ETag;
+  if (!a.LastModified.empty() && !b.LastModified.empty())
+    return a.LastModified == b.LastModified &&
+           (a.Size == 0 || b.Size == 0 || a.Size == b.Size);
+  return a.Size != 0 && a.Size == b.Size;
+}
+
+bool Downloader::HasResumablePart(const std::wstring &destination,
+                                  const HttpValidator &validator) {
+  PartJournal journal;
+  if (!LoadJournal(destination + L".part.journal", journal) ||
+      journal.CommittedPrefix() == 0)
+    return false;
+  if (journal.Validator.ETag.empty() && journal.Validator.LastModified.empty())
+    return false;
+  std::error_code ec;
+  UINT64 size = std::filesystem::file_size(destination + L".part", ec);
+  return !ec && size >= journal.CommittedPrefix() &&
+         SameOriginFile(journal.Validator, validator);
+}
+
+Downloader::RevalidateResult
+Downloader::Revalidate(const std::wstring &url, const std::wstring &destination,
+                       const HttpValidator &current, DownloadInfo *info,
+                       TransferPriority priority) {
+  std::vector<RevalidateItem> items(1);
+  items[0].Url = url;
+  items[0].Destination = destination;
+  items[0].Current = current;
+  RevalidateBatch(items, priority);
+  if (info)
+    *info = items[0].Info;
+  return items[0].Result;
+}
+
+void Downloader::RevalidateBatch(std::vector<RevalidateItem> &items,
+                                 TransferPriority priority) {
+  HttpRequest req;
+  std::wstring host;
+
+  for (auto &item : items) {
+    std::wstring itemHost = GetHostname(item.Url);
+    if (itemHost != host) {
+      req.Reset();
+      host = itemHost;
+    }
+
+    std::wstring headers;
+    if (!item.Current.ETag.empty())
+      headers += L"If-None-Match: " + item.Current.ETag + L"\r\n";
+    if (!item.Current.LastModified.empty())
+      headers += L"If-Modified-Since: " + item.Current.LastModified + L"\r\n";
+
+    bool changed = false;
+    {
+      TransferScheduler::Slot slot = TransferScheduler::Acquire(host, priority);
+      if (!OpenRequest(item.Url, headers, req, L"HEAD")) {
+        item.Result = RevalidateResult::Failed;
+        req.Reset();
+        continue;
+      }
+
+      DWORD dwStatusCode = 0;
+      DWORD dwSize = sizeof(dwStatusCode);
+      WinHttpQueryHeaders(req.Request,
+                          WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER,
+                          WINHTTP_HEADER_NAME_BY_INDEX, &dwStatusCode, &dwSize,
+                          WINHTTP_NO_HEADER_INDEX);
+
+      HttpValidator remote;
+      remote.ETag = QueryHeader(req, WINHTTP_QUERY_ETAG);
+      remote.LastModified = QueryHeader(req, WINHTTP_QUERY_LAST_MODIFIED);
+      std::wstring contentLength =
+          QueryHeader(req, WINHTTP_QUERY_CONTENT_LENGTH);
+      if (!contentLength.empty())
+        remote.Size = std::wcstoull(contentLength.c_str(), nullptr, 10);
+
+      if (dwStatusCode == 304) {
+        item.Result = RevalidateResult::NotModified;
+        item.Info.Validator = item.Current;
+        if (!remote.ETag.empty())
+          item.Info.Validator.ETag = remote.ETag;
+      } else if (dwStatusCode == 200) {
+        // Also covers origins that ignore conditional headers, and cached
+        // files recorded without a validator (adopted from disk).
+        if (SameOriginFile(item.Current, remote)) {
+          item.Result = RevalidateResult::NotModified;
+          item.Info.Validator = remote;
+          item.Info.Validator.Size = item.Current.Size;
+        } else {
+          changed = true;
+        }
+      } else {
+        std::wcerr << L"HTTP Error: " << dwStatusCode << L" revalidating "
+                   << item.Url << std::endl;
+        item.Result = RevalidateResult::Failed;
+      }
+    }
+
+    if (changed) {
+      std::wcout << L"Origin copy changed, refreshing: " << item.Destination
+                 << std::endl;
+      bool updated =
+          Refresh(item.Url, item.Destination, &item.Info, priority);
+      item.Result =
+          updated ? RevalidateResult::Updated : RevalidateResult::Failed;
+    }
+  }
+}
+
+// Parses "bytes <first>-<last>/<total>"; total is 0 when sent as "*".
+static bool ParseContentRange(const std::wstring &value, UINT64 &first,
+                              UINT64 &last, UINT64 &total) {
+  size_t space = value.find(L' ');
+  size_t dash = value.find(L'-');
+  size_t slash = value.find(L'/');
+  if (space == std::wstring::npos || dash == std::wstring::npos ||
+      slash == std::wstring::npos || dash < space || slash < dash)
+    return false;
+  first = std::wcstoull(value.c_str() + space + 1, nullptr, 10);
+  last = std::wcstoull(value.c_str() + dash + 1, nullptr, 10);
+  total = value[slash + 1] == L'*'
+              ? 0
+              : std::wcstoull(value.c_str() + slash + 1, nullptr, 10);
+  return last >= first;
+}
+
+bool Downloader::FetchRanges(
+    const std::wstring &url,
+    const std::vector<std::pair<UINT64, UINT64>> &ranges,
+    HttpValidator &validator, const RangeSink &sink,
+    TransferPriority priority) {
+  std::wstring host = GetHostname(url);
+  HttpRequest req;
+  std::vector<BYTE> buffer;
+
+  for (const auto &range : ranges) {
+    if (range.second == 0)
+      continue;
+    std::wstring headers = L"Range: bytes=";
+    if (range.first == kSuffixRange)
+      headers += L"-" + std::to_wstring(range.second);
+    else
+      headers += std::to_wstring(range.first) + L"-" +
+                 std::to_wstring(range.first + range.second - 1);
+    const std::wstring &tag =
+        validator.ETag.empty() ? validator.LastModified : validator.ETag;
+    if (!tag.empty())
+      headers += L"\r\nIf-Range: " + tag;
+
+    UINT64 queuedAt = Trace::Now();
+    TransferScheduler::Slot slot = TransferScheduler::Acquire(host, priority);
+    Trace::Record("net", "queue", queuedAt, Trace::Now(), url.c_str());
+    if (!OpenRequest(url, headers, req))
+      return false;
+
+    DWORD dwStatusCode = 0;
+    DWORD dwSize = sizeof(dwStatusCode);
+    WinHttpQueryHeaders(req.Request,
+                        WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER,
+                        WINHTTP_HEADER_NAME_BY_INDEX, &dwStatusCode, &dwSize,
+                        WINHTTP_NO_HEADER_INDEX);
+    if (dwStatusCode != 206) {
+      // 200 means no range support, or the file changed under If-Range.
+      std::wcerr << L"Range request not honored (HTTP " << dwStatusCode
+                 << L"): " << url << std::endl;
+      if (dwStatusCode == 200 && !tag.empty()) {
+        validator.ETag = QueryHeader(req, WINHTTP_QUERY_ETAG);
+        validator.LastModified = QueryHeader(req, WINHTTP_QUERY_LAST_MODIFIED);
+      }
+      return false;
+    }
+
+    UINT64 first = 0, last = 0, total = 0;
+    std::wstring contentRange = QueryHeader(req, WINHTTP_QUERY_CONTENT_RANGE);
+    if (!ParseContentRange(contentRange, first, last, total) ||
+        (range.first != kSuffixRange && first != range.first)) {
+      std::wcerr << L"Unexpected Content-Range '" << contentRange << L"': "
+                 << url << std::endl;
+      return false;
+    }
+    if (tag.empty()) {
+      validator.ETag = QueryHeader(req, WINHTTP_QUERY_ETAG);
+      validator.LastModified = QueryHeader(req, WINHTTP_QUERY_LAST_MODIFIED);
+    }
+    if (validator.Size == 0)
+      validator.Size = total;
+    else if (total != 0 && total != validator.Size)
+      return false;
+
+    Trace::Span body("net", "body", url.c_str());
+    UINT64 offset = first;
+    do {
+      dwSize = 0;
+      if (!WinHttpQueryDataAvailable(req.Request, &dwSize))
+        return false;
+      if (dwSize == 0)
+        break;
+      if (buffer.size() < dwSize)
+        buffer.resize(dwSize);
+
+      DWORD dwDownloaded = 0;
+      if (!WinHttpReadData(req.Request, buffer.data(), dwSize, &dwDownloaded))
+        return false;
+      if (offset + dwDownloaded > last + 1 ||
+          !sink(offset, buffer.data(), dwDownloaded))
+        return false;
+      offset += dwDownloaded;
+      slot.Throttle(dwDownloaded);
+    } while (dwSize > 0);
+
+    if (offset != last + 1) {
+      std::wcerr << L"Range response cut short at byte " << offset << L": "
+                 << url << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+Downloader::AttemptResult
+Downloader::DownloadAttempt(
+    const std::wstring &url, const std::wstring &partPath,
+    const std::wstring &journalPath, PartJournal &journal,
+    const TransferScheduler::SharedPriority &priority) {
+  UINT64 offset = journal.CommittedPrefix();
+
+  // Resuming is only safe when If-Range can prove the origin file is the one
+  // the committed bytes came from, and the bytes are still on disk.
+  if (offset > 0 && journal.Validator.ETag.empty() &&
+      journal.Validator.LastModified.empty())
+    offset = 0;
+  if (offset > 0) {
+    try {
+      if (std::filesystem::file_size(partPath) < offset)
+        offset = 0;
+    } catch (...) {
+      offset = 0;
+    }
+  }
+  // The running CRC has to line up with the prefix we resume from.
+  if (offset > 0 && journal.CrcOffset != offset)
+    offset = 0;
+  if (offset == 0) {
+    journal.Ranges.clear();
+    journal.Crc32 = 0;
+    journal.CrcOffset = 0;
+  }
+
+  if (offset > 0 && offset == journal.Validator.Size) {
+    // Everything was committed before the previous run stopped.
+    try {
+      std::filesystem::resize_file(partPath, offset);
+      return AttemptResult::Complete;
+    } catch (...) {
+      return AttemptResult::Fatal;
+    }
+  }
+
+  std::wstring headers;
+  if (offset > 0) {
+    const std::wstring &validator = journal.Validator.ETag.empty()
+                                        ? journal.Validator.LastModified
+                                        : journal.Validator.ETag;
+    headers = L"Range: bytes=" + std::to_wstring(offset) +
+              L"-\r\nIf-Range: " + validator;
+    std::wcout << L"Resuming download at byte " << offset << L": " << partPath
+               << std::endl;
+  }
+
+  UINT64 queuedAt = Trace::Now();
+  TransferScheduler::Slot slot =
+      TransferScheduler::Acquire(GetHostname(url), priority);
+  Trace::Record("net", "queue", queuedAt, Trace::Now(), url.c_str());
+  HttpRequest req;
+  if (!OpenRequest(url, headers, req))
+    return AttemptResult::Retry;
 
   DWORD dwStatusCode = 0;
   DWORD dwSize = sizeof(dwStatusCode);
-  WinHttpQueryHeaders(hRequest,
+  WinHttpQueryHeaders(req.Request,
                       WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER,
                       WINHTTP_HEADER_NAME_BY_INDEX, &dwStatusCode, &dwSize,
                       WINHTTP_NO_HEADER_INDEX);
 
-  if (dwStatusCode != 200) {
-    std::wcerr << L"HTTP Error: " << dwStatusCode << L" for " << path
+  if (dwStatusCode == 416 && offset > 0) {
+    // Our committed prefix runs past the origin file; start over.
+    std::wcerr << L"Range not satisfiable, restarting download." << std::endl;
+    journal = PartJournal();
+    SaveJournal(journalPath, journal);
+    return AttemptResult::Retry;
+  }
+
+  if (dwStatusCode != 200 && dwStatusCode != 206) {
+    std::wcerr << L"HTTP Error: " << dwStatusCode << L" for " << url
                << std::endl;
-    WinHttpCloseHandle(hRequest);
-    WinHttpCloseHandle(hConnect);
-    WinHttpCloseHandle(hSession);
-    return false;
+    if (dwStatusCode >= 500 || dwStatusCode == 408 || dwStatusCode == 429)
+      return AttemptResult::Retry;
+    return AttemptResult::Fatal;
   }
 
   // Get Content-Length for debugging and validation
-  DWORD dwContentLength = 0;
-  DWORD dwCLSize = sizeof(dwContentLength);
-  WinHttpQueryHeaders(hRequest,
-                      WINHTTP_QUERY_CONTENT_LENGTH | WINHTTP_QUERY_FLAG_NUMBER,
-                      WINHTTP_HEADER_NAME_BY_INDEX, &dwContentLength, &dwCLSize,
-                      WINHTTP_NO_HEADER_INDEX);
+  std::wstring contentLength = QueryHeader(req, WINHTTP_QUERY_CONTENT_LENGTH);
+  UINT64 dwContentLength =
+      contentLength.empty() ? 0
+                            : std::wcstoull(contentLength.c_str(), nullptr, 10);
   std::wcout << L"Content-Length: " << dwContentLength << std::endl;
 
-  // Abort if Content-Length is 0
-  if (dwContentLength == 0) {
-    std::wcerr << L"Error: Content-Length is 0. Aborting download."
-               << std::endl;
-    WinHttpCloseHandle(hRequest);
-    WinHttpCloseHandle(hConnect);
-    WinHttpCloseHandle(hSession);
-    return false;
-  }
+  std::wstring etag = QueryHeader(req, WINHTTP_QUERY_ETAG);
+  std::wstring lastModified = QueryHeader(req, WINHTTP_QUERY_LAST_MODIFIED);
 
-  // Simple skip: If file exists and has data, assume it's good.
-  // This prevents MAME from seeing file changes/timestamp updates during
-  // re-runs.
-  try {
-    if (std::filesystem::exists(destination) &&
-        std::filesystem::file_size(destination) > 0) {
-      std::wcout << L"Skipping download (file exists): " << destination
+  if (dwStatusCode == 200) {
+    if (offset > 0)
+      std::wcout << L"Origin sent the full file (changed or no range "
+                    L"support), restarting from byte 0."
                  << std::endl;
-      WinHttpCloseHandle(hRequest);
-      WinHttpCloseHandle(hConnect);
-      WinHttpCloseHandle(hSession);
-      return true;
+
+    // Abort if Content-Length is 0
+    if (dwContentLength == 0) {
+      std::wcerr << L"Error: Content-Length is 0. Aborting download."
+                 << std::endl;
+      return AttemptResult::Fatal;
     }
-  } catch (...) {
-    // Ignore errors, proceed to download
+    offset = 0;
+    journal = PartJournal();
+    journal.Validator.Size = dwContentLength;
+  } else {
+    // Content-Range: bytes <first>-<last>/<total>
+    std::wstring contentRange = QueryHeader(req, WINHTTP_QUERY_CONTENT_RANGE);
+    size_t space = contentRange.find(L' ');
+    size_t slash = contentRange.find(L'/');
+    UINT64 first = (space == std::wstring::npos)
+                       ? UINT64(-1)
+                       : std::wcstoull(contentRange.c_str() + space + 1,
+                                       nullptr, 10);
+    if (first != offset) {
+      std::wcerr << L"Unexpected Content-Range '" << contentRange
+                 << L"', restarting download." << std::endl;
+      journal = PartJournal();
+      SaveJournal(journalPath, journal);
+      return AttemptResult::Retry;
+    }
+    if (slash != std::wstring::npos && contentRange[slash + 1] != L'*')
+      journal.Validator.Size =
+          std::wcstoull(contentRange.c_str() + slash + 1, nullptr, 10);
   }
+  if (!etag.empty())
+    journal.Validator.ETag = etag;
+  if (!lastModified.empty())
+    journal.Validator.LastModified = lastModified;
 
   // Ensure directory exists ONLY after successful header check
-  std::filesystem::path destPath(destination);
-  std::filesystem::path dirPath = destPath.parent_path();
+  std::filesystem::path dirPath = std::filesystem::path(partPath).parent_path();
   if (!std::filesystem::exists(dirPath)) {
     std::filesystem::create_directories(dirPath);
   }
 
-  std::ofstream outFile(destination, std::ios::binary);
-  if (!outFile.is_open()) {
-    std::wcerr << L"Failed to open local file: " << destination << std::endl;
-    WinHttpCloseHandle(hRequest);
-    WinHttpCloseHandle(hConnect);
-    WinHttpCloseHandle(hSession);
-    return false;
+  HANDLE hFile = CreateFileW(partPath.c_str(), GENERIC_WRITE, FILE_SHARE_READ,
+                             NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (hFile == INVALID_HANDLE_VALUE) {
+    std::wcerr << L"Failed to open local file: " << partPath << std::endl;
+    return AttemptResult::Fatal;
   }
 
-  DWORD dwDownloaded = 0;
-  DWORD dwTotalDownloaded = 0;
+  // Drop anything past the committed prefix; it was never journaled.
+  LARGE_INTEGER pos;
+  pos.QuadPart = (LONGLONG)offset;
+  if (!SetFilePointerEx(hFile, pos, NULL, FILE_BEGIN) || !SetEndOfFile(hFile)) {
+    std::wcerr << L"Failed to seek local file: " << partPath << std::endl;
+    CloseHandle(hFile);
+    return AttemptResult::Fatal;
+  }
+  SaveJournal(journalPath, journal);
+
+  UINT64 written = offset;
+  UINT64 commitStart = offset;
+  UINT32 crc = journal.Crc32;
+  bool ioError = false;
+  std::vector<char> buffer;
+  UINT64 bodyStart = Trace::Now();
   do {
     dwSize = 0;
-    if (!WinHttpQueryDataAvailable(hRequest, &dwSize))
+    if (!WinHttpQueryDataAvailable(req.Request, &dwSize)) {
+      ioError = true;
       break;
+    }
     if (dwSize == 0)
       break;
 
-    char *pszOutBuffer = new char[dwSize];
-    if (!pszOutBuffer)
+    if (buffer.size() < dwSize)
+      buffer.resize(dwSize);
+
+    DWORD dwDownloaded = 0;
+    if (!WinHttpReadData(req.Request, (LPVOID)buffer.data(), dwSize,
+                         &dwDownloaded)) {
+      ioError = true;
       break;
+    }
 
-    if (WinHttpReadData(hRequest, (LPVOID)pszOutBuffer, dwSize,
-                        &dwDownloaded)) {
-      outFile.write(pszOutBuffer, dwDownloaded);
-      dwTotalDownloaded += dwDownloaded;
+    DWORD dwWritten = 0;
+    if (!WriteFile(hFile, buffer.data(), dwDownloaded, &dwWritten, NULL) ||
+        dwWritten != dwDownloaded) {
+      std::wcerr << L"Failed to write local file: " << partPath << std::endl;
+      ioError = true;
+      break;
+    }
+    written += dwDownloaded;
+    crc = Crc32Update(crc, buffer.data(), dwDownloaded);
+    slot.Throttle(dwDownloaded);
+
+    if (written - commitStart >= kJournalInterval) {
+      FlushFileBuffers(hFile);
+      journal.Commit(commitStart, written);
+      journal.Crc32 = crc;
+      journal.CrcOffset = written;
+      SaveJournal(journalPath, journal);
+      commitStart = written;
     }
-    delete[] pszOutBuffer;
   } while (dwSize > 0);
+  Trace::Record("net", "body", bodyStart, Trace::Now(), url.c_str());
 
-  outFile.close();
+  FlushFileBuffers(hFile);
+  CloseHandle(hFile);
+  journal.Commit(commitStart, written);
+  journal.Crc32 = crc;
+  journal.CrcOffset = written;
+  SaveJournal(journalPath, journal);
 
-  if (dwTotalDownloaded == 0) {
+  if (written == 0) {
     std::wcerr << L"Error: Downloaded file is empty (0 bytes). Deleting."
                << std::endl;
-    std::filesystem::remove(destination);
-
-    // Attempt to remove the parent directory if it's empty
-    try {
-      if (std::filesystem::exists(dirPath) &&
-          std::filesystem::is_empty(dirPath)) {
-        std::filesystem::remove(dirPath);
-        std::wcerr << L"Removed empty parent directory: " << dirPath.wstring()
-                   << std::endl;
-      }
-    } catch (...) {
-      // Ignore errors during cleanup
-    }
-    WinHttpCloseHandle(hRequest);
-    WinHttpCloseHandle(hConnect);
-    WinHttpCloseHandle(hSession);
-    return false;
+    return AttemptResult::Fatal;
   }
 
-  std::cout << "Download completed successfully. Total bytes: "
-            << dwTotalDownloaded << std::endl;
-
-  WinHttpCloseHandle(hRequest);
-  WinHttpCloseHandle(hConnect);
-  WinHttpCloseHandle(hSession);
-  return true;
+  bool complete = journal.Validator.Size > 0
+                      ? written == journal.Validator.Size
+                      : !ioError;
+  if (!complete) {
+    std::wcerr << L"Transfer interrupted at byte " << written << L" of "
+               << journal.Validator.Size << std::endl;
+    return AttemptResult::Retry;
+  }
+  return AttemptResult::Complete;
 }
 
 bool Downloader::ExtractFileFromZip(const std::wstring &zipPath,
                                     const std::wstring &fileName,
                                     const std::wstring &destPath) {
+  Trace::Span trace("extract", "tar", fileName.c_str());
   // Ensure destination directory exists
   std::filesystem::path dest(destPath);
   std::filesystem::path destDir = dest.parent_path();
@@ -222,16 +1013,3 @@ std::wstring Downloader::GetHostname(const std::wstring &url) {
     return url.substr(start);
   return url.substr(start, end - start);
 }
-
-std::wstring Downloader::GetPath(const std::wstring &url) {
-  size_t start = 0;
-  if (url.find(L"https://") == 0)
-    start = 8;
-  else if (url.find(L"http://") == 0)
-    start = 7;
-
-  size_t end = url.find(L"/", start);
-  if (end == std::wstring::npos)
-    return L"/";
-  return url.substr(end);
-}
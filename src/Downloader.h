@@ -1,18 +1,156 @@
 #pragma once
+#include "TransferScheduler.h"
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 #include <windows.h>
 #include <winhttp.h>
 
+// Origin validator captured from the response headers of a download.
+struct HttpValidator {
+  std::wstring ETag;
+  std::wstring LastModified;
+  UINT64 Size = 0;
+};
+
+// What a completed download looked like, for recording in the catalog.
+struct DownloadInfo {
+  HttpValidator Validator;
+  UINT32 Crc32 = 0;
+};
+
 class Downloader {
 public:
+  // Only one transfer per destination runs at a time, counting the
+  // refreshes RevalidateBatch makes: a caller for a destination that is
+  // already being fetched waits for that transfer and shares its result,
+  // raising its priority to the caller's if higher.
   static bool Download(const std::wstring &url,
-                       const std::wstring &destination);
+                       const std::wstring &destination,
+                       DownloadInfo *info = nullptr,
+                       TransferPriority priority =
+                           TransferPriority::Interactive);
+
+  enum class RevalidateResult { NotModified, Updated, Failed };
+
+  struct RevalidateItem {
+    std::wstring Url;
+    std::wstring Destination;
+    HttpValidator Current; // what the cached copy was downloaded as
+    RevalidateResult Result = RevalidateResult::Failed;
+    DownloadInfo Info; // validator to record, and the new CRC if Updated
+  };
+
+  // Checks a cached file against its origin with a conditional request and,
+  // if the origin copy changed, downloads it and swaps it in atomically.
+  static RevalidateResult
+  Revalidate(const std::wstring &url, const std::wstring &destination,
+             const HttpValidator &current, DownloadInfo *info,
+             TransferPriority priority = TransferPriority::Background);
+  // Same for many files, reusing one session (and its kept-alive
+  // connections) for the whole batch.
+  static void RevalidateBatch(std::vector<RevalidateItem> &items,
+                              TransferPriority priority);
+
+  // Receives the body of a range response; `offset` is the file offset of
+  // data[0]. Return false to abort.
+  using RangeSink =
+      std::function<bool(UINT64 offset, const BYTE *data, DWORD size)>;
+  // Offset value that asks for the last `length` bytes of the file.
+  static constexpr UINT64 kSuffixRange = UINT64(-1);
+
+  // Fetches byte ranges {offset, length} of a remote file in order over one
+  // connection. Every request carries If-Range, so all ranges come from the
+  // same copy; an empty `validator` is filled in from the first response,
+  // including the total Size. Fails unless every response is a 206. A 200
+  // to If-Range means the origin file changed, and `validator` then
+  // describes the new copy so the caller can tell that from other errors.
+  static bool FetchRanges(const std::wstring &url,
+                          const std::vector<std::pair<UINT64, UINT64>> &ranges,
+                          HttpValidator &validator, const RangeSink &sink,
+                          TransferPriority priority);
+  // True when `destination` has a partial download from the same origin
+  // file as `validator` that Download would resume rather than restart.
+  static bool HasResumablePart(const std::wstring &destination,
+                               const HttpValidator &validator);
+  // Moves a finished download over `destination`, even while it is open.
+  static bool SwapIntoPlace(const std::wstring &source,
+                            const std::wstring &destination);
+
   static bool ExtractFileFromZip(const std::wstring &zipPath,
                                  const std::wstring &fileName,
                                  const std::wstring &destPath);
 
 private:
+  struct HttpRequest;
+
+  // A Download in progress, shared by every caller for its destination.
+  struct Flight {
+    TransferScheduler::SharedPriority Priority;
+    bool Done = false;
+    bool Ok = false;
+    bool Fetched = false; // false if it found the file already in place
+    DownloadInfo Info;
+
+    explicit Flight(TransferPriority priority) : Priority(priority) {}
+  };
+
+  // Progress journal stored next to a .part file. Ranges are the byte
+  // ranges [first, second) that have been flushed to disk.
+  struct PartJournal {
+    HttpValidator Validator;
+    std::vector<std::pair<UINT64, UINT64>> Ranges;
+    // Running CRC-32 of the committed prefix, valid up to CrcOffset.
+    UINT32 Crc32 = 0;
+    UINT64 CrcOffset = 0;
+
+    UINT64 CommittedPrefix() const;
+    void Commit(UINT64 begin, UINT64 end);
+  };
+
+  enum class AttemptResult { Complete, Retry, Fatal };
+
+  // A flight's transfer: fills in the DownloadInfo, and clears the flag if
+  // it fetched nothing because the file was already in place.
+  using FlightWork = std::function<bool(
+      const TransferScheduler::SharedPriority &, DownloadInfo *, bool &)>;
+
+  // Runs `work` as the one transfer for `destination`, or waits for the one
+  // already running and shares its result. With `mustFetch`, a flight that
+  // found the file in place does not count and the caller leads its own.
+  static bool RunFlight(const std::wstring &destination, DownloadInfo *info,
+                        TransferPriority priority, bool mustFetch,
+                        const FlightWork &work);
+  // Replaces a cached file whose origin copy changed, by a zip delta if
+  // possible and a full transfer otherwise.
+  static bool Refresh(const std::wstring &url,
+                      const std::wstring &destination, DownloadInfo *info,
+                      TransferPriority priority);
+
+  static bool Transfer(const std::wstring &url,
+                       const std::wstring &destination, DownloadInfo *info,
+                       const TransferScheduler::SharedPriority &priority);
+  static AttemptResult
+  DownloadAttempt(const std::wstring &url, const std::wstring &partPath,
+                  const std::wstring &journalPath, PartJournal &journal,
+                  const TransferScheduler::SharedPriority &priority);
+  static bool OpenRequest(const std::wstring &url,
+                          const std::wstring &headers, HttpRequest &req,
+                          const wchar_t *verb = L"GET");
+  static std::wstring QueryHeader(HttpRequest &req, DWORD query);
+  static bool LoadJournal(const std::wstring &path, PartJournal &journal);
+  static bool SaveJournal(const std::wstring &path,
+                          const PartJournal &journal);
   static bool SaveToFile(const std::wstring &path, const std::string &data);
   static std::wstring GetHostname(const std::wstring &url);
-  static std::wstring GetPath(const std::wstring &url);
+
+  static std::mutex m_FlightLock;
+  static std::condition_variable m_FlightDone;
+  // By case-folded destination path.
+  static std::map<std::wstring, std::shared_ptr<Flight>> m_Flights;
 };
@@ -1,9 +1,20 @@
 #include "MameFs.h"
+#include "CacheLayout.h"
 #include "Downloader.h"
+#include "Trace.h"
+#include "TransferScheduler.h"
+#include <algorithm>
+#include <atomic>
 #include <filesystem>
 #include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <vector>
 #include <winfsp/winfsp.h>
 
 // PathCombine
@@ -16,6 +27,28 @@ static UINT64 FileTimeToInt64(const FILETIME &ft) {
   return ((UINT64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
 }
 
+// Zip central directories larger than this are not pinned.
+static const UINT64 kMaxPinnedTail = 4 * 1024 * 1024;
+// Closed contexts kept around for reuse.
+static const size_t kMaxPooledContexts = 256;
+// Overlapped reads in flight per open file; past this SRead blocks instead.
+static const UINT32 kMaxOutstandingReads = 4;
+// Threads completing overlapped reads.
+static const UINT32 kCompletionThreads = 2;
+// How often the usage history is saved and the warm set reconsidered.
+static const DWORD kHistoryIntervalMs = 60 * 1000;
+// Quiet time after the last launch before warming runs again.
+static const UINT64 kWarmIdleMs = 5 * 60 * 1000;
+// Wait before retrying a set that could not be warmed.
+static const UINT64 kWarmRetryMs = 30 * 60 * 1000;
+
+// Root entry of a sharded cache, listed from the catalog.
+struct ListedArchive {
+  std::wstring Name;
+  UINT64 Size;
+  UINT64 Time;
+};
+
 struct MameFileContext {
   HANDLE Handle;
   HANDLE FindHandle;
@@ -23,24 +56,168 @@ struct MameFileContext {
   bool IsDirectory;
   std::wstring Path;
 
+  // Archive read path state (SRead).
+  bool IsArchive;
+  UINT64 FileSize;
+  UINT64 CacheKey; // identifies this version of the file in m_BlockCache
+  std::mutex PatternLock;
+  AccessPattern Pattern;
+  std::atomic<UINT32> Reads;
+  std::atomic<UINT32> ReadSyscalls;
+  bool AsyncReads; // Handle is attached to m_FileIo
+  std::atomic<UINT32> Outstanding;
+
+  std::shared_ptr<ChdStream> Chd; // streamed CHD; SRead fetches first
+
+  // Sharded root: SReadDirectory lists the catalog instead of the disk.
+  bool ListCatalog;
+  std::vector<ListedArchive> Listing; // sorted case-insensitively
+  size_t ListingPos;
+
   MameFileContext()
       : Handle(INVALID_HANDLE_VALUE), FindHandle(INVALID_HANDLE_VALUE),
-        IsDirectory(false) {
+        IsDirectory(false), IsArchive(false), FileSize(0),
+        CacheKey(0), Reads(0), ReadSyscalls(0), AsyncReads(false),
+        Outstanding(0), ListCatalog(false), ListingPos(0) {
     memset(&FindData, 0, sizeof(FindData));
   }
 };
 
-static UINT64 GetPathHash(const std::wstring &path) {
-  std::wstring lowerPath = path;
-  for (auto &c : lowerPath)
-    c = towlower(c);
-  std::hash<std::wstring> hasher;
-  return (UINT64)hasher(lowerPath);
+// Positioned read on a cache file handle, counted for the read statistics.
+static AsyncFileIo::ReadResult ReadAt(MameFileContext *ctx, BlockCache &cache,
+                                      UINT64 offset, void *buffer,
+                                      DWORD length) {
+  ctx->ReadSyscalls++;
+  cache.GetStats().ReadSyscalls++;
+  AsyncFileIo::ReadResult result = AsyncFileIo::ReadSync(
+      (AsyncFileIo::NativeFile)ctx->Handle, offset, buffer, length);
+  cache.GetStats().BytesFromDisk += result.Bytes;
+  return result;
+}
+
+// Uncached read straight into the caller's buffer.
+static NTSTATUS PlainRead(MameFileContext *ctx, BlockCache &cache,
+                          PVOID Buffer, UINT64 Offset, ULONG Length,
+                          PULONG PBytesTransferred) {
+  AsyncFileIo::ReadResult result = ReadAt(ctx, cache, Offset, Buffer, Length);
+  if (result.Status == AsyncFileIo::ReadStatus::EndOfFile) {
+    *PBytesTransferred = 0;
+    return STATUS_END_OF_FILE;
+  }
+  if (!result.Ok()) {
+    std::wcerr << L"SRead failed: " << result.SystemError << std::endl;
+    return STATUS_UNSUCCESSFUL;
+  }
+  DWORD bytesRead = result.Bytes;
+
+  // Debug partial reads
+  if (bytesRead < Length) {
+    // Check if EOF?
+    // We can't easily check EOF without another call or knowing size.
+    // But for now let's just log it if it's suspicious.
+    // actually, short reads are valid at EOF.
+    // Let's explicitly check if we are at EOF.
+    BY_HANDLE_FILE_INFORMATION info;
+    if (GetFileInformationByHandle(ctx->Handle, &info)) {
+      UINT64 size = ((UINT64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+      if (Offset + bytesRead < size) {
+        std::wcerr << L"WARNING: SRead partial read in middle of file! Req="
+                   << Length << L" Read=" << bytesRead << L" Off=" << Offset
+                   << L" Size=" << size << std::endl;
+      }
+    }
+  }
+
+  *PBytesTransferred = bytesRead;
+  return STATUS_SUCCESS;
+}
+
+// Takes one of the file's overlapped read slots, if it has any free.
+static bool TryBeginAsync(MameFileContext *ctx) {
+  if (!ctx->AsyncReads)
+    return false;
+  if (ctx->Outstanding.fetch_add(1) < kMaxOutstandingReads)
+    return true;
+  ctx->Outstanding--;
+  return false;
+}
+
+// Answers a Read that SRead returned STATUS_PENDING for.
+static void CompleteRead(FSP_FILE_SYSTEM *FileSystem, UINT64 hint,
+                         NTSTATUS status, ULONG bytes) {
+  FSP_FSCTL_TRANSACT_RSP response;
+  memset(&response, 0, sizeof(response));
+  response.Size = sizeof(response);
+  response.Kind = FspFsctlTransactReadKind;
+  response.Hint = hint;
+  response.IoStatus.Status = status;
+  response.IoStatus.Information = bytes;
+  FspFileSystemSendResponse(FileSystem, &response);
+}
+
+// Fills in a context and WinFsp's view of a cache file just opened.
+static void FillOpenInfo(MameFileContext *ctx,
+                         const BY_HANDLE_FILE_INFORMATION &info,
+                         bool isArchive, UINT64 pathHash,
+                         FSP_FSCTL_FILE_INFO *FileInfo) {
+  ctx->IsDirectory = (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+  ctx->IsArchive = isArchive;
+  ctx->FileSize = ((UINT64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+  // Mixing in size and mtime keeps blocks of a replaced copy apart.
+  ctx->CacheKey =
+      pathHash ^
+      (FileTimeToInt64(info.ftLastWriteTime) * 0x9E3779B97F4A7C15ull) ^
+      ctx->FileSize;
+  FileInfo->FileAttributes = info.dwFileAttributes;
+  FileInfo->ReparseTag = 0;
+  FileInfo->AllocationSize = ctx->FileSize;
+  FileInfo->FileSize = FileInfo->AllocationSize;
+  FileInfo->CreationTime = FileTimeToInt64(info.ftCreationTime);
+  FileInfo->LastAccessTime = FileTimeToInt64(info.ftLastAccessTime);
+  FileInfo->LastWriteTime = FileTimeToInt64(info.ftLastWriteTime);
+  FileInfo->ChangeTime = FileInfo->LastWriteTime;
+  FileInfo->IndexNumber = pathHash;
+  FileInfo->HardLinks = 1; // Force 1 to pacify usage limits "Too many
+                           // links" error in MAME/unzip
+}
+
+// Bookkeeping files that must never show up in the virtual namespace:
+// in-progress downloads ("<name>.part" plus "<name>.part.journal"), CHD
+// block bitmaps, the cache catalog and the CacheLayout marker and empty
+// directory.
+static bool IsInternalCacheFile(const wchar_t *name) {
+  size_t len = wcslen(name);
+  auto endsWith = [&](const wchar_t *suffix) {
+    size_t n = wcslen(suffix);
+    return len >= n && _wcsicmp(name + len - n, suffix) == 0;
+  };
+  return endsWith(L".part") || endsWith(L".part.journal") ||
+         endsWith(L".part.journal.tmp") || endsWith(L".hunks") ||
+         _wcsicmp(name, L"mcr.catalog") == 0 ||
+         _wcsicmp(name, L"mcr.catalog.tmp") == 0 ||
+         _wcsicmp(name, L"mcr.layout") == 0 ||
+         _wcsicmp(name, L"mcr.usage") == 0 ||
+         _wcsicmp(name, L"mcr.usage.tmp") == 0 ||
+         _wcsicmp(name, L"mcr.empty") == 0;
 }
 
 std::wstring MameFs::m_CacheDir;
 std::wstring MameFs::m_BaseUrl;
+std::wstring MameFs::m_ChdUrl;
 bool MameFs::m_Enable7z = false;
+bool MameFs::m_Revalidate = true;
+bool MameFs::m_Sharded = false;
+CacheCatalog MameFs::m_Catalog;
+BlockCache MameFs::m_BlockCache;
+Revalidator MameFs::m_Revalidator;
+CacheServer MameFs::m_Server;
+AsyncFileIo MameFs::m_FileIo;
+PathTable MameFs::m_Paths;
+UsageHistory MameFs::m_History;
+LaunchDetector MameFs::m_Launches;
+UINT64 MameFs::m_CacheDirHash = CacheCatalog::kHashSeed;
+std::mutex MameFs::m_ContextPoolLock;
+std::vector<MameFileContext *> MameFs::m_FreeContexts;
 
 std::wstring MameFs::GetLocalPath(PCWSTR fileName) {
   // Skip leading slash of fileName if present to append cleanly?
@@ -52,20 +229,295 @@ std::wstring MameFs::GetLocalPath(PCWSTR fileName) {
   // Simple concat if we ensure m_CacheDir doesn't end with slash and fileName
   // starts with slash.
   if (fileName[0] == L'\\') {
+    if (m_Sharded)
+      return m_CacheDir + CacheLayout::ShardDir(fileName) + fileName;
     return m_CacheDir + fileName;
   }
   return m_CacheDir + L"\\" + fileName;
 }
 
-int MameFs::Run(const std::wstring &mountPoint, const std::wstring &cacheDir,
-                const std::wstring &baseUrl, bool enable7z) {
-  m_CacheDir = cacheDir;
-  m_BaseUrl = baseUrl;
-  m_Enable7z = enable7z;
+std::wstring MameFs::GetRemoteUrl(const std::wstring &fileName) {
+  bool isZip = (fileName.length() > 4 &&
+                fileName.substr(fileName.length() - 4) == L".zip");
+  bool is7z = (fileName.length() > 3 &&
+               fileName.substr(fileName.length() - 3) == L".7z");
+
+  std::wstring url = m_BaseUrl;
+  if (url.back() == L'/')
+    url.pop_back();
+
+  if (isZip) {
+    if (url.find(L"/standalone") != std::wstring::npos) {
+      size_t pos = url.find(L"/standalone");
+      url.replace(pos, 11, L"/split");
+    } else if (url.find(L"/split") == std::wstring::npos) {
+      if (url.back() != L'/')
+        url += L"/";
+      url += L"split";
+    }
+  } else if (is7z) {
+    if (url.find(L"/split") != std::wstring::npos) {
+      size_t pos = url.find(L"/split");
+      url.replace(pos, 6, L"/standalone");
+    } else if (url.find(L"/standalone") == std::wstring::npos) {
+      if (url.back() != L'/')
+        url += L"/";
+      url += L"standalone";
+    }
+  } else {
+    return L"";
+  }
 
-  // Ensure cache dir exists
+  // Append filename (convert \ to /)
+  std::wstring relPath = fileName;
+  for (auto &c : relPath)
+    if (c == L'\\')
+      c = L'/';
+  url += relPath;
+  return url;
+}
+
+std::wstring MameFs::GetArchiveUrl(const std::wstring &fileName) {
+  // Honor -7z the same way SOpen does.
+  if (!m_Enable7z && fileName.length() > 3 &&
+      fileName.substr(fileName.length() - 3) == L".7z")
+    return L"";
+  return GetRemoteUrl(fileName);
+}
+
+void MameFs::AttachRevalidator() {
+  m_Revalidator.Attach(
+      &m_Catalog, GetArchiveUrl,
+      [](const std::wstring &name) { return GetLocalPath(name.c_str()); });
+}
+
+// Counts a launch for the archive that starts a burst of opens; the repeat
+// opens of one launch, and its dependencies, cost a couple of exchanges.
+void MameFs::NoteArchiveOpen(PathEntry *path) {
+  if (m_Launches.IsLaunch(path->LastOpened, GetTickCount64()))
+    m_History.RecordLaunch(path->Name);
+}
+
+// Saves the usage history and keeps the predicted sets cached: once at
+// startup, then whenever MAME has been quiet for a while. Sets that fail
+// (network down, not on the server) are retried after kWarmRetryMs.
+void MameFs::HistoryLoop(UINT32 warmSets, std::wstring datPath) {
+  Prefetcher prefetcher;
+  prefetcher.Attach(
+      &m_Catalog, GetArchiveUrl,
+      [](const std::wstring &name) { return GetLocalPath(name.c_str()); });
+  std::set<std::wstring> warmed;         // case-folded
+  std::map<std::wstring, UINT64> failed; // case-folded -> GetTickCount64
+  bool startup = true;
+  while (true) {
+    if (warmSets && (startup || m_History.IdleFor() >= kWarmIdleMs)) {
+      UINT64 now = GetTickCount64();
+      std::vector<std::wstring> pending;
+      for (const auto &set : m_History.Top(warmSets)) {
+        auto it = failed.find(set);
+        if (!warmed.count(set) &&
+            (it == failed.end() || now - it->second >= kWarmRetryMs))
+          pending.push_back(set);
+      }
+      if (!pending.empty()) {
+        PrefetchOptions warm;
+        warm.Names = pending;
+        warm.DatPath = datPath; // adds parents, BIOS and devices
+        warm.Priority = TransferPriority::Background;
+        std::wcout << L"Warming " << pending.size()
+                   << L" of the most played sets..." << std::endl;
+        std::vector<std::wstring> failures;
+        prefetcher.Run(
+            warm, TransferScheduler::Capacity(TransferPriority::Background),
+            &failures);
+        std::set<std::wstring> bad;
+        for (auto name : failures) {
+          for (auto &c : name)
+            c = towlower(c);
+          bad.insert(name);
+        }
+        // A failed dependency can't be pinned on the sets that need it, so
+        // it holds back the whole pass.
+        bool dependencyFailed = false;
+        for (const auto &name : bad)
+          if (std::find(pending.begin(), pending.end(), name) ==
+              pending.end())
+            dependencyFailed = true;
+        for (const auto &set : pending) {
+          if (dependencyFailed || bad.count(set)) {
+            failed[set] = now;
+          } else {
+            warmed.insert(set);
+            failed.erase(set);
+          }
+        }
+      }
+      startup = false;
+    }
+    if (!m_History.Save())
+      std::wcerr << L"Cannot save the usage history." << std::endl;
+    Sleep(kHistoryIntervalMs);
+  }
+}
+
+// Downloads an archive into the cache for the cache server, recording it in
+// the catalog the same way SOpen does.
+bool MameFs::FillArchive(const std::wstring &fileName) {
+  std::wstring url = GetArchiveUrl(fileName);
+  if (url.empty())
+    return false;
+  std::wstring localPath = GetLocalPath(fileName.c_str());
+
+  m_Catalog.MarkDownloading(fileName.c_str());
+  DownloadInfo info;
+  if (!Downloader::Download(url, localPath, &info)) {
+    m_Catalog.Remove(fileName.c_str());
+    return false;
+  }
+  if (info.Validator.Size == 0) {
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (GetFileAttributesExW(localPath.c_str(), GetFileExInfoStandard, &attr))
+      info.Validator.Size =
+          ((UINT64)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+  }
+  m_Catalog.Commit(fileName.c_str(), info);
+  return true;
+}
+
+// Creates the cache directory and settles its layout: sharded if it already
+// is, or if asked to be, in which case a flat cache is migrated first.
+bool MameFs::PrepareCacheDir(const MameFsOptions &options) {
+  m_CacheDir = options.CacheDir;
   CreateDirectoryW(m_CacheDir.c_str(), NULL);
 
+  m_Sharded = CacheLayout::IsSharded(m_CacheDir);
+  if (options.Shard && !m_Sharded) {
+    // Holding the catalog keeps another mcr from mounting mid-move, and
+    // failing to get it means one is already serving the flat layout.
+    if (!m_Catalog.Open(m_CacheDir, false)) {
+      std::wcerr << L"Cannot move " << m_CacheDir
+                 << L" to the sharded layout"
+                 << (m_Catalog.InUse() ? L" while another mcr is using it."
+                                       : L" without its catalog.")
+                 << std::endl;
+      return false;
+    }
+    std::wcout << L"Moving " << m_CacheDir
+               << L" to the sharded layout..." << std::endl;
+    bool migrated = CacheLayout::MigrateToShards(
+        m_CacheDir, (std::max)(1u, std::thread::hardware_concurrency()));
+    m_Catalog.Close();
+    if (!migrated)
+      return false;
+    m_Sharded = true;
+  }
+  if (m_Sharded) {
+    // Every per-set directory probe opens this one instead.
+    CreateDirectoryW((m_CacheDir + L"\\mcr.empty").c_str(), NULL);
+    std::wcout << L"Using the sharded cache layout." << std::endl;
+  }
+  return true;
+}
+
+int MameFs::RevalidateAll(const MameFsOptions &options) {
+  m_BaseUrl = options.BaseUrl;
+  m_Enable7z = options.Enable7z;
+  if (!PrepareCacheDir(options))
+    return -1;
+
+  if (!m_Catalog.Open(m_CacheDir, m_Sharded)) {
+    std::wcerr << L"Cannot open the cache catalog in " << m_CacheDir
+               << std::endl;
+    return -1;
+  }
+  AttachRevalidator();
+  // As many workers as the scheduler would admit, so none sits queued.
+  m_Revalidator.RevalidateAll(
+      TransferScheduler::Capacity(TransferPriority::Background), 32);
+  return 0;
+}
+
+int MameFs::Prefetch(const MameFsOptions &options,
+                     const PrefetchOptions &prefetch) {
+  m_BaseUrl = options.BaseUrl;
+  m_Enable7z = options.Enable7z;
+  if (!PrepareCacheDir(options))
+    return -1;
+
+  if (!m_Catalog.Open(m_CacheDir, m_Sharded)) {
+    if (!m_Catalog.InUse()) {
+      std::wcerr << L"Cannot open the cache catalog in " << m_CacheDir
+                 << std::endl;
+      return -1;
+    }
+    // A running mount owns it; it adopts what we fetch on the next open.
+    std::wcout << L"Prefetching without the catalog." << std::endl;
+  }
+
+  // Workers beyond what the scheduler admits would only sit in Acquire, so
+  // size the pool to the transfer limits rather than the core count.
+  Prefetcher prefetcher;
+  prefetcher.Attach(
+      &m_Catalog, GetArchiveUrl,
+      [](const std::wstring &name) { return GetLocalPath(name.c_str()); });
+  size_t failed = prefetcher.Run(
+      prefetch, TransferScheduler::Capacity(TransferPriority::Prefetch));
+  return failed == 0 ? 0 : 1;
+}
+
+int MameFs::Run(const MameFsOptions &options) {
+  const std::wstring &mountPoint = options.MountPoint;
+  m_BaseUrl = options.BaseUrl;
+  m_ChdUrl = options.ChdUrl;
+  m_Enable7z = options.Enable7z;
+  m_BlockCache.SetCapacity(options.ReadCacheMB * 1024 * 1024);
+  m_FreeContexts.reserve(kMaxPooledContexts);
+  m_FileIo.Start(kCompletionThreads);
+
+  // Ensure cache dir exists
+  if (!PrepareCacheDir(options))
+    return -1;
+  m_CacheDirHash = PathTable::HashPath(m_CacheDir);
+
+  if (!m_Catalog.Open(m_CacheDir, m_Sharded))
+    std::wcerr << L"Catalog unavailable, falling back to filesystem lookups."
+               << std::endl;
+
+  m_Revalidate = options.Revalidate;
+  AttachRevalidator();
+  if (m_Revalidate)
+    m_Revalidator.StartWorker();
+
+  // The history is always kept, so -warm has something to go on later.
+  m_History.Load(m_CacheDir);
+  if (!options.FavoritesPath.empty()) {
+    size_t favorites = m_History.ImportFavorites(options.FavoritesPath);
+    std::wcout << L"Imported " << favorites << L" favorites." << std::endl;
+  }
+  std::thread(&MameFs::HistoryLoop, options.WarmSets, options.WarmDatPath)
+      .detach();
+
+  if (options.ServePort != 0) {
+    m_Server.Attach(
+        [](const std::wstring &name) { return GetLocalPath(name.c_str()); },
+        FillArchive,
+        [](const std::wstring &name) {
+          // Served hits count as use, and keep this upstream cache fresh.
+          m_Catalog.Touch(name.c_str());
+          if (m_Revalidate)
+            m_Revalidator.Enqueue(name.c_str());
+        });
+    if (!m_Server.Start(options.ServePort))
+      return -1;
+  }
+  if (!options.Mount) {
+    std::wcout << L"Not mounting; serving the cache only. Press Ctrl+C to "
+                  L"stop."
+               << std::endl;
+    while (true)
+      Sleep(10000);
+  }
+
   FSP_FILE_SYSTEM *FileSystem = NULL;
   FSP_FILE_SYSTEM_INTERFACE *Interface = new FSP_FILE_SYSTEM_INTERFACE();
   memset(Interface, 0, sizeof(*Interface));
@@ -206,53 +658,72 @@ NTSTATUS MameFs::SCreate(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
 NTSTATUS MameFs::SOpen(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
                        UINT32 CreateOptions, UINT32 GrantedAccess,
                        PVOID *PFileContext, FSP_FSCTL_FILE_INFO *FileInfo) {
+  Trace::Span trace("fs", "open", FileName);
   try {
-    std::wcout << L"DEBUG: SOpen " << FileName << std::endl;
-    std::wstring localPath = GetLocalPath(FileName);
-
     // Heuristic: Is this an archive or a split file?
-    std::wstring fileNameStr = FileName;
-    bool isZip = (fileNameStr.length() > 4 &&
-                  fileNameStr.substr(fileNameStr.length() - 4) == L".zip");
-    bool is7z = (fileNameStr.length() > 3 &&
-                 fileNameStr.substr(fileNameStr.length() - 3) == L".7z");
-    bool isRoot = (wcscmp(FileName, L"\\") == 0);
+    PathClass cls = PathTable::Classify(FileName, m_CacheDirHash);
+    bool isZip = (cls.Kind == PathKind::Zip);
+    bool is7z = (cls.Kind == PathKind::SevenZip);
+    bool isRoot = (cls.Kind == PathKind::Root);
     bool isDirectoryRequest = (CreateOptions & FILE_DIRECTORY_FILE);
+    if ((isZip || is7z) && !isDirectoryRequest &&
+        OpenCachedArchive(FileName, cls.Length, cls.NameHash, PFileContext,
+                          FileInfo))
+      return STATUS_SUCCESS;
+
+    std::wcout << L"DEBUG: SOpen " << FileName << std::endl;
+    std::wstring localPath = GetLocalPath(FileName);
+    // Sharded, per-set directory probes all open one empty directory, so
+    // the cache doesn't fill up with a directory per set.
+    if (m_Sharded && isDirectoryRequest && !isRoot)
+      localPath = m_CacheDir + L"\\mcr.empty";
+    bool catalogHit = false;
+    bool downloaded = false;
+    DownloadInfo downloadInfo;
 
     // If it's a directory or root, handle normally (create/open local dir).
     if (isRoot || isDirectoryRequest) {
       if (GetFileAttributesW(localPath.c_str()) == INVALID_FILE_ATTRIBUTES) {
         std::filesystem::create_directories(localPath);
       }
+    } else if (cls.Kind == PathKind::Chd && !m_ChdUrl.empty()) {
+      return OpenChd(FileName, localPath, cls.PathHash, PFileContext,
+                     FileInfo);
     } else if (!isZip && !is7z) {
       // It is a single file request (e.g., \sf2ce\rom.bin).
       // PER USER REQUEST: DO NOT SERVE IT. DO NOT DOWNLOAD IT.
       // Instead, ensure parent ZIP exists, then return NOT FOUND.
 
-      std::filesystem::path p(localPath);
-      if (p.has_parent_path()) {
-        std::filesystem::path parentDir = p.parent_path(); // e.g. ...\sf2ce
-        // Check if parent directory name matches the expected zip name pattern
-        // logic
-        std::wstring parentDirName = parentDir.filename().wstring();
-        if (parentDirName != L"mamecache" &&
-            !parentDirName.empty()) { // Avoid root cache dir itself
-          std::wstring zipFileName = parentDirName + L".zip";
-          std::filesystem::path cacheRoot = parentDir.parent_path();
-          std::filesystem::path zipPath = cacheRoot / zipFileName;
-
-          // Proactively download ZIP if missing
-          if (!std::filesystem::exists(zipPath)) {
-            std::wstring zipUrl = m_BaseUrl;
-            if (zipUrl.back() == L'/')
-              zipUrl.pop_back();
-            zipUrl += L"/split/" + zipFileName;
-
-            std::wcout
-                << L"Split file requested. Triggering proactive ZIP download: "
-                << zipUrl << std::endl;
-            Downloader::Download(zipUrl, zipPath.wstring());
-          }
+      // The set's zip is named after the member's virtual directory, which
+      // keeps this independent of where the zip is stored.
+      size_t slash = std::wstring(FileName).rfind(L'\\');
+      if (slash != std::wstring::npos && slash > 0) {
+        std::wstring virtualDir(FileName, slash);
+        std::wstring zipFileName =
+            virtualDir.substr(virtualDir.rfind(L'\\') + 1) + L".zip";
+        std::wstring zipVirtualName = virtualDir + L".zip";
+        std::wstring zipPath = GetLocalPath(zipVirtualName.c_str());
+
+        // Proactively download ZIP if missing
+        CatalogEntry entry;
+        bool cached = m_Catalog.Lookup(zipVirtualName.c_str(), &entry) &&
+                      entry.State == CatalogState::Complete;
+        if (!cached &&
+            GetFileAttributesW(zipPath.c_str()) == INVALID_FILE_ATTRIBUTES) {
+          std::wstring zipUrl = m_BaseUrl;
+          if (zipUrl.back() == L'/')
+            zipUrl.pop_back();
+          zipUrl += L"/split/" + zipFileName;
+
+          std::wcout
+              << L"Split file requested. Triggering proactive ZIP download: "
+              << zipUrl << std::endl;
+          m_Catalog.MarkDownloading(zipVirtualName.c_str());
+          DownloadInfo info;
+          if (Downloader::Download(zipUrl, zipPath, &info))
+            m_Catalog.Commit(zipVirtualName.c_str(), info);
+          else
+            m_Catalog.Remove(zipVirtualName.c_str());
         }
       }
 
@@ -260,57 +731,39 @@ NTSTATUS MameFs::SOpen(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
       return STATUS_OBJECT_NAME_NOT_FOUND;
     } else {
       // It IS an archive (.zip or .7z). Handle normal download logic.
-      if (GetFileAttributesW(localPath.c_str()) == INVALID_FILE_ATTRIBUTES) {
-        std::wstring url = m_BaseUrl;
-        if (url.back() == L'/')
-          url.pop_back();
-
-        if (isZip) {
-          if (url.find(L"/standalone") != std::wstring::npos) {
-            size_t pos = url.find(L"/standalone");
-            url.replace(pos, 11, L"/split");
-          } else if (url.find(L"/split") == std::wstring::npos) {
-            if (url.back() != L'/')
-              url += L"/";
-            url += L"split";
-          }
+      // A catalog hit means it is cached; skip the attribute probe.
+      CatalogEntry entry;
+      catalogHit = m_Catalog.Lookup(FileName, &entry, cls.NameHash) &&
+                   entry.State == CatalogState::Complete;
+      if (!catalogHit &&
+          GetFileAttributesW(localPath.c_str()) == INVALID_FILE_ATTRIBUTES) {
+        if (is7z && !m_Enable7z) {
+          std::wcerr << L"Ignored .7z request (7z support disabled)."
+                     << std::endl;
+          return STATUS_OBJECT_NAME_NOT_FOUND;
+        }
+        if (isZip)
           std::wcout << L"Routing .zip request to split directory..."
                      << std::endl;
-        } else if (is7z) {
-          if (!m_Enable7z) {
-            std::wcerr << L"Ignored .7z request (7z support disabled)."
-                       << std::endl;
-            return STATUS_OBJECT_NAME_NOT_FOUND;
-          }
-          if (url.find(L"/split") != std::wstring::npos) {
-            size_t pos = url.find(L"/split");
-            url.replace(pos, 6, L"/standalone");
-          } else if (url.find(L"/standalone") == std::wstring::npos) {
-            if (url.back() != L'/')
-              url += L"/";
-            url += L"standalone";
-          }
+        else
           std::wcout << L"Routing .7z request to standalone directory..."
                      << std::endl;
-        }
-
-        // Append filename (convert \ to /)
-        std::wstring relPath = FileName;
-        for (auto &c : relPath)
-          if (c == L'\\')
-            c = L'/';
-        url += relPath;
+        std::wstring url = GetRemoteUrl(FileName);
 
-        if (!Downloader::Download(url, localPath)) {
+        m_Catalog.MarkDownloading(FileName);
+        if (!Downloader::Download(url, localPath, &downloadInfo)) {
           std::wcerr << L"Download failed for archive: " << url << std::endl;
+          m_Catalog.Remove(FileName);
           return STATUS_OBJECT_NAME_NOT_FOUND;
         }
         std::wcout << L"Download success for archive: " << localPath
                    << std::endl;
+        downloaded = true;
       }
     }
 
-    DWORD fileAttr = GetFileAttributesW(localPath.c_str());
+    DWORD fileAttr = catalogHit ? FILE_ATTRIBUTE_NORMAL
+                                : GetFileAttributesW(localPath.c_str());
     bool isDir = (fileAttr != INVALID_FILE_ATTRIBUTES) &&
                  (fileAttr & FILE_ATTRIBUTE_DIRECTORY);
     DWORD flags = FILE_ATTRIBUTE_NORMAL;
@@ -318,6 +771,9 @@ NTSTATUS MameFs::SOpen(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
       flags |= FILE_FLAG_BACKUP_SEMANTICS;
     if (isZip || is7z)
       flags |= FILE_FLAG_RANDOM_ACCESS;
+    // Archive reads can then complete on m_FileIo instead of blocking.
+    if ((isZip || is7z) && !isDir && m_FileIo.Started())
+      flags |= FILE_FLAG_OVERLAPPED;
 
     HANDLE hFile =
         CreateFileW(localPath.c_str(), GENERIC_READ,
@@ -328,6 +784,13 @@ NTSTATUS MameFs::SOpen(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
       DWORD err = GetLastError();
       std::wcerr << L"CreateFileW failed for " << localPath << L": " << err
                  << std::endl;
+      if (catalogHit &&
+          (err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND)) {
+        // Deleted behind our back; forget it and take the download path.
+        m_Catalog.Remove(FileName);
+        return SOpen(FileSystem, FileName, CreateOptions, GrantedAccess,
+                     PFileContext, FileInfo);
+      }
       if (err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND)
         return STATUS_OBJECT_NAME_NOT_FOUND;
       if (err == ERROR_ACCESS_DENIED)
@@ -337,41 +800,47 @@ NTSTATUS MameFs::SOpen(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
       return STATUS_UNSUCCESSFUL;
     }
 
-    // FileOpened: // Label no longer needed with refactored logic
-    MameFileContext *ctx = new MameFileContext();
+    BY_HANDLE_FILE_INFORMATION info;
+    if (!GetFileInformationByHandle(hFile, &info)) {
+      DWORD err = GetLastError();
+      std::wcerr << L"GetFileInformationByHandle failed in SOpen: " << err
+                 << L" for " << localPath << std::endl;
+      CloseHandle(hFile);
+      return STATUS_UNSUCCESSFUL;
+    }
+
+    MameFileContext *ctx = AcquireContext();
     ctx->Handle = hFile;
     ctx->Path = localPath;
-    ctx->IsDirectory =
-        (GetFileAttributesW(localPath.c_str()) & FILE_ATTRIBUTE_DIRECTORY) != 0;
-    ctx->FindHandle = INVALID_HANDLE_VALUE;
-
+    ctx->AsyncReads = (flags & FILE_FLAG_OVERLAPPED) &&
+                      m_FileIo.Attach((AsyncFileIo::NativeFile)hFile);
+    ctx->ListCatalog = isRoot && m_Sharded;
+    FillOpenInfo(ctx, info, isZip || is7z, cls.PathHash, FileInfo);
+    PinArchiveTail(ctx);
     *PFileContext = ctx;
 
-    BY_HANDLE_FILE_INFORMATION info;
-    if (GetFileInformationByHandle(hFile, &info)) {
-      FileInfo->FileAttributes = info.dwFileAttributes;
-      FileInfo->ReparseTag = 0;
-      FileInfo->AllocationSize =
-          ((UINT64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
-      FileInfo->FileSize = FileInfo->AllocationSize;
-      FileInfo->CreationTime = FileTimeToInt64(info.ftCreationTime);
-      FileInfo->LastAccessTime = FileTimeToInt64(info.ftLastAccessTime);
-      FileInfo->LastWriteTime = FileTimeToInt64(info.ftLastWriteTime);
-      FileInfo->ChangeTime = FileInfo->LastWriteTime;
-      FileInfo->ChangeTime = FileInfo->LastWriteTime;
-      FileInfo->IndexNumber = GetPathHash(localPath);
-      FileInfo->HardLinks = 1; // Force 1 to pacify usage limits "Too many
-                               // links" error in MAME/unzip
-      std::wcout << L"DEBUG: SOpen success, Index=" << FileInfo->IndexNumber
-                 << L", Links=" << FileInfo->HardLinks << std::endl;
-      return STATUS_SUCCESS;
+    if (catalogHit) {
+      m_Catalog.Touch(FileName, cls.NameHash);
+    } else if (isZip || is7z) {
+      // Record fresh downloads, and adopt archives that were already in
+      // the cache directory before the catalog knew about them.
+      if (downloadInfo.Validator.Size == 0)
+        downloadInfo.Validator.Size = FileInfo->FileSize;
+      m_Catalog.Commit(FileName, downloadInfo);
     }
-    DWORD err = GetLastError();
-    std::wcerr << L"GetFileInformationByHandle failed in SOpen: " << err
-               << L" for " << localPath << std::endl;
-    delete ctx;
-    CloseHandle(hFile);
-    return STATUS_UNSUCCESSFUL;
+    if (isZip || is7z) {
+      // Later opens of this archive take OpenCachedArchive.
+      PathEntry *path = m_Paths.Intern(FileName, cls.Length, cls.NameHash,
+                                       localPath, cls.PathHash);
+      NoteArchiveOpen(path);
+      // Served from cache: check freshness in the background.
+      if (!downloaded && m_Revalidate &&
+          !path->RevalidationQueued.exchange(true))
+        m_Revalidator.Enqueue(FileName);
+    }
+    std::wcout << L"DEBUG: SOpen success, Index=" << FileInfo->IndexNumber
+               << L", Links=" << FileInfo->HardLinks << std::endl;
+    return STATUS_SUCCESS;
   } catch (const std::exception &e) {
     std::wcerr << L"Exception in SOpen: " << e.what() << std::endl;
     return STATUS_UNSUCCESSFUL;
@@ -381,6 +850,128 @@ NTSTATUS MameFs::SOpen(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
   }
 }
 
+// SOpen's fast path for archives opened before whose catalog entry is still
+// Complete. Classification, both lookups and the pooled context stay off the
+// heap; anything unusual returns false and takes the full path instead.
+bool MameFs::OpenCachedArchive(PCWSTR fileName, size_t length,
+                               UINT64 nameHash, PVOID *PFileContext,
+                               FSP_FSCTL_FILE_INFO *FileInfo) {
+  PathEntry *path = m_Paths.Find(fileName, length, nameHash);
+  CatalogEntry entry;
+  if (!path || !m_Catalog.Lookup(fileName, &entry, nameHash) ||
+      entry.State != CatalogState::Complete)
+    return false;
+
+  HANDLE hFile = CreateFileW(
+      path->LocalPath.c_str(), GENERIC_READ,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+      OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS |
+          (m_FileIo.Started() ? FILE_FLAG_OVERLAPPED : 0),
+      NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+    return false;
+  BY_HANDLE_FILE_INFORMATION info;
+  if (!GetFileInformationByHandle(hFile, &info)) {
+    CloseHandle(hFile);
+    return false;
+  }
+
+  MameFileContext *ctx = AcquireContext();
+  ctx->Handle = hFile;
+  ctx->Path = path->LocalPath; // reuses the pooled context's buffer
+  ctx->AsyncReads =
+      m_FileIo.Started() && m_FileIo.Attach((AsyncFileIo::NativeFile)hFile);
+  FillOpenInfo(ctx, info, true, path->PathHash, FileInfo);
+  *PFileContext = ctx;
+
+  m_Catalog.Touch(fileName, nameHash);
+  NoteArchiveOpen(path);
+  // Revalidator::Enqueue dedupes as well, but only after copying the name.
+  if (m_Revalidate && !path->RevalidationQueued.exchange(true))
+    m_Revalidator.Enqueue(fileName);
+  return true;
+}
+
+MameFileContext *MameFs::AcquireContext() {
+  {
+    std::lock_guard<std::mutex> guard(m_ContextPoolLock);
+    if (!m_FreeContexts.empty()) {
+      MameFileContext *ctx = m_FreeContexts.back();
+      m_FreeContexts.pop_back();
+      return ctx;
+    }
+  }
+  return new MameFileContext();
+}
+
+void MameFs::ReleaseContext(MameFileContext *ctx) {
+  // Back to a fresh state, except that Path keeps its capacity.
+  ctx->Handle = INVALID_HANDLE_VALUE;
+  ctx->FindHandle = INVALID_HANDLE_VALUE;
+  memset(&ctx->FindData, 0, sizeof(ctx->FindData));
+  ctx->IsDirectory = false;
+  ctx->Path.clear();
+  ctx->IsArchive = false;
+  ctx->FileSize = 0;
+  ctx->CacheKey = 0;
+  ctx->Pattern = AccessPattern();
+  ctx->Reads = 0;
+  ctx->ReadSyscalls = 0;
+  ctx->AsyncReads = false;
+  ctx->Outstanding = 0;
+  ctx->Chd.reset();
+  ctx->ListCatalog = false;
+  std::vector<ListedArchive>().swap(ctx->Listing);
+  ctx->ListingPos = 0;
+  {
+    std::lock_guard<std::mutex> guard(m_ContextPoolLock);
+    if (m_FreeContexts.size() < kMaxPooledContexts) {
+      m_FreeContexts.push_back(ctx);
+      return;
+    }
+  }
+  delete ctx;
+}
+
+// CHDs are too big to download before MAME may open them, so they are
+// streamed: the open only waits for the header and hunk map.
+NTSTATUS MameFs::OpenChd(PCWSTR fileName, const std::wstring &localPath,
+                         UINT64 pathHash, PVOID *PFileContext,
+                         FSP_FSCTL_FILE_INFO *FileInfo) {
+  std::wstring url = m_ChdUrl;
+  if (url.back() == L'/')
+    url.pop_back();
+  for (const wchar_t *c = fileName; *c; ++c)
+    url += (*c == L'\\') ? L'/' : *c;
+
+  std::filesystem::create_directories(
+      std::filesystem::path(localPath).parent_path());
+  std::shared_ptr<ChdStream> stream = ChdStream::Open(url, localPath);
+  if (!stream)
+    return STATUS_OBJECT_NAME_NOT_FOUND;
+
+  HANDLE hFile =
+      CreateFileW(localPath.c_str(), GENERIC_READ,
+                  FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                  OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+    return STATUS_OBJECT_NAME_NOT_FOUND;
+  BY_HANDLE_FILE_INFORMATION info;
+  if (!GetFileInformationByHandle(hFile, &info)) {
+    CloseHandle(hFile);
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  MameFileContext *ctx = AcquireContext();
+  ctx->Handle = hFile;
+  ctx->Path = localPath;
+  ctx->Chd = stream;
+  FillOpenInfo(ctx, info, false, pathHash, FileInfo);
+  *PFileContext = ctx;
+  return STATUS_SUCCESS;
+}
+
 // Helper defines if not present
 #ifndef STATUS_UNSUCCESSFUL
 #define STATUS_UNSUCCESSFUL ((NTSTATUS)0xC0000001L)
@@ -391,6 +982,12 @@ NTSTATUS MameFs::SOpen(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
 void MameFs::SClose(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext) {
   MameFileContext *ctx = (MameFileContext *)FileContext;
   if (ctx) {
+    if (ctx->IsArchive && ctx->Reads > 0) {
+      BlockCache::Stats &stats = m_BlockCache.GetStats();
+      std::wcout << L"DEBUG: SClose " << ctx->Path << L" reads=" << ctx->Reads
+                 << L" syscalls=" << ctx->ReadSyscalls << L" (cache hits "
+                 << stats.Hits << L"/" << stats.Reads << L")" << std::endl;
+    }
     if (ctx->Handle != INVALID_HANDLE_VALUE) {
       // std::wcout << L"DEBUG: SClose Handle " << ctx->Handle << std::endl;
       CloseHandle(ctx->Handle);
@@ -398,7 +995,7 @@ void MameFs::SClose(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext) {
     if (ctx->FindHandle != INVALID_HANDLE_VALUE) {
       FindClose(ctx->FindHandle);
     }
-    delete ctx;
+    ReleaseContext(ctx);
   }
 }
 
@@ -415,6 +1012,59 @@ NTSTATUS MameFs::SOverwrite(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext,
   return STATUS_MEDIA_WRITE_PROTECTED;
 }
 
+void MameFs::PinArchiveTail(MameFileContext *ctx) {
+  // Zip readers start at the end-of-central-directory record and then walk
+  // the whole central directory, so keep that region in memory. This runs
+  // on SOpen's slow path only, outside any per-file lock; the pin outlives
+  // the handle. OpenCachedArchive must not allocate or block on reads, so a
+  // pin evicted later, or a copy replaced since, is left to the block cache.
+  if (!ctx->IsArchive || ctx->IsDirectory || !m_BlockCache.Enabled() ||
+      ctx->FileSize == 0 || m_BlockCache.IsPinned(ctx->CacheKey))
+    return;
+
+  const UINT64 kEocdSize = 22;
+  UINT64 tailSize = (std::min)(ctx->FileSize, (UINT64)65535 + kEocdSize);
+  UINT64 tailStart = ctx->FileSize - tailSize;
+  std::vector<BYTE> tail((size_t)tailSize);
+  AsyncFileIo::ReadResult read =
+      ReadAt(ctx, m_BlockCache, tailStart, tail.data(), (DWORD)tailSize);
+  if (!read.Ok() || read.Bytes != tailSize)
+    return;
+
+  auto u32 = [&](size_t at) {
+    return (UINT32)tail[at] | ((UINT32)tail[at + 1] << 8) |
+           ((UINT32)tail[at + 2] << 16) | ((UINT32)tail[at + 3] << 24);
+  };
+
+  // Scan backwards for the EOCD signature; a trailing comment may follow it.
+  for (size_t i = tailSize >= kEocdSize ? (size_t)(tailSize - kEocdSize) + 1
+                                        : 0;
+       i-- > 0;) {
+    if (u32(i) != 0x06054b50)
+      continue;
+    UINT64 cdSize = u32(i + 12);
+    UINT64 cdOffset = u32(i + 16);
+    if (cdOffset + cdSize > ctx->FileSize ||
+        ctx->FileSize - cdOffset > kMaxPinnedTail)
+      break; // Zip64 or damaged; fall back to pinning the raw tail.
+
+    if (cdOffset >= tailStart) {
+      tail.erase(tail.begin(), tail.begin() + (size_t)(cdOffset - tailStart));
+      m_BlockCache.Pin(ctx->CacheKey, cdOffset, std::move(tail));
+      return;
+    }
+    std::vector<BYTE> region((size_t)(ctx->FileSize - cdOffset));
+    read = ReadAt(ctx, m_BlockCache, cdOffset, region.data(),
+                  (DWORD)region.size());
+    if (read.Ok() && read.Bytes == region.size()) {
+      m_BlockCache.Pin(ctx->CacheKey, cdOffset, std::move(region));
+      return;
+    }
+    break;
+  }
+  m_BlockCache.Pin(ctx->CacheKey, tailStart, std::move(tail));
+}
+
 NTSTATUS MameFs::SRead(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext,
                        PVOID Buffer, UINT64 Offset, ULONG Length,
                        PULONG PBytesTransferred) {
@@ -422,41 +1072,128 @@ NTSTATUS MameFs::SRead(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext,
   if (!ctx || ctx->Handle == INVALID_HANDLE_VALUE)
     return STATUS_INVALID_HANDLE;
 
-  OVERLAPPED ov = {0};
-  ov.Offset = (DWORD)Offset;
-  ov.OffsetHigh = (DWORD)(Offset >> 32);
+  Trace::Span trace("fs", "read", ctx->Path.c_str());
+  ctx->Reads++;
 
-  DWORD bytesRead = 0;
-  if (!ReadFile(ctx->Handle, Buffer, Length, &bytesRead, &ov)) {
-    DWORD err = GetLastError();
-    if (err == ERROR_HANDLE_EOF) {
+  // A streamed CHD is read from its sparse local copy like any other file,
+  // once the blocks asked for have arrived.
+  if (ctx->Chd && !ctx->Chd->Ensure(Offset, Length))
+    return STATUS_UNSUCCESSFUL;
+
+  // Archives go through the shared block cache: pinned central directory,
+  // whole-block reads for small scattered requests, and read-ahead on
+  // sequential runs.
+  if (ctx->IsArchive && m_BlockCache.Enabled() &&
+      Length <= BlockCache::kMaxReadAhead) {
+    if (Offset >= ctx->FileSize) {
       *PBytesTransferred = 0;
       return STATUS_END_OF_FILE;
     }
-    std::wcerr << L"SRead failed: " << err << std::endl;
-    return STATUS_UNSUCCESSFUL;
-  }
+    ULONG length = (ULONG)(std::min)((UINT64)Length, ctx->FileSize - Offset);
 
-  // Debug partial reads
-  if (bytesRead < Length) {
-    // Check if EOF?
-    // We can't easily check EOF without another call or knowing size.
-    // But for now let's just log it if it's suspicious.
-    // actually, short reads are valid at EOF.
-    // Let's explicitly check if we are at EOF.
-    BY_HANDLE_FILE_INFORMATION info;
-    if (GetFileInformationByHandle(ctx->Handle, &info)) {
-      UINT64 size = ((UINT64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
-      if (Offset + bytesRead < size) {
-        std::wcerr << L"WARNING: SRead partial read in middle of file! Req="
-                   << Length << L" Read=" << bytesRead << L" Off=" << Offset
-                   << L" Size=" << size << std::endl;
-      }
+    UINT32 readAhead;
+    {
+      std::lock_guard<std::mutex> guard(ctx->PatternLock);
+      readAhead = ctx->Pattern.Update(Offset, length);
     }
+
+    if (m_BlockCache.Read(ctx->CacheKey, Offset, Buffer, length)) {
+      *PBytesTransferred = length;
+      return STATUS_SUCCESS;
+    }
+
+    UINT64 spanStart, spanEnd;
+    m_BlockCache.SpanFor(ctx->CacheKey, ctx->FileSize, Offset, length,
+                         readAhead, spanStart, spanEnd);
+
+    if (TryBeginAsync(ctx) && ReadSpanAsync(FileSystem, ctx, spanStart,
+                                            spanEnd, Buffer, Offset, length))
+      return STATUS_PENDING;
+
+    std::vector<BYTE> span((size_t)(spanEnd - spanStart));
+    AsyncFileIo::ReadResult read =
+        ReadAt(ctx, m_BlockCache, spanStart, span.data(), (DWORD)span.size());
+    if (read.Ok() && spanStart + read.Bytes >= Offset + length) {
+      m_BlockCache.InsertSpan(ctx->CacheKey, ctx->FileSize, spanStart,
+                              span.data(), read.Bytes);
+      memcpy(Buffer, span.data() + (Offset - spanStart), length);
+      *PBytesTransferred = length;
+      return STATUS_SUCCESS;
+    }
+    // Fall through to a plain read, which reports the error properly.
   }
 
-  *PBytesTransferred = bytesRead;
-  return STATUS_SUCCESS;
+  if (TryBeginAsync(ctx) && ReadAsync(FileSystem, ctx, Buffer, Offset, Length))
+    return STATUS_PENDING;
+  return PlainRead(ctx, m_BlockCache, Buffer, Offset, Length,
+                   PBytesTransferred);
+}
+
+// Cache-miss half of SRead on the completion port. The callback finishes
+// with ctx before answering, since WinFsp may close the file right after.
+bool MameFs::ReadSpanAsync(FSP_FILE_SYSTEM *FileSystem, MameFileContext *ctx,
+                           UINT64 spanStart, UINT64 spanEnd, PVOID Buffer,
+                           UINT64 Offset, ULONG Length) {
+  UINT64 hint = FspFileSystemGetOperationContext()->Request->Hint;
+  auto span =
+      std::make_shared<std::vector<BYTE>>((size_t)(spanEnd - spanStart));
+  UINT64 issuedAt = Trace::Enabled() ? Trace::Now() : 0;
+  ctx->ReadSyscalls++;
+  m_BlockCache.GetStats().ReadSyscalls++;
+  bool issued = m_FileIo.Read(
+      (AsyncFileIo::NativeFile)ctx->Handle, spanStart, span->data(),
+      (DWORD)span->size(), [=](const AsyncFileIo::ReadResult &result) {
+        m_BlockCache.GetStats().BytesFromDisk += result.Bytes;
+        NTSTATUS status = STATUS_SUCCESS;
+        ULONG transferred = 0;
+        if (result.Ok() && spanStart + result.Bytes >= Offset + Length) {
+          m_BlockCache.InsertSpan(ctx->CacheKey, ctx->FileSize, spanStart,
+                                  span->data(), result.Bytes);
+          memcpy(Buffer, span->data() + (Offset - spanStart), Length);
+          transferred = Length;
+        } else {
+          status = PlainRead(ctx, m_BlockCache, Buffer, Offset, Length,
+                             &transferred);
+        }
+        if (issuedAt)
+          Trace::Record("io", "async read", issuedAt, Trace::Now(),
+                        ctx->Path.c_str());
+        ctx->Outstanding--;
+        CompleteRead(FileSystem, hint, status, transferred);
+      });
+  if (!issued)
+    ctx->Outstanding--;
+  return issued;
+}
+
+// Uncached SRead on the completion port, straight into WinFsp's buffer.
+bool MameFs::ReadAsync(FSP_FILE_SYSTEM *FileSystem, MameFileContext *ctx,
+                       PVOID Buffer, UINT64 Offset, ULONG Length) {
+  UINT64 hint = FspFileSystemGetOperationContext()->Request->Hint;
+  UINT64 issuedAt = Trace::Enabled() ? Trace::Now() : 0;
+  ctx->ReadSyscalls++;
+  m_BlockCache.GetStats().ReadSyscalls++;
+  bool issued = m_FileIo.Read(
+      (AsyncFileIo::NativeFile)ctx->Handle, Offset, Buffer, Length,
+      [=](const AsyncFileIo::ReadResult &result) {
+        m_BlockCache.GetStats().BytesFromDisk += result.Bytes;
+        NTSTATUS status = STATUS_SUCCESS;
+        ULONG got = result.Bytes;
+        if (result.Status == AsyncFileIo::ReadStatus::EndOfFile) {
+          status = STATUS_END_OF_FILE;
+        } else if (!result.Ok()) {
+          std::wcerr << L"SRead failed: " << result.SystemError << std::endl;
+          status = STATUS_UNSUCCESSFUL;
+        }
+        if (issuedAt)
+          Trace::Record("io", "async read", issuedAt, Trace::Now(),
+                        ctx->Path.c_str());
+        ctx->Outstanding--;
+        CompleteRead(FileSystem, hint, status, got);
+      });
+  if (!issued)
+    ctx->Outstanding--;
+  return issued;
 }
 
 NTSTATUS MameFs::SGetFileInfo(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext,
@@ -494,6 +1231,10 @@ NTSTATUS MameFs::SReadDirectory(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext,
   MameFileContext *ctx = (MameFileContext *)FileContext;
   if (!ctx || !ctx->IsDirectory)
     return STATUS_INVALID_HANDLE;
+  Trace::Span trace("fs", "read directory", ctx->Path.c_str());
+  if (ctx->ListCatalog)
+    return ReadCatalogDirectory(ctx, Marker, Buffer, Length,
+                                PBytesTransferred);
 
   // Reset search if Marker is NULL
   if (Marker == NULL) {
@@ -528,6 +1269,15 @@ NTSTATUS MameFs::SReadDirectory(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext,
   NTSTATUS Result = STATUS_SUCCESS;
 
   while (true) {
+    if (IsInternalCacheFile(ctx->FindData.cFileName)) {
+      if (!FindNextFileW(ctx->FindHandle, &ctx->FindData)) {
+        if (GetLastError() != ERROR_NO_MORE_FILES)
+          Result = STATUS_UNSUCCESSFUL;
+        break;
+      }
+      continue;
+    }
+
     // Allocate buffer for DirInfo + Filename
     BYTE DirInfoBuf[sizeof(FSP_FSCTL_DIR_INFO) + MAX_PATH * sizeof(WCHAR)] = {
         0};
@@ -617,3 +1367,67 @@ NTSTATUS MameFs::SReadDirectory(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext,
 
   return Result;
 }
+
+// Root listing of a sharded cache. The archives are spread over the shards,
+// so list what the catalog knows instead; it has every name and size. The
+// catalog keeps no modification time, so the last access stands in. Without
+// a catalog, the shards are walked for the same entries.
+NTSTATUS MameFs::ReadCatalogDirectory(MameFileContext *ctx, PWSTR Marker,
+                                      PVOID Buffer, ULONG Length,
+                                      PULONG PBytesTransferred) {
+  auto before = [](const ListedArchive &a, const ListedArchive &b) {
+    return _wcsicmp(a.Name.c_str(), b.Name.c_str()) < 0;
+  };
+  if (Marker == NULL || ctx->Listing.empty()) {
+    ctx->Listing.clear();
+    auto add = [&](const CatalogEntry &e) {
+      if (e.Name[0] == L'\\' && !wcschr(e.Name + 1, L'\\'))
+        ctx->Listing.push_back({e.Name + 1, e.Size, e.LastAccess});
+    };
+    if (m_Catalog.IsOpen()) {
+      m_Catalog.ForEach(add);
+    } else {
+      std::vector<CatalogEntry> found;
+      m_Catalog.Scan(found);
+      for (const auto &e : found)
+        add(e);
+    }
+    std::sort(ctx->Listing.begin(), ctx->Listing.end(), before);
+    ctx->ListingPos = 0;
+  }
+  if (Marker != NULL) {
+    ListedArchive marker = {Marker, 0, 0};
+    ctx->ListingPos = std::upper_bound(ctx->Listing.begin(),
+                                       ctx->Listing.end(), marker, before) -
+                      ctx->Listing.begin();
+  }
+  if (ctx->ListingPos >= ctx->Listing.size())
+    return STATUS_NO_MORE_FILES;
+
+  for (; ctx->ListingPos < ctx->Listing.size(); ++ctx->ListingPos) {
+    const ListedArchive &item = ctx->Listing[ctx->ListingPos];
+    size_t nameBytes =
+        (std::min)(item.Name.size(), (size_t)MAX_PATH) * sizeof(WCHAR);
+    BYTE DirInfoBuf[sizeof(FSP_FSCTL_DIR_INFO) + MAX_PATH * sizeof(WCHAR)] = {
+        0};
+    FSP_FSCTL_DIR_INFO *pDirInfo = (FSP_FSCTL_DIR_INFO *)DirInfoBuf;
+    pDirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + nameBytes);
+    memcpy(pDirInfo->FileNameBuf, item.Name.c_str(), nameBytes);
+
+    pDirInfo->FileInfo.FileAttributes = FILE_ATTRIBUTE_ARCHIVE;
+    pDirInfo->FileInfo.AllocationSize = item.Size;
+    pDirInfo->FileInfo.FileSize = item.Size;
+    pDirInfo->FileInfo.CreationTime = item.Time;
+    pDirInfo->FileInfo.LastAccessTime = item.Time;
+    pDirInfo->FileInfo.LastWriteTime = item.Time;
+    pDirInfo->FileInfo.ChangeTime = item.Time;
+    pDirInfo->FileInfo.IndexNumber = 0;
+    pDirInfo->FileInfo.HardLinks = 1;
+
+    if (*PBytesTransferred + pDirInfo->Size > Length)
+      break; // Buffer full
+    memcpy((BYTE *)Buffer + *PBytesTransferred, pDirInfo, pDirInfo->Size);
+    *PBytesTransferred += pDirInfo->Size;
+  }
+  return STATUS_SUCCESS;
+}
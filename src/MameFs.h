@@ -1,11 +1,44 @@
 #pragma once
+#include "AsyncFileIo.h"
+#include "BlockCache.h"
+#include "CacheCatalog.h"
+#include "CacheServer.h"
+#include "ChdStream.h"
+#include "PathTable.h"
+#include "Prefetcher.h"
+#include "Revalidator.h"
+#include "UsageHistory.h"
+#include <mutex>
 #include <string>
+#include <vector>
 #include <winfsp/winfsp.h>
 
+struct MameFsOptions {
+  std::wstring MountPoint = L"Z:";
+  std::wstring CacheDir = L"C:\\MameCache";
+  std::wstring BaseUrl = L"https://mdk.cab/download/";
+  bool Enable7z = false;
+  size_t ReadCacheMB = 64; // shared SRead block cache, 0 disables it
+  bool Revalidate = true;  // background freshness checks on cached opens
+  UINT16 ServePort = 0;    // embedded cache server for the LAN, 0 = off
+  bool Mount = true;       // false: only run the cache server
+  bool Shard = false;      // hashed subdirectories; migrates a flat cache
+  std::wstring ChdUrl;     // base URL for streamed CHDs, empty = off
+  UINT32 WarmSets = 0;     // most likely sets kept cached, 0 = off
+  std::wstring FavoritesPath; // MAME favorites.ini to rank with the history
+  std::wstring WarmDatPath;   // DAT for the warmed sets' parents/BIOS
+};
+
+struct MameFileContext;
+
 class MameFs {
 public:
-  static int Run(const std::wstring &mountPoint, const std::wstring &cacheDir,
-                 const std::wstring &baseUrl, bool enable7z);
+  static int Run(const MameFsOptions &options);
+  // Bulk mode: conditionally re-checks every cached archive and exits.
+  static int RevalidateAll(const MameFsOptions &options);
+  // Bulk mode: downloads the selected sets into the cache and exits.
+  static int Prefetch(const MameFsOptions &options,
+                      const PrefetchOptions &prefetch);
 
 private:
   static NTSTATUS SGetVolumeInfo(FSP_FILE_SYSTEM *FileSystem,
@@ -41,7 +74,47 @@ private:
 
   static std::wstring m_CacheDir;
   static std::wstring m_BaseUrl;
+  static std::wstring m_ChdUrl;
   static bool m_Enable7z;
+  static bool m_Revalidate;
+  static bool m_Sharded; // CacheLayout sharded; see GetLocalPath
+  static CacheCatalog m_Catalog;
+  static BlockCache m_BlockCache;
+  static Revalidator m_Revalidator;
+  static CacheServer m_Server;
+  static AsyncFileIo m_FileIo;
+  static PathTable m_Paths;
+  static UsageHistory m_History;
+  static LaunchDetector m_Launches;
+  static UINT64 m_CacheDirHash; // HashStep state after m_CacheDir
+  // Closed contexts kept for reuse by later opens.
+  static std::mutex m_ContextPoolLock;
+  static std::vector<MameFileContext *> m_FreeContexts;
 
+  static bool PrepareCacheDir(const MameFsOptions &options);
   static std::wstring GetLocalPath(PCWSTR fileName);
+  static std::wstring GetRemoteUrl(const std::wstring &fileName);
+  static std::wstring GetArchiveUrl(const std::wstring &fileName);
+  static void AttachRevalidator();
+  static void NoteArchiveOpen(PathEntry *path);
+  static void HistoryLoop(UINT32 warmSets, std::wstring datPath);
+  static bool FillArchive(const std::wstring &fileName);
+  static void PinArchiveTail(MameFileContext *ctx);
+  static NTSTATUS OpenChd(PCWSTR fileName, const std::wstring &localPath,
+                          UINT64 pathHash, PVOID *PFileContext,
+                          FSP_FSCTL_FILE_INFO *FileInfo);
+  static NTSTATUS ReadCatalogDirectory(MameFileContext *ctx, PWSTR Marker,
+                                       PVOID Buffer, ULONG Length,
+                                       PULONG PBytesTransferred);
+  static bool ReadSpanAsync(FSP_FILE_SYSTEM *FileSystem,
+                            MameFileContext *ctx, UINT64 spanStart,
+                            UINT64 spanEnd, PVOID Buffer, UINT64 Offset,
+                            ULONG Length);
+  static bool ReadAsync(FSP_FILE_SYSTEM *FileSystem, MameFileContext *ctx,
+                        PVOID Buffer, UINT64 Offset, ULONG Length);
+  static MameFileContext *AcquireContext();
+  static void ReleaseContext(MameFileContext *ctx);
+  static bool OpenCachedArchive(PCWSTR fileName, size_t length,
+                                UINT64 nameHash, PVOID *PFileContext,
+                                FSP_FSCTL_FILE_INFO *FileInfo);
 };
@@ -0,0 +1,96 @@
+#include "PathTable.h"
+#include "CacheCatalog.h"
+#include <cwchar>
+#include <cwctype>
+#include <mutex>
+
+PathTable::~PathTable() {
+  for (auto &bucket : m_Buckets) {
+    PathEntry *entry = bucket.second;
+    while (entry) {
+      PathEntry *next = entry->Next;
+      delete entry;
+      entry = next;
+    }
+  }
+}
+
+PathEntry *PathTable::FindLocked(PCWSTR name, size_t length,
+                                 UINT64 nameHash) {
+  auto it = m_Buckets.find(nameHash);
+  if (it == m_Buckets.end())
+    return nullptr;
+  for (PathEntry *entry = it->second; entry; entry = entry->Next) {
+    if (entry->Name.size() != length)
+      continue;
+    size_t i = 0;
+    while (i < length && towlower(entry->Name[i]) == towlower(name[i]))
+      ++i;
+    if (i == length)
+      return entry;
+  }
+  return nullptr;
+}
+
+PathEntry *PathTable::Find(PCWSTR name, size_t length, UINT64 nameHash) {
+  std::shared_lock<std::shared_mutex> lock(m_Lock);
+  return FindLocked(name, length, nameHash);
+}
+
+PathEntry *PathTable::Intern(PCWSTR name, size_t length, UINT64 nameHash,
+                             const std::wstring &localPath,
+                             UINT64 pathHash) {
+  std::unique_lock<std::shared_mutex> lock(m_Lock);
+  PathEntry *entry = FindLocked(name, length, nameHash);
+  if (entry)
+    return entry;
+
+  entry = new PathEntry();
+  entry->NameHash = nameHash;
+  entry->PathHash = pathHash;
+  entry->Name.assign(name, length);
+  entry->LocalPath = localPath;
+  PathEntry *&head = m_Buckets[nameHash];
+  entry->Next = head;
+  head = entry;
+  return entry;
+}
+
+PathClass PathTable::Classify(PCWSTR name, UINT64 cacheDirHash) {
+  PathClass cls;
+  UINT64 nameHash = CacheCatalog::kHashSeed;
+  UINT64 pathHash = cacheDirHash;
+  if (name[0] != L'\\')
+    pathHash = CacheCatalog::HashStep(pathHash, L'\\');
+  size_t n = 0;
+  for (; name[n]; ++n) {
+    nameHash = CacheCatalog::HashStep(nameHash, name[n]);
+    pathHash = CacheCatalog::HashStep(pathHash, name[n]);
+  }
+  cls.Length = n;
+  cls.NameHash = nameHash ? nameHash : 1;
+  cls.PathHash = pathHash;
+
+  // Extensions are matched case-sensitively, as they always have been.
+  auto endsWith = [&](const wchar_t *suffix, size_t length) {
+    return n > length && wmemcmp(name + n - length, suffix, length) == 0;
+  };
+  if (n == 1 && name[0] == L'\\')
+    cls.Kind = PathKind::Root;
+  else if (endsWith(L".zip", 4))
+    cls.Kind = PathKind::Zip;
+  else if (endsWith(L".7z", 3))
+    cls.Kind = PathKind::SevenZip;
+  else if (endsWith(L".chd", 4))
+    cls.Kind = PathKind::Chd;
+  else
+    cls.Kind = PathKind::Other;
+  return cls;
+}
+
+UINT64 PathTable::HashPath(const std::wstring &path) {
+  UINT64 hash = CacheCatalog::kHashSeed;
+  for (WCHAR c : path)
+    hash = CacheCatalog::HashStep(hash, c);
+  return hash;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <windows.h>
+
+// One virtual path SOpen has resolved before. Entries are never freed, so
+// pointers stay valid for the life of the process.
+struct PathEntry {
+  UINT64 NameHash;        // CacheCatalog::HashName of the virtual name
+  UINT64 PathHash;        // of the local path; reported as IndexNumber
+  std::wstring Name;      // virtual name as first seen
+  std::wstring LocalPath; // file in the cache directory
+  std::atomic<bool> RevalidationQueued{false};
+  std::atomic<UINT64> LastOpened{0}; // GetTickCount64, for launch counting
+  PathEntry *Next = nullptr; // same-hash chain
+};
+
+enum class PathKind { Root, Zip, SevenZip, Chd, Other };
+
+// What SOpen needs to know about a virtual name, from one pass over it.
+struct PathClass {
+  PathKind Kind;
+  size_t Length;
+  UINT64 NameHash; // CacheCatalog::HashName(name)
+  UINT64 PathHash; // identifies the file; flat layout: HashPath of its
+                   // local path, computed without building that
+};
+
+// Interned, case-insensitive table of virtual paths. Lookups take the hash
+// computed while classifying the request and never allocate.
+class PathTable {
+public:
+  ~PathTable();
+
+  PathEntry *Find(PCWSTR name, size_t length, UINT64 nameHash);
+  // Returns the existing entry for `name`, or adds one.
+  PathEntry *Intern(PCWSTR name, size_t length, UINT64 nameHash,
+                    const std::wstring &localPath, UINT64 pathHash);
+
+  // `cacheDirHash` is HashPath of the cache directory.
+  static PathClass Classify(PCWSTR name, UINT64 cacheDirHash);
+  // Case-insensitive hash of a local cache path, also its IndexNumber.
+  static UINT64 HashPath(const std::wstring &path);
+
+private:
+  PathEntry *FindLocked(PCWSTR name, size_t length, UINT64 nameHash);
+
+  std::shared_mutex m_Lock;
+  std::unordered_map<UINT64, PathEntry *> m_Buckets;
+};
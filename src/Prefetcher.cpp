@@ -0,0 +1,348 @@
+#include "Prefetcher.h"
+#include "Crc32.h"
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+// Per-worker deque. The owner takes from the front and idle workers steal
+// from the back of another's, so a handful of huge sets dealt to one worker
+// don't leave the others waiting.
+struct WorkQueue {
+  std::mutex Lock;
+  std::deque<size_t> Items;
+};
+
+static bool NextItem(std::vector<WorkQueue> &queues, size_t self,
+                     size_t &item) {
+  {
+    WorkQueue &own = queues[self];
+    std::lock_guard<std::mutex> guard(own.Lock);
+    if (!own.Items.empty()) {
+      item = own.Items.front();
+      own.Items.pop_front();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < queues.size(); ++i) {
+    WorkQueue &victim = queues[(self + i) % queues.size()];
+    std::lock_guard<std::mutex> guard(victim.Lock);
+    if (!victim.Items.empty()) {
+      item = victim.Items.back();
+      victim.Items.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+static std::wstring FoldCase(std::wstring s) {
+  for (auto &c : s)
+    c = towlower(c);
+  return s;
+}
+
+static std::wstring Trim(const std::wstring &s) {
+  size_t begin = s.find_first_not_of(L" \t\r\n");
+  if (begin == std::wstring::npos)
+    return L"";
+  size_t end = s.find_last_not_of(L" \t\r\n");
+  return s.substr(begin, end - begin + 1);
+}
+
+// Value of attribute `name` in an XML start tag, or "" if absent.
+static std::wstring Attribute(const std::string &tag, const char *name) {
+  std::string key = std::string(" ") + name + "=\"";
+  size_t pos = tag.find(key);
+  if (pos == std::string::npos)
+    return L"";
+  pos += key.size();
+  size_t end = tag.find('"', pos);
+  if (end == std::string::npos)
+    return L"";
+  return std::wstring(tag.begin() + pos, tag.begin() + end);
+}
+
+void Prefetcher::Attach(CacheCatalog *catalog, PathResolver remoteUrl,
+                        PathResolver localPath) {
+  m_Catalog = catalog;
+  m_RemoteUrl = remoteUrl;
+  m_LocalPath = localPath;
+}
+
+bool Prefetcher::LoadSetList(const std::wstring &spec,
+                             std::vector<std::wstring> &sets) {
+  DWORD attr = GetFileAttributesW(spec.c_str());
+  if (attr != INVALID_FILE_ATTRIBUTES && !(attr & FILE_ATTRIBUTE_DIRECTORY)) {
+    std::ifstream in(spec);
+    if (!in.is_open())
+      return false;
+    std::string line;
+    while (std::getline(in, line)) {
+      std::wstring name = Trim(std::wstring(line.begin(), line.end()));
+      if (!name.empty() && name[0] != L'#')
+        sets.push_back(name);
+    }
+    return true;
+  }
+
+  // Not a file: a comma separated list of set names.
+  size_t start = 0;
+  while (start <= spec.size()) {
+    size_t comma = spec.find(L',', start);
+    if (comma == std::wstring::npos)
+      comma = spec.size();
+    std::wstring name = Trim(spec.substr(start, comma - start));
+    if (!name.empty())
+      sets.push_back(name);
+    start = comma + 1;
+  }
+  return true;
+}
+
+bool Prefetcher::LoadDat(const std::wstring &path, std::vector<DatSet> &sets) {
+  std::ifstream in(path);
+  if (!in.is_open())
+    return false;
+
+  // Line based on purpose: -listxml output is hundreds of MB and puts every
+  // tag we care about on its own line, as do Logiqx DATs.
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.find("<machine ") != std::string::npos ||
+        line.find("<game ") != std::string::npos) {
+      DatSet set;
+      set.Name = Attribute(line, "name");
+      set.CloneOf = Attribute(line, "cloneof");
+      set.RomOf = Attribute(line, "romof");
+      sets.push_back(set);
+    } else if (sets.empty()) {
+      continue;
+    } else if (line.find("<rom ") != std::string::npos) {
+      if (Attribute(line, "status") != L"nodump")
+        sets.back().HasRoms = true;
+    } else if (line.find("<device_ref ") != std::string::npos) {
+      sets.back().Devices.push_back(Attribute(line, "name"));
+    }
+  }
+  return true;
+}
+
+bool Prefetcher::SelectSets(const PrefetchOptions &options,
+                            std::vector<std::wstring> &sets) {
+  std::vector<std::wstring> requested = options.Names;
+  if (!options.Sets.empty() && !LoadSetList(options.Sets, requested)) {
+    std::wcerr << L"Cannot read set list: " << options.Sets << std::endl;
+    return false;
+  }
+  if (options.DatPath.empty()) {
+    std::set<std::wstring> seen;
+    for (const auto &name : requested)
+      if (seen.insert(FoldCase(name)).second)
+        sets.push_back(name);
+    return true;
+  }
+
+  std::vector<DatSet> dat;
+  if (!LoadDat(options.DatPath, dat)) {
+    std::wcerr << L"Cannot read DAT: " << options.DatPath << std::endl;
+    return false;
+  }
+  std::map<std::wstring, const DatSet *> byName;
+  for (const auto &set : dat)
+    byName[FoldCase(set.Name)] = &set;
+
+  if (requested.empty()) {
+    for (const auto &set : dat)
+      if (set.HasRoms && !(options.NoClones && !set.CloneOf.empty()))
+        requested.push_back(set.Name);
+  }
+
+  // Split sets need their parent and BIOS (romof) and any devices with
+  // ROMs of their own, so pull in the whole dependency closure.
+  std::set<std::wstring> seen;
+  std::vector<std::wstring> pending(requested.rbegin(), requested.rend());
+  while (!pending.empty()) {
+    std::wstring name = pending.back();
+    pending.pop_back();
+    if (!seen.insert(FoldCase(name)).second)
+      continue;
+
+    auto it = byName.find(FoldCase(name));
+    if (it == byName.end()) {
+      std::wcerr << L"Not in DAT, fetching as-is: " << name << std::endl;
+      sets.push_back(name);
+      continue;
+    }
+    const DatSet &set = *it->second;
+    if (set.HasRoms)
+      sets.push_back(set.Name);
+    if (!set.RomOf.empty())
+      pending.push_back(set.RomOf);
+    for (const auto &device : set.Devices)
+      pending.push_back(device);
+  }
+  return true;
+}
+
+bool Prefetcher::IsCached(const std::wstring &name,
+                          const std::wstring &localPath, bool verify) {
+  WIN32_FILE_ATTRIBUTE_DATA attr;
+  if (!GetFileAttributesExW(localPath.c_str(), GetFileExInfoStandard, &attr))
+    return false;
+  UINT64 size = ((UINT64)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+
+  CatalogEntry entry;
+  if (!m_Catalog->Lookup(name.c_str(), &entry) ||
+      entry.State != CatalogState::Complete) {
+    if (size == 0)
+      return false;
+    // Already in the cache directory but unknown to the catalog; adopt it
+    // the same way SOpen does.
+    DownloadInfo info;
+    info.Validator.Size = size;
+    m_Catalog->Commit(name.c_str(), info);
+    return true;
+  }
+
+  bool good = (entry.Size == size);
+  if (good && verify && entry.Crc32 != 0) {
+    UINT32 crc = 0;
+    good = Crc32File(localPath, crc) && crc == entry.Crc32;
+  }
+  if (good)
+    return true;
+
+  // Download() keeps any existing file, so clear the bad copy first.
+  std::wcerr << L"Cached copy failed verification, refetching: " << localPath
+             << std::endl;
+  m_Catalog->Remove(name.c_str());
+  DeleteFileW(localPath.c_str());
+  return false;
+}
+
+Prefetcher::Outcome Prefetcher::FetchSet(const std::wstring &set,
+                                         const PrefetchOptions &options,
+                                         UINT64 &bytes) {
+  // Same order MAME probes the rompath in: .zip, then .7z (when enabled).
+  static const wchar_t *kExtensions[] = {L".zip", L".7z"};
+  bytes = 0;
+
+  for (const wchar_t *ext : kExtensions) {
+    std::wstring name = L"\\" + set + ext;
+    if (!m_RemoteUrl(name).empty() &&
+        IsCached(name, m_LocalPath(name), options.Verify))
+      return Outcome::Cached;
+  }
+
+  for (const wchar_t *ext : kExtensions) {
+    std::wstring name = L"\\" + set + ext;
+    std::wstring url = m_RemoteUrl(name);
+    if (url.empty())
+      continue;
+    std::wstring localPath = m_LocalPath(name);
+
+    m_Catalog->MarkDownloading(name.c_str());
+    DownloadInfo info;
+    if (Downloader::Download(url, localPath, &info, options.Priority)) {
+      if (info.Validator.Size == 0) {
+        WIN32_FILE_ATTRIBUTE_DATA attr;
+        if (GetFileAttributesExW(localPath.c_str(), GetFileExInfoStandard,
+                                 &attr))
+          info.Validator.Size =
+              ((UINT64)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+      }
+      m_Catalog->Commit(name.c_str(), info);
+      bytes = info.Validator.Size;
+      return Outcome::Downloaded;
+    }
+    m_Catalog->Remove(name.c_str());
+  }
+  return Outcome::Failed;
+}
+
+size_t Prefetcher::Run(const PrefetchOptions &options, UINT32 workers,
+                       std::vector<std::wstring> *failedSets) {
+  std::vector<std::wstring> sets;
+  if (!SelectSets(options, sets)) {
+    if (failedSets)
+      *failedSets = options.Names;
+    return 1;
+  }
+  workers = (std::max)(1u, workers);
+  std::wcout << L"Prefetching " << sets.size() << L" sets with " << workers
+             << L" workers..." << std::endl;
+
+  // Deal round-robin; stealing evens out whatever imbalance is left.
+  std::vector<WorkQueue> queues(workers);
+  for (size_t i = 0; i < sets.size(); ++i)
+    queues[i % workers].Items.push_back(i);
+
+  auto start = std::chrono::steady_clock::now();
+  std::mutex progressLock;
+  size_t done = 0, cached = 0, downloaded = 0, failed = 0;
+  UINT64 totalBytes = 0;
+
+  std::vector<std::thread> threads;
+  for (UINT32 w = 0; w < workers; ++w) {
+    threads.emplace_back([&, w]() {
+      size_t item;
+      while (NextItem(queues, w, item)) {
+        UINT64 bytes = 0;
+        Outcome outcome = FetchSet(sets[item], options, bytes);
+
+        std::lock_guard<std::mutex> guard(progressLock);
+        done++;
+        totalBytes += bytes;
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        std::wcout << L"[" << done << L"/" << sets.size() << L"] "
+                   << sets[item];
+        switch (outcome) {
+        case Outcome::Cached:
+          cached++;
+          std::wcout << L" cached";
+          break;
+        case Outcome::Downloaded:
+          downloaded++;
+          std::wcout << L" downloaded (" << bytes / 1024 << L" KB)";
+          break;
+        case Outcome::Failed:
+          failed++;
+          if (failedSets)
+            failedSets->push_back(sets[item]);
+          std::wcout << L" FAILED";
+          break;
+        }
+        if (seconds > 0)
+          std::wcout << L", " << (UINT64)(totalBytes / seconds / 1024)
+                     << L" KB/s overall";
+        std::wcout << std::endl;
+      }
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+
+  double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  std::wcout << L"Prefetch finished in " << (UINT64)seconds << L" s: "
+             << downloaded << L" downloaded (" << totalBytes / (1024 * 1024)
+             << L" MB";
+  if (seconds > 0)
+    std::wcout << L", " << (UINT64)(totalBytes / seconds / 1024) << L" KB/s";
+  std::wcout << L"), " << cached << L" already cached, " << failed
+             << L" failed." << std::endl;
+  if (failed > 0)
+    std::wcout << L"Run the same command again to retry; partial downloads "
+                  L"resume where they stopped."
+               << std::endl;
+  return failed;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "CacheCatalog.h"
+#include "Downloader.h"
+#include <functional>
+#include <string>
+#include <vector>
+
+struct PrefetchOptions {
+  // Comma separated set names, or a file with one set name per line.
+  // Empty with a DAT means every set in the DAT.
+  std::wstring Sets;
+  std::vector<std::wstring> Names; // more set names, e.g. predicted ones
+  // MAME -listxml output or a Logiqx DAT; adds parents/BIOS (romof).
+  std::wstring DatPath;
+  bool NoClones = false; // DAT mode: skip clones unless another set needs them
+  bool Verify = false;   // re-check cached files against the catalog CRC
+  TransferPriority Priority = TransferPriority::Prefetch;
+};
+
+// Bulk download of whole sets into the cache, for seeding a new machine
+// without running MAME against every game.
+class Prefetcher {
+public:
+  using PathResolver = std::function<std::wstring(const std::wstring &)>;
+
+  void Attach(CacheCatalog *catalog, PathResolver remoteUrl,
+              PathResolver localPath);
+
+  // Fetches every selected set on `workers` threads. Returns the number of
+  // sets that could not be fetched, and lists them in `failedSets`.
+  size_t Run(const PrefetchOptions &options, UINT32 workers,
+             std::vector<std::wstring> *failedSets = nullptr);
+
+private:
+  enum class Outcome { Cached, Downloaded, Failed };
+
+  struct DatSet {
+    std::wstring Name;
+    std::wstring CloneOf;
+    std::wstring RomOf;
+    std::vector<std::wstring> Devices; // device_ref names
+    bool HasRoms = false;
+  };
+
+  static bool LoadSetList(const std::wstring &spec,
+                          std::vector<std::wstring> &sets);
+  static bool LoadDat(const std::wstring &path, std::vector<DatSet> &sets);
+  static bool SelectSets(const PrefetchOptions &options,
+                         std::vector<std::wstring> &sets);
+
+  Outcome FetchSet(const std::wstring &set, const PrefetchOptions &options,
+                   UINT64 &bytes);
+  bool IsCached(const std::wstring &name, const std::wstring &localPath,
+                bool verify);
+
+  CacheCatalog *m_Catalog = nullptr;
+  PathResolver m_RemoteUrl;
+  PathResolver m_LocalPath;
+};
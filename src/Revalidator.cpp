@@ -0,0 +1,144 @@
+#include "Revalidator.h"
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <thread>
+
+// Queued checks are sent together so they share one kept-alive connection.
+static const size_t kMaxQueuedBatch = 16;
+
+void Revalidator::Attach(CacheCatalog *catalog, PathResolver remoteUrl,
+                         PathResolver localPath) {
+  m_Catalog = catalog;
+  m_RemoteUrl = remoteUrl;
+  m_LocalPath = localPath;
+}
+
+void Revalidator::StartWorker() {
+  std::thread(&Revalidator::WorkerLoop, this).detach();
+}
+
+void Revalidator::Enqueue(PCWSTR name) {
+  std::wstring key = name;
+  for (auto &c : key)
+    c = towlower(c);
+
+  std::lock_guard<std::mutex> guard(m_Lock);
+  if (!m_Seen.insert(key).second)
+    return;
+  m_Queue.push_back(name);
+  m_Queued.notify_one();
+}
+
+void Revalidator::WorkerLoop() {
+  while (true) {
+    std::vector<std::wstring> batch;
+    {
+      std::unique_lock<std::mutex> lock(m_Lock);
+      m_Queued.wait(lock, [&]() { return !m_Queue.empty(); });
+      while (!m_Queue.empty() && batch.size() < kMaxQueuedBatch) {
+        batch.push_back(m_Queue.front());
+        m_Queue.pop_front();
+      }
+    }
+
+    Tally tally;
+    ProcessBatch(batch, TransferPriority::Background, tally);
+  }
+}
+
+void Revalidator::ProcessBatch(const std::vector<std::wstring> &names,
+                               TransferPriority priority, Tally &tally) {
+  std::vector<Downloader::RevalidateItem> items;
+  std::vector<CatalogEntry> entries;
+
+  for (const auto &name : names) {
+    CatalogEntry entry;
+    if (!m_Catalog->Lookup(name.c_str(), &entry) ||
+        entry.State != CatalogState::Complete)
+      continue;
+    std::wstring url = m_RemoteUrl(name);
+    if (url.empty())
+      continue;
+
+    Downloader::RevalidateItem item;
+    item.Url = url;
+    item.Destination = m_LocalPath(name);
+    item.Current.ETag = entry.ETag;
+    item.Current.LastModified = entry.LastModified;
+    item.Current.Size = entry.Size;
+    items.push_back(item);
+    entries.push_back(entry);
+  }
+
+  Downloader::RevalidateBatch(items, priority);
+
+  for (size_t i = 0; i < items.size(); ++i) {
+    const auto &item = items[i];
+    const CatalogEntry &entry = entries[i];
+    switch (item.Result) {
+    case Downloader::RevalidateResult::NotModified:
+      tally.Unchanged++;
+      // Record validators learned for files adopted without one.
+      if (item.Info.Validator.ETag != item.Current.ETag ||
+          item.Info.Validator.LastModified != item.Current.LastModified) {
+        DownloadInfo info = item.Info;
+        info.Crc32 = entry.Crc32;
+        m_Catalog->Commit(entry.Name, info);
+      }
+      break;
+    case Downloader::RevalidateResult::Updated:
+      tally.Updated++;
+      m_Catalog->Commit(entry.Name, item.Info);
+      std::wcout << L"Revalidated, new copy in place: " << entry.Name
+                 << std::endl;
+      break;
+    case Downloader::RevalidateResult::Failed:
+      tally.Failed++;
+      std::wcerr << L"Revalidation failed: " << entry.Name << std::endl;
+      break;
+    }
+  }
+}
+
+void Revalidator::RevalidateAll(UINT32 workers, size_t batchSize) {
+  std::vector<std::wstring> names;
+  m_Catalog->ForEach(
+      [&](const CatalogEntry &entry) { names.push_back(entry.Name); });
+  std::wcout << L"Revalidating " << names.size() << L" cached archives..."
+             << std::endl;
+
+  std::vector<std::vector<std::wstring>> batches;
+  for (size_t i = 0; i < names.size(); i += batchSize) {
+    size_t end = (std::min)(names.size(), i + batchSize);
+    batches.emplace_back(names.begin() + i, names.begin() + end);
+  }
+
+  std::mutex tallyLock;
+  Tally total;
+  std::atomic<size_t> next(0);
+  std::atomic<size_t> done(0);
+  std::vector<std::thread> threads;
+  for (UINT32 w = 0; w < (std::max)(1u, workers); ++w) {
+    threads.emplace_back([&]() {
+      for (size_t b = next++; b < batches.size(); b = next++) {
+        Tally tally;
+        ProcessBatch(batches[b], TransferPriority::Prefetch, tally);
+        std::lock_guard<std::mutex> guard(tallyLock);
+        total.Unchanged += tally.Unchanged;
+        total.Updated += tally.Updated;
+        total.Failed += tally.Failed;
+        done += batches[b].size();
+        std::wcout << L"[" << done << L"/" << names.size() << L"] unchanged="
+                   << total.Unchanged << L" updated=" << total.Updated
+                   << L" failed=" << total.Failed << std::endl;
+      }
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+
+  std::wcout << L"Revalidation finished: " << total.Unchanged
+             << L" unchanged, " << total.Updated << L" updated, "
+             << total.Failed << L" failed." << std::endl;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include "CacheCatalog.h"
+#include "Downloader.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// Stale-while-revalidate for cached archives. Opens are served from the
+// cache right away and queued here; a background worker asks the origin
+// whether the file changed and swaps in a fresh copy for later opens.
+class Revalidator {
+public:
+  using PathResolver = std::function<std::wstring(const std::wstring &)>;
+
+  void Attach(CacheCatalog *catalog, PathResolver remoteUrl,
+              PathResolver localPath);
+  void StartWorker();
+
+  // Queues a check; each archive is checked at most once per session.
+  void Enqueue(PCWSTR name);
+
+  // Checks every cataloged archive, in batches spread over `workers`
+  // threads. Blocks until done.
+  void RevalidateAll(UINT32 workers, size_t batchSize);
+
+private:
+  struct Tally {
+    size_t Unchanged = 0;
+    size_t Updated = 0;
+    size_t Failed = 0;
+  };
+
+  void WorkerLoop();
+  void ProcessBatch(const std::vector<std::wstring> &names,
+                    TransferPriority priority, Tally &tally);
+
+  CacheCatalog *m_Catalog = nullptr;
+  PathResolver m_RemoteUrl;
+  PathResolver m_LocalPath;
+
+  std::mutex m_Lock;
+  std::condition_variable m_Queued;
+  std::deque<std::wstring> m_Queue;
+  std::set<std::wstring> m_Seen; // case-folded names
+};
@@ -0,0 +1,263 @@
+#include "Trace.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cwchar>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Quiet time that ends a launch.
+static const UINT64 kLaunchIdleUs = 3 * 1000 * 1000;
+
+struct TraceEvent {
+  const char *Category;
+  const char *Name;
+  UINT64 Start;
+  UINT64 Duration;
+  std::wstring Detail;
+};
+
+struct ThreadBuffer {
+  std::mutex Lock; // only contended while exporting
+  std::vector<TraceEvent> Events;
+  DWORD ThreadId;
+};
+
+bool Trace::m_Enabled = false;
+std::wstring Trace::m_Directory;
+UINT32 Trace::m_WindowSeconds = 0;
+
+// Buffers outlive their threads so nothing recorded is lost.
+static std::mutex g_BuffersLock;
+static std::vector<ThreadBuffer *> g_Buffers;
+// Launch detection: when the last "fs" span ended, how many are still
+// open, and when the current launch's first one started (0 between
+// launches).
+static std::atomic<UINT64> g_LastActivity(0);
+static std::atomic<UINT32> g_OpenFsSpans(0);
+static std::atomic<UINT64> g_LaunchStart(0);
+// Name of the first archive opened in the current launch, for the filename.
+static std::mutex g_LabelLock;
+static std::wstring g_Label;
+static std::atomic<bool> g_Labelled(false);
+
+bool Trace::Start(const std::wstring &directory, UINT32 windowSeconds) {
+  CreateDirectoryW(directory.c_str(), NULL);
+  DWORD attrs = GetFileAttributesW(directory.c_str());
+  if (attrs == INVALID_FILE_ATTRIBUTES ||
+      !(attrs & FILE_ATTRIBUTE_DIRECTORY)) {
+    std::wcerr << L"Trace: cannot use directory " << directory << std::endl;
+    return false;
+  }
+  m_Directory = directory;
+  if (m_Directory.back() != L'\\' && m_Directory.back() != L'/')
+    m_Directory += L'\\';
+  m_WindowSeconds = windowSeconds;
+  m_Enabled = true;
+  std::thread(&Trace::ExportLoop).detach();
+  return true;
+}
+
+UINT64 Trace::Now() {
+  static LARGE_INTEGER frequency = []() {
+    LARGE_INTEGER f;
+    QueryPerformanceFrequency(&f);
+    return f;
+  }();
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return (UINT64)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+         (UINT64)(counter.QuadPart % frequency.QuadPart) * 1000000 /
+             frequency.QuadPart;
+}
+
+static ThreadBuffer *LocalBuffer() {
+  thread_local ThreadBuffer *buffer = nullptr;
+  if (!buffer) {
+    buffer = new ThreadBuffer();
+    buffer->ThreadId = GetCurrentThreadId();
+    std::lock_guard<std::mutex> guard(g_BuffersLock);
+    g_Buffers.push_back(buffer);
+  }
+  return buffer;
+}
+
+void Trace::Record(const char *category, const char *name, UINT64 start,
+                   UINT64 end, PCWSTR detail) {
+  if (!m_Enabled)
+    return;
+  if (strcmp(category, "fs") == 0) {
+    g_LastActivity = end;
+    if (detail && !g_Labelled && strcmp(name, "open") == 0) {
+      std::wstring stem = detail;
+      size_t slash = stem.find_last_of(L"\\/");
+      if (slash != std::wstring::npos)
+        stem.erase(0, slash + 1);
+      size_t dot = stem.rfind(L'.');
+      if (dot != std::wstring::npos && dot > 0 &&
+          (_wcsicmp(stem.c_str() + dot, L".zip") == 0 ||
+           _wcsicmp(stem.c_str() + dot, L".7z") == 0)) {
+        stem.erase(dot);
+        std::lock_guard<std::mutex> guard(g_LabelLock);
+        if (!g_Labelled) {
+          g_Label = stem;
+          g_Labelled = true;
+        }
+      }
+    }
+  }
+
+  ThreadBuffer *buffer = LocalBuffer();
+  std::lock_guard<std::mutex> guard(buffer->Lock);
+  buffer->Events.push_back(
+      {category, name, start, end > start ? end - start : 0,
+       detail ? std::wstring(detail) : std::wstring()});
+}
+
+void Trace::Begin(const char *category, UINT64 start) {
+  if (strcmp(category, "fs") != 0)
+    return;
+  g_OpenFsSpans++;
+  UINT64 none = 0;
+  g_LaunchStart.compare_exchange_strong(none, start);
+}
+
+void Trace::End(const char *category) {
+  if (strcmp(category, "fs") == 0)
+    g_OpenFsSpans--;
+}
+
+// Drops buffered events that ended before `time`.
+static void DiscardBefore(UINT64 time) {
+  std::lock_guard<std::mutex> guard(g_BuffersLock);
+  for (ThreadBuffer *buffer : g_Buffers) {
+    std::lock_guard<std::mutex> bufferGuard(buffer->Lock);
+    auto &events = buffer->Events;
+    events.erase(std::remove_if(events.begin(), events.end(),
+                                [&](const TraceEvent &event) {
+                                  return event.Start + event.Duration < time;
+                                }),
+                 events.end());
+  }
+}
+
+void Trace::ExportLoop() {
+  while (true) {
+    if (m_WindowSeconds) {
+      Sleep(m_WindowSeconds * 1000);
+      Export(0);
+      continue;
+    }
+    Sleep(1000);
+    UINT64 now = Now();
+    UINT64 last = g_LastActivity;
+    if (last && g_OpenFsSpans == 0 && now - last > kLaunchIdleUs) {
+      g_LastActivity = 0;
+      Export(g_LaunchStart.exchange(0));
+    } else if (g_LaunchStart == 0) {
+      // Between launches: revalidation and -warm transfers that finish
+      // now would only clutter the next launch's waterfall.
+      DiscardBefore(now);
+    }
+  }
+}
+
+static void WriteJsonString(std::ofstream &out, const std::string &value) {
+  out << '"';
+  for (unsigned char c : value) {
+    if (c == '"' || c == '\\')
+      out << '\\' << c;
+    else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out << escaped;
+    } else
+      out << c;
+  }
+  out << '"';
+}
+
+static std::string ToUtf8(const std::wstring &value) {
+  if (value.empty())
+    return std::string();
+  int size = WideCharToMultiByte(CP_UTF8, 0, value.c_str(), (int)value.size(),
+                                 NULL, 0, NULL, NULL);
+  std::string result(size, '\0');
+  WideCharToMultiByte(CP_UTF8, 0, value.c_str(), (int)value.size(),
+                      &result[0], size, NULL, NULL);
+  return result;
+}
+
+void Trace::Export(UINT64 notBefore) {
+  struct Tagged {
+    DWORD ThreadId;
+    TraceEvent Value;
+  };
+  std::vector<Tagged> events;
+  {
+    std::lock_guard<std::mutex> guard(g_BuffersLock);
+    for (ThreadBuffer *buffer : g_Buffers) {
+      std::vector<TraceEvent> taken;
+      {
+        std::lock_guard<std::mutex> bufferGuard(buffer->Lock);
+        taken.swap(buffer->Events);
+      }
+      for (auto &event : taken)
+        if (event.Start + event.Duration >= notBefore)
+          events.push_back({buffer->ThreadId, std::move(event)});
+    }
+  }
+  std::wstring label;
+  {
+    std::lock_guard<std::mutex> guard(g_LabelLock);
+    label.swap(g_Label);
+    g_Labelled = false;
+  }
+  if (events.empty())
+    return;
+  std::sort(events.begin(), events.end(),
+            [](const Tagged &a, const Tagged &b) {
+              return a.Value.Start < b.Value.Start;
+            });
+
+  SYSTEMTIME st;
+  GetLocalTime(&st);
+  WCHAR stamp[32];
+  swprintf(stamp, 32, L"%04u%02u%02u-%02u%02u%02u", st.wYear, st.wMonth,
+           st.wDay, st.wHour, st.wMinute, st.wSecond);
+  std::wstring path = m_Directory + L"mcr-trace-" + stamp;
+  if (!label.empty())
+    path += L"-" + label;
+  path += L".json";
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    std::wcerr << L"Trace: cannot write " << path << std::endl;
+    return;
+  }
+  DWORD pid = GetCurrentProcessId();
+  out << "{\"traceEvents\":[";
+  for (size_t i = 0; i < events.size(); ++i) {
+    const TraceEvent &event = events[i].Value;
+    out << (i ? ",\n" : "\n") << "{\"name\":";
+    WriteJsonString(out, event.Name);
+    out << ",\"cat\":";
+    WriteJsonString(out, event.Category);
+    out << ",\"ph\":\"X\",\"ts\":" << event.Start
+        << ",\"dur\":" << event.Duration << ",\"pid\":" << pid
+        << ",\"tid\":" << events[i].ThreadId;
+    if (!event.Detail.empty()) {
+      out << ",\"args\":{\"detail\":";
+      WriteJsonString(out, ToUtf8(event.Detail));
+      out << "}";
+    }
+    out << "}";
+  }
+  out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  std::wcout << L"Trace: wrote " << events.size() << L" events to " << path
+             << std::endl;
+}
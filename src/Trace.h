@@ -0,0 +1,64 @@
+#pragma once
+#include <string>
+#include <windows.h>
+
+// Opt-in timing trace. Spans go into per-thread buffers and are written out
+// as Chrome trace-event JSON (open in chrome://tracing or Perfetto), either
+// one file per game launch or one per fixed time window. A launch is a
+// burst of filesystem callbacks ended by a few seconds of quiet.
+class Trace {
+public:
+  // Starts exporting into `directory`. `windowSeconds` = 0 exports per
+  // launch, anything else every that many seconds.
+  static bool Start(const std::wstring &directory, UINT32 windowSeconds);
+  static bool Enabled() { return m_Enabled; }
+
+  // Microseconds on the trace clock.
+  static UINT64 Now();
+  static void Record(const char *category, const char *name, UINT64 start,
+                     UINT64 end, PCWSTR detail = nullptr);
+
+  // Records the enclosing scope as a span; free when tracing is off.
+  class Span {
+  public:
+    Span(const char *category, const char *name, PCWSTR detail = nullptr)
+        : m_Category(category), m_Name(name), m_Active(Enabled()) {
+      if (m_Active) {
+        if (detail)
+          m_Detail = detail;
+        m_Start = Now();
+        Begin(m_Category, m_Start);
+      }
+    }
+    Span(const Span &) = delete;
+    Span &operator=(const Span &) = delete;
+    ~Span() {
+      if (m_Active) {
+        Record(m_Category, m_Name, m_Start, Now(),
+               m_Detail.empty() ? nullptr : m_Detail.c_str());
+        End(m_Category);
+      }
+    }
+
+  private:
+    const char *m_Category;
+    const char *m_Name;
+    bool m_Active;
+    UINT64 m_Start = 0;
+    std::wstring m_Detail;
+  };
+
+private:
+  // Track open "fs" spans, so a launch blocked on a long download isn't
+  // taken for a finished one.
+  static void Begin(const char *category, UINT64 start);
+  static void End(const char *category);
+  static void ExportLoop();
+  // Writes out everything buffered, less events that ended before
+  // `notBefore`.
+  static void Export(UINT64 notBefore);
+
+  static bool m_Enabled;
+  static std::wstring m_Directory;
+  static UINT32 m_WindowSeconds;
+};
@@ -0,0 +1,188 @@
+#include "TransferScheduler.h"
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+std::mutex TransferScheduler::m_Lock;
+std::condition_variable TransferScheduler::m_Changed;
+TransferLimits TransferScheduler::m_Limits;
+UINT32 TransferScheduler::m_Active = 0;
+std::map<std::wstring, TransferScheduler::OriginState>
+    TransferScheduler::m_Origins;
+TransferScheduler::TokenBucket TransferScheduler::m_Global;
+TransferScheduler::TokenBucket TransferScheduler::m_Bulk;
+
+std::chrono::microseconds
+TransferScheduler::TokenBucket::Reserve(UINT64 bytes) {
+  if (Rate <= 0)
+    return std::chrono::microseconds(0);
+
+  auto now = std::chrono::steady_clock::now();
+  if (Last.time_since_epoch().count() == 0) {
+    Last = now;
+    Tokens = Rate; // allow a one second burst
+  }
+  double elapsed = std::chrono::duration<double>(now - Last).count();
+  Tokens = (std::min)(Rate, Tokens + Rate * elapsed);
+  Last = now;
+
+  // Go into debt and make the caller sleep it off, so pacing stays accurate
+  // however large the chunks are.
+  Tokens -= (double)bytes;
+  if (Tokens >= 0)
+    return std::chrono::microseconds(0);
+  return std::chrono::microseconds((long long)(-Tokens / Rate * 1e6));
+}
+
+void TransferScheduler::Configure(const TransferLimits &limits) {
+  std::lock_guard<std::mutex> guard(m_Lock);
+  m_Limits = limits;
+  m_Limits.MaxTransfers = (std::max)(1u, m_Limits.MaxTransfers);
+  m_Limits.MaxPerOrigin = (std::max)(1u, m_Limits.MaxPerOrigin);
+  m_Global = TokenBucket();
+  m_Global.Rate = (double)limits.BytesPerSecond;
+  m_Bulk = TokenBucket();
+  m_Bulk.Rate = (double)limits.BulkBytesPerSecond;
+  m_Changed.notify_all();
+}
+
+UINT32 TransferScheduler::GlobalCap(TransferPriority priority) {
+  // Bulk classes leave one slot free so an interactive open never queues
+  // behind them.
+  UINT32 globalCap = m_Limits.MaxTransfers;
+  if (priority != TransferPriority::Interactive && globalCap > 1)
+    globalCap--;
+  return globalCap;
+}
+
+UINT32 TransferScheduler::Capacity(TransferPriority priority) {
+  std::lock_guard<std::mutex> guard(m_Lock);
+  UINT32 originCap = m_Limits.MaxPerOrigin;
+  if (priority == TransferPriority::Interactive)
+    originCap++;
+  return (std::min)(GlobalCap(priority), originCap);
+}
+
+bool TransferScheduler::CanAdmit(const std::wstring &origin,
+                                 TransferPriority priority) {
+  const OriginState &state = m_Origins[origin];
+  int p = (int)priority;
+  for (int higher = 0; higher < p; ++higher)
+    if (state.Waiting[higher] > 0)
+      return false;
+
+  if (m_Active >= GlobalCap(priority))
+    return false;
+
+  UINT32 originCap = m_Limits.MaxPerOrigin;
+  if (priority == TransferPriority::Interactive)
+    originCap++;
+  return state.Active < originCap;
+}
+
+// Drops an origin's bookkeeping once nothing runs or waits on it.
+void TransferScheduler::Forget(const std::wstring &origin) {
+  auto it = m_Origins.find(origin);
+  if (it == m_Origins.end() || it->second.Active > 0)
+    return;
+  for (UINT32 waiting : it->second.Waiting)
+    if (waiting > 0)
+      return;
+  m_Origins.erase(it);
+}
+
+TransferScheduler::Slot
+TransferScheduler::Acquire(const std::wstring &origin,
+                           TransferPriority priority) {
+  return Admit(origin, priority, nullptr);
+}
+
+TransferScheduler::Slot
+TransferScheduler::Acquire(const std::wstring &origin,
+                           const SharedPriority &priority) {
+  return Admit(origin, priority, &priority);
+}
+
+TransferScheduler::Slot
+TransferScheduler::Admit(const std::wstring &origin,
+                         TransferPriority priority,
+                         const SharedPriority *shared) {
+  std::unique_lock<std::mutex> lock(m_Lock);
+  m_Origins[origin].Waiting[(int)priority]++;
+  m_Changed.wait(lock, [&]() {
+    if (shared && *shared != priority) {
+      // Raised while queued; wait in the new class instead.
+      OriginState &state = m_Origins[origin];
+      state.Waiting[(int)priority]--;
+      priority = *shared;
+      state.Waiting[(int)priority]++;
+    }
+    return CanAdmit(origin, priority);
+  });
+
+  OriginState &state = m_Origins[origin];
+  int p = (int)priority;
+  state.Waiting[p]--;
+  state.Active++;
+  state.Running[p]++;
+  m_Active++;
+  // Our leaving the wait queue may unblock lower classes.
+  m_Changed.notify_all();
+  return Slot(origin, priority, shared);
+}
+
+void TransferScheduler::Raise(SharedPriority &priority, TransferPriority to) {
+  // Under m_Lock so a transfer waiting in Admit or Throttle can't miss it.
+  std::lock_guard<std::mutex> guard(m_Lock);
+  if (to < priority)
+    priority = to;
+  m_Changed.notify_all();
+}
+
+void TransferScheduler::Release(const std::wstring &origin,
+                                TransferPriority priority) {
+  std::lock_guard<std::mutex> guard(m_Lock);
+  m_Active--;
+  OriginState &state = m_Origins[origin];
+  state.Active--;
+  state.Running[(int)priority]--;
+  Forget(origin);
+  m_Changed.notify_all();
+}
+
+TransferScheduler::Slot::~Slot() { Release(m_Origin, m_Priority); }
+
+void TransferScheduler::Slot::Throttle(UINT64 bytes) {
+  std::chrono::microseconds wait(0);
+  {
+    std::unique_lock<std::mutex> lock(m_Lock);
+    int interactive = (int)TransferPriority::Interactive;
+    bool announced = false;
+    while (true) {
+      if (Raised()) {
+        OriginState &state = m_Origins[m_Origin];
+        state.Running[(int)m_Priority]--;
+        m_Priority = *m_Shared;
+        state.Running[(int)m_Priority]++;
+      }
+      if (m_Priority == TransferPriority::Interactive ||
+          m_Origins[m_Origin].Running[interactive] == 0)
+        break;
+      // Stop reading until MAME's transfer from this origin is done. If the
+      // origin gives up on us meanwhile, the .part journal lets the retry
+      // resume.
+      if (!announced)
+        std::wcout << L"Transfer to " << m_Origin
+                   << L" paused for an interactive download." << std::endl;
+      announced = true;
+      m_Changed.wait(lock, [&]() {
+        return Raised() || m_Origins[m_Origin].Running[interactive] == 0;
+      });
+    }
+    wait = m_Global.Reserve(bytes);
+    if (m_Priority != TransferPriority::Interactive)
+      wait = (std::max)(wait, m_Bulk.Reserve(bytes));
+  }
+  if (wait.count() > 0)
+    std::this_thread::sleep_for(wait);
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <windows.h>
+
+enum class TransferPriority {
+  Interactive = 0, // MAME is blocked on this open
+  Prefetch = 1,    // dependency or explicitly requested prefetch
+  Background = 2,  // revalidation, cache warming
+};
+
+struct TransferLimits {
+  UINT32 MaxTransfers = 4;      // global concurrency cap
+  UINT32 MaxPerOrigin = 2;      // per-host concurrency cap
+  UINT64 BytesPerSecond = 0;    // global bandwidth cap, 0 = unlimited
+  UINT64 BulkBytesPerSecond = 0; // extra cap for non-interactive classes
+};
+
+// Central admission and pacing for every HTTP transfer. Interactive
+// transfers always get the next free slot on their origin and, while any
+// are running, lower classes on that origin stop reading so the
+// interactive one gets the bandwidth. Other origins (a LAN -serve
+// upstream, say) keep going.
+class TransferScheduler {
+public:
+  // A transfer's class that other callers may raise while it is queued or
+  // running, e.g. when MAME opens an archive that is being prefetched.
+  using SharedPriority = std::atomic<TransferPriority>;
+
+  // Held for the lifetime of one transfer; releases its slot on destruction.
+  class Slot {
+  public:
+    Slot(const Slot &) = delete;
+    Slot &operator=(const Slot &) = delete;
+    ~Slot();
+
+    // Call after receiving `bytes`; sleeps as needed to honor the
+    // bandwidth caps and to yield to interactive transfers.
+    void Throttle(UINT64 bytes);
+
+  private:
+    friend class TransferScheduler;
+    Slot(const std::wstring &origin, TransferPriority priority,
+         const SharedPriority *shared)
+        : m_Origin(origin), m_Priority(priority), m_Shared(shared) {}
+
+    bool Raised() const { return m_Shared && *m_Shared < m_Priority; }
+
+    std::wstring m_Origin;
+    TransferPriority m_Priority; // class counted in Running
+    const SharedPriority *m_Shared;
+  };
+
+  static void Configure(const TransferLimits &limits);
+  static Slot Acquire(const std::wstring &origin, TransferPriority priority);
+  // Follows `priority` if it is raised while queued or running.
+  static Slot Acquire(const std::wstring &origin,
+                      const SharedPriority &priority);
+  // Raises `priority` to `to` if that is higher, and lets the transfer
+  // using it move up.
+  static void Raise(SharedPriority &priority, TransferPriority to);
+  // How many transfers of this class can run at once against one origin.
+  static UINT32 Capacity(TransferPriority priority);
+
+private:
+  struct TokenBucket {
+    double Rate = 0; // bytes per second, 0 = unlimited
+    double Tokens = 0;
+    std::chrono::steady_clock::time_point Last;
+
+    std::chrono::microseconds Reserve(UINT64 bytes);
+  };
+
+  static UINT32 GlobalCap(TransferPriority priority);
+  static bool CanAdmit(const std::wstring &origin, TransferPriority priority);
+  static void Release(const std::wstring &origin, TransferPriority priority);
+
+  static std::mutex m_Lock;
+  static std::condition_variable m_Changed;
+  static TransferLimits m_Limits;
+  // Transfers admitted or queued for one origin.
+  struct OriginState {
+    UINT32 Active = 0;
+    UINT32 Running[3] = {0, 0, 0};
+    UINT32 Waiting[3] = {0, 0, 0};
+  };
+
+  static Slot Admit(const std::wstring &origin, TransferPriority priority,
+                    const SharedPriority *shared);
+  static void Forget(const std::wstring &origin);
+
+  static UINT32 m_Active;
+  static std::map<std::wstring, OriginState> m_Origins;
+  static TokenBucket m_Global;
+  static TokenBucket m_Bulk;
+};
@@ -0,0 +1,176 @@
+#include "UsageHistory.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cwctype>
+#include <fstream>
+#include <iostream>
+
+// Launches lose half their weight every week, so last month's favorite
+// fades behind what is being played now.
+static const double kHalfLifeDays = 7.0;
+// A favorite ranks like this many launches made today.
+static const double kFavoriteLaunches = 3.0;
+static const UINT64 kFileTimeDay = 24ull * 60 * 60 * 10000000;
+
+static std::wstring FoldCase(std::wstring s) {
+  for (auto &c : s)
+    c = towlower(c);
+  return s;
+}
+
+// MAME short names: up to 16 of [a-z0-9_], never all digits. Favorites
+// files carry other fields (years, flags, titles) that this rules out.
+static bool IsSetName(const std::string &s) {
+  if (s.empty() || s.size() > 16)
+    return false;
+  bool digitsOnly = true;
+  for (char c : s) {
+    if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_'))
+      return false;
+    if (c < '0' || c > '9')
+      digitsOnly = false;
+  }
+  return !digitsOnly;
+}
+
+static UINT64 CurrentFileTime() {
+  FILETIME ft;
+  GetSystemTimeAsFileTime(&ft);
+  return ((UINT64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+bool UsageHistory::Load(const std::wstring &cacheDir) {
+  std::lock_guard<std::mutex> guard(m_Lock);
+  m_Path = cacheDir + L"\\mcr.usage";
+  m_LastActivity = GetTickCount64();
+
+  std::ifstream in(m_Path);
+  if (!in.is_open())
+    return false;
+  // One set per line: name <tab> launches <tab> last launch (FILETIME).
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t tab1 = line.find('\t');
+    size_t tab2 = line.find('\t', tab1 + 1);
+    if (tab1 == std::string::npos || tab2 == std::string::npos)
+      continue;
+    std::string name = line.substr(0, tab1);
+    if (!IsSetName(name))
+      continue;
+    Record &record = m_Sets[std::wstring(name.begin(), name.end())];
+    record.Launches =
+        (UINT32)std::strtoul(line.c_str() + tab1 + 1, nullptr, 10);
+    record.LastLaunch = std::strtoull(line.c_str() + tab2 + 1, nullptr, 10);
+  }
+  return true;
+}
+
+bool UsageHistory::Save() {
+  std::lock_guard<std::mutex> guard(m_Lock);
+  if (!m_Dirty || m_Path.empty())
+    return true;
+
+  // Same write-and-rename as the download journals.
+  std::wstring tmpPath = m_Path + L".tmp";
+  {
+    std::ofstream out(tmpPath, std::ios::trunc);
+    if (!out.is_open())
+      return false;
+    for (const auto &item : m_Sets) {
+      if (item.second.Launches == 0)
+        continue; // favorites are re-imported every run
+      out << std::string(item.first.begin(), item.first.end()) << "\t"
+          << item.second.Launches << "\t" << item.second.LastLaunch << "\n";
+    }
+    if (!out.good())
+      return false;
+  }
+  if (!MoveFileExW(tmpPath.c_str(), m_Path.c_str(),
+                   MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    return false;
+  m_Dirty = false;
+  return true;
+}
+
+size_t UsageHistory::ImportFavorites(const std::wstring &path) {
+  std::ifstream in(path);
+  if (!in.is_open()) {
+    std::wcerr << L"Cannot read favorites: " << path << std::endl;
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> guard(m_Lock);
+  size_t imported = 0;
+  std::string line;
+  while (std::getline(in, line)) {
+    while (!line.empty() && (line.back() == '\r' || line.back() == ' '))
+      line.pop_back();
+    if (!IsSetName(line))
+      continue;
+    Record &record = m_Sets[std::wstring(line.begin(), line.end())];
+    if (!record.Favorite) {
+      record.Favorite = true;
+      imported++;
+    }
+  }
+  return imported;
+}
+
+void UsageHistory::RecordLaunch(const std::wstring &archiveName) {
+  size_t begin = archiveName.find_first_not_of(L'\\');
+  size_t dot = archiveName.rfind(L'.');
+  if (begin == std::wstring::npos || dot == std::wstring::npos ||
+      dot <= begin || archiveName.find(L'\\', begin) != std::wstring::npos)
+    return; // only sets in the rompath root
+  std::wstring set = FoldCase(archiveName.substr(begin, dot - begin));
+
+  std::lock_guard<std::mutex> guard(m_Lock);
+  Record &record = m_Sets[set];
+  record.Launches++;
+  record.LastLaunch = CurrentFileTime();
+  m_Dirty = true;
+  m_LastActivity = GetTickCount64();
+}
+
+double UsageHistory::Score(const Record &record, UINT64 now) {
+  double score = 0;
+  if (record.Launches) {
+    double ageDays = now > record.LastLaunch
+                         ? (double)(now - record.LastLaunch) / kFileTimeDay
+                         : 0;
+    score = record.Launches * std::pow(0.5, ageDays / kHalfLifeDays);
+  }
+  if (record.Favorite)
+    score += kFavoriteLaunches;
+  return score;
+}
+
+std::vector<std::wstring> UsageHistory::Top(size_t count) {
+  UINT64 now = CurrentFileTime();
+  std::vector<std::pair<double, std::wstring>> ranked;
+  {
+    std::lock_guard<std::mutex> guard(m_Lock);
+    for (const auto &item : m_Sets)
+      ranked.push_back({Score(item.second, now), item.first});
+  }
+  count = (std::min)(count, ranked.size());
+  // Best score first; ties go alphabetically so the pick is stable.
+  std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(),
+                    [](const std::pair<double, std::wstring> &a,
+                       const std::pair<double, std::wstring> &b) {
+                      if (a.first != b.first)
+                        return a.first > b.first;
+                      return a.second < b.second;
+                    });
+
+  std::vector<std::wstring> sets;
+  for (size_t i = 0; i < count; ++i)
+    sets.push_back(ranked[i].second);
+  return sets;
+}
+
+UINT64 UsageHistory::IdleFor() {
+  std::lock_guard<std::mutex> guard(m_Lock);
+  return GetTickCount64() - m_LastActivity;
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <windows.h>
+
+// Which sets get played, kept in <cache>\mcr.usage so a wiped cache or a
+// new cabinet can be warmed with the games that will be launched next.
+class UsageHistory {
+public:
+  bool Load(const std::wstring &cacheDir);
+  bool Save();
+
+  // Marks every set named in MAME's ui favorites.ini, or a folder .ini
+  // with one set per line, as a favorite for this session.
+  size_t ImportFavorites(const std::wstring &path);
+
+  // Counts a launch of the set `archiveName` (e.g. \pacman.zip) belongs
+  // to. MAME opens several archives, several times, while starting one
+  // game; LaunchDetector picks the open that is the launch.
+  void RecordLaunch(const std::wstring &archiveName);
+
+  // The `count` sets most likely to be launched next, best first.
+  std::vector<std::wstring> Top(size_t count);
+
+  // Milliseconds since the last recorded launch, or since Load.
+  UINT64 IdleFor();
+
+private:
+  struct Record {
+    UINT32 Launches = 0;
+    UINT64 LastLaunch = 0; // FILETIME
+    bool Favorite = false;
+  };
+
+  static double Score(const Record &record, UINT64 now);
+
+  std::mutex m_Lock;
+  std::wstring m_Path;
+  std::map<std::wstring, Record> m_Sets; // by case-folded set name
+  bool m_Dirty = false;
+  UINT64 m_LastActivity = 0; // GetTickCount64
+};
+
+// Tells launches apart from the other archive opens MAME makes. Starting a
+// game opens its own archive first and then, within moments, its parent,
+// BIOS and devices; only that first open of a burst is a launch, and only
+// if the game was not already launched within kLaunchGapMs.
+class LaunchDetector {
+public:
+  // Opens this close to the previous archive open belong to its burst.
+  static const UINT64 kBurstGapMs = 3000;
+  // An archive opened again within this long belongs to the same launch.
+  static const UINT64 kLaunchGapMs = 10 * 60 * 1000;
+
+  // Notes an archive open at `nowMs` (GetTickCount64); `lastOpened` is
+  // that archive's own last open time, which this updates. Never blocks
+  // or allocates.
+  bool IsLaunch(std::atomic<UINT64> &lastOpened, UINT64 nowMs) {
+    UINT64 lastAny = m_LastOpen.exchange(nowMs);
+    UINT64 last = lastOpened.exchange(nowMs);
+    if (lastAny != 0 && nowMs - lastAny < kBurstGapMs)
+      return false;
+    return last == 0 || nowMs - last >= kLaunchGapMs;
+  }
+
+private:
+  std::atomic<UINT64> m_LastOpen{0};
+};
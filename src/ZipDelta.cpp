@@ -0,0 +1,409 @@
+#include "ZipDelta.h"
+#include "Crc32.h"
+#include "Trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+
+// Covers the end of central directory record with the longest comment.
+static const UINT64 kTailSize = 22 + 65535;
+// Past this fraction of the file a full download costs about the same.
+static const double kMaxDeltaFraction = 0.5;
+
+static const UINT32 kEndRecordSignature = 0x06054b50;
+static const UINT32 kCentralSignature = 0x02014b50;
+static const UINT32 kLocalSignature = 0x04034b50;
+// General purpose flag: CRC and sizes follow the data instead.
+static const UINT16 kDataDescriptorFlag = 0x0008;
+
+static UINT16 Read16(const BYTE *p) { return (UINT16)(p[0] | (p[1] << 8)); }
+
+static UINT32 Read32(const BYTE *p) {
+  return (UINT32)p[0] | ((UINT32)p[1] << 8) | ((UINT32)p[2] << 16) |
+         ((UINT32)p[3] << 24);
+}
+
+static bool ReadAt(HANDLE hFile, UINT64 offset, void *data, DWORD size) {
+  OVERLAPPED ov = {0};
+  ov.Offset = (DWORD)offset;
+  ov.OffsetHigh = (DWORD)(offset >> 32);
+  DWORD got = 0;
+  return ReadFile(hFile, data, size, &got, &ov) && got == size;
+}
+
+static bool WriteAt(HANDLE hFile, UINT64 offset, const void *data,
+                    DWORD size) {
+  OVERLAPPED ov = {0};
+  ov.Offset = (DWORD)offset;
+  ov.OffsetHigh = (DWORD)(offset >> 32);
+  DWORD written = 0;
+  return WriteFile(hFile, data, size, &written, &ov) && written == size;
+}
+
+bool ZipDelta::FindEndRecord(const std::string &tail, UINT64 fileSize,
+                             Directory &dir) {
+  if (tail.size() < 22 || tail.size() > fileSize)
+    return false;
+  const BYTE *p = (const BYTE *)tail.data();
+  for (size_t i = tail.size() - 22 + 1; i-- > 0;) {
+    if (Read32(p + i) != kEndRecordSignature)
+      continue;
+    UINT16 commentLength = Read16(p + i + 20);
+    if (i + 22 + commentLength != tail.size())
+      continue;
+
+    UINT16 entries = Read16(p + i + 10);
+    UINT32 size = Read32(p + i + 12);
+    UINT32 offset = Read32(p + i + 16);
+    // Zip64 archives are left to a full download.
+    if (entries == 0xFFFF || size == 0xFFFFFFFF || offset == 0xFFFFFFFF)
+      return false;
+    UINT64 recordOffset = fileSize - tail.size() + i;
+    if ((UINT64)offset + size > recordOffset)
+      return false;
+
+    dir.FileSize = fileSize;
+    dir.Offset = offset;
+    dir.Size = size;
+    return true;
+  }
+  return false;
+}
+
+bool ZipDelta::ParseDirectory(const BYTE *data, size_t size, Directory &dir) {
+  dir.Members.clear();
+  size_t pos = 0;
+  while (pos + 46 <= size && Read32(data + pos) == kCentralSignature) {
+    const BYTE *p = data + pos;
+    Member m;
+    m.Flags = Read16(p + 8);
+    m.Method = Read16(p + 10);
+    m.Time = Read16(p + 12);
+    m.Date = Read16(p + 14);
+    m.Crc32 = Read32(p + 16);
+    m.CompressedSize = Read32(p + 20);
+    m.UncompressedSize = Read32(p + 24);
+    UINT16 nameLength = Read16(p + 28);
+    UINT16 extraLength = Read16(p + 30);
+    UINT16 commentLength = Read16(p + 32);
+    m.LocalOffset = Read32(p + 42);
+    if (m.CompressedSize == 0xFFFFFFFF || m.UncompressedSize == 0xFFFFFFFF ||
+        m.LocalOffset == 0xFFFFFFFF)
+      return false;
+
+    size_t recordLength = 46 + nameLength + extraLength + commentLength;
+    if (pos + recordLength > size)
+      return false;
+    m.Name.assign((const char *)p + 46, nameLength);
+    dir.Members.push_back(m);
+    pos += recordLength;
+  }
+  if (pos != size)
+    return false;
+
+  // A member's bytes run from its local header to the next one, which also
+  // takes in any data descriptor.
+  std::sort(dir.Members.begin(), dir.Members.end(),
+            [](const Member &a, const Member &b) {
+              return a.LocalOffset < b.LocalOffset;
+            });
+  for (size_t i = 0; i < dir.Members.size(); ++i) {
+    UINT64 end = (i + 1 < dir.Members.size()) ? dir.Members[i + 1].LocalOffset
+                                               : dir.Offset;
+    if (end <= dir.Members[i].LocalOffset)
+      return false;
+    dir.Members[i].Span = end - dir.Members[i].LocalOffset;
+  }
+  return true;
+}
+
+bool ZipDelta::ReadLocalDirectory(HANDLE hFile, Directory &dir) {
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(hFile, &fileSize))
+    return false;
+  UINT64 size = (UINT64)fileSize.QuadPart;
+  UINT64 tailLength = (std::min)(size, kTailSize);
+
+  std::string tail((size_t)tailLength, '\0');
+  if (!ReadAt(hFile, size - tailLength, &tail[0], (DWORD)tailLength) ||
+      !FindEndRecord(tail, size, dir))
+    return false;
+
+  std::vector<BYTE> central((size_t)dir.Size);
+  if (dir.Size > 0 &&
+      !ReadAt(hFile, dir.Offset, central.data(), (DWORD)dir.Size))
+    return false;
+  return ParseDirectory(central.data(), central.size(), dir);
+}
+
+bool ZipDelta::Unchanged(const Member &a, const Member &b) {
+  // Everything the local header repeats has to match too, or the reused
+  // bytes would differ from the origin's.
+  return a.Name == b.Name && a.Flags == b.Flags && a.Method == b.Method &&
+         a.Time == b.Time && a.Date == b.Date && a.Crc32 == b.Crc32 &&
+         a.CompressedSize == b.CompressedSize &&
+         a.UncompressedSize == b.UncompressedSize && a.Span == b.Span;
+}
+
+bool ZipDelta::VerifyMembers(HANDLE hFile, const Directory &dir) {
+  std::vector<BYTE> buffer(1024 * 1024);
+  for (const auto &m : dir.Members) {
+    BYTE header[30];
+    if (!ReadAt(hFile, m.LocalOffset, header, sizeof(header)) ||
+        Read32(header) != kLocalSignature || Read16(header + 6) != m.Flags ||
+        Read16(header + 8) != m.Method || Read16(header + 10) != m.Time ||
+        Read16(header + 12) != m.Date)
+      return false;
+    if (!(m.Flags & kDataDescriptorFlag) &&
+        (Read32(header + 14) != m.Crc32 ||
+         Read32(header + 18) != m.CompressedSize ||
+         Read32(header + 22) != m.UncompressedSize))
+      return false;
+
+    UINT16 nameLength = Read16(header + 26);
+    UINT16 extraLength = Read16(header + 28);
+    std::string name(nameLength, '\0');
+    if (nameLength != m.Name.size() ||
+        (nameLength > 0 &&
+         !ReadAt(hFile, m.LocalOffset + 30, &name[0], nameLength)) ||
+        name != m.Name)
+      return false;
+    UINT64 dataOffset = m.LocalOffset + 30 + nameLength + extraLength;
+    if (dataOffset + m.CompressedSize > m.LocalOffset + m.Span)
+      return false;
+
+    // Stored data is its own CRC input; compressed members are left to the
+    // archive test in Update.
+    if (m.Method != 0)
+      continue;
+    UINT32 crc = 0;
+    for (UINT64 done = 0; done < m.CompressedSize;) {
+      DWORD chunk =
+          (DWORD)(std::min)((UINT64)buffer.size(), m.CompressedSize - done);
+      if (!ReadAt(hFile, dataOffset + done, buffer.data(), chunk))
+        return false;
+      crc = Crc32Update(crc, buffer.data(), chunk);
+      done += chunk;
+    }
+    if (crc != m.Crc32)
+      return false;
+  }
+  return true;
+}
+
+bool ZipDelta::HaveTar() {
+  // Windows 10 and later ship a tar that reads zips; older or trimmed-down
+  // systems may not, and every archive test would then fail.
+  static const bool found = [] {
+    bool ok = _wsystem(L"tar --version > NUL 2> NUL") == 0;
+    if (!ok)
+      std::wcerr << L"tar not found: zips with compressed members will be "
+                    L"downloaded whole rather than by zip delta"
+                 << std::endl;
+    return ok;
+  }();
+  return found;
+}
+
+bool ZipDelta::TestArchive(const std::wstring &path) {
+  Trace::Span trace("extract", "tar test", path.c_str());
+  // Extracting to stdout makes tar inflate every member and check it
+  // against its CRC, without writing anything.
+  std::wstring command = L"tar -xOf \"" + path + L"\" > NUL 2> NUL";
+  int status = _wsystem(command.c_str());
+  if (status != 0)
+    std::wcerr << L"Zip delta archive test failed (tar exit " << status
+               << L"): " << path << std::endl;
+  return status == 0;
+}
+
+bool ZipDelta::Update(const std::wstring &url, const std::wstring &destination,
+                      DownloadInfo *info, TransferPriority priority) {
+  if (destination.size() < 4 ||
+      _wcsicmp(destination.c_str() + destination.size() - 4, L".zip") != 0)
+    return false;
+  Trace::Span trace("net", "delta update", url.c_str());
+  auto start = std::chrono::steady_clock::now();
+
+  HANDLE hLocal =
+      CreateFileW(destination.c_str(), GENERIC_READ,
+                  FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                  OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+  if (hLocal == INVALID_HANDLE_VALUE)
+    return false;
+  Directory local;
+  if (!ReadLocalDirectory(hLocal, local)) {
+    CloseHandle(hLocal);
+    return false;
+  }
+
+  // The tail holds the end record and, for all but huge sets, the whole
+  // central directory.
+  HttpValidator validator;
+  std::string tail;
+  auto appendTo = [](std::string &out) {
+    return [&out](UINT64, const BYTE *data, DWORD size) {
+      out.append((const char *)data, size);
+      return true;
+    };
+  };
+  Directory remote;
+  bool ok =
+      Downloader::FetchRanges(url, {{Downloader::kSuffixRange, kTailSize}},
+                              validator, appendTo(tail), priority) &&
+      FindEndRecord(tail, validator.Size, remote);
+  UINT64 tailOffset = validator.Size - tail.size();
+  if (ok && remote.Offset < tailOffset) {
+    std::string head;
+    ok = Downloader::FetchRanges(
+        url, {{remote.Offset, tailOffset - remote.Offset}}, validator,
+        appendTo(head), priority);
+    tail = head + tail;
+    tailOffset = remote.Offset;
+  }
+  UINT64 fetched = tail.size();
+  ok = ok &&
+       ParseDirectory((const BYTE *)tail.data() + (remote.Offset - tailOffset),
+                      (size_t)remote.Size, remote);
+  if (!ok) {
+    CloseHandle(hLocal);
+    std::wcout << L"No zip delta possible, downloading whole file: " << url
+               << std::endl;
+    return false;
+  }
+  // Stored members are checked in full by VerifyMembers; compressed ones
+  // need tar, and without it the rebuilt file could never be swapped in.
+  bool compressed =
+      std::any_of(remote.Members.begin(), remote.Members.end(),
+                  [](const Member &m) { return m.Method != 0; });
+  if (compressed && !HaveTar()) {
+    CloseHandle(hLocal);
+    return false;
+  }
+  // A partial download of this same origin file resumes cheaper than a
+  // delta rebuilds, and rebuilding would throw its bytes away.
+  if (Downloader::HasResumablePart(destination, validator)) {
+    CloseHandle(hLocal);
+    std::wcout << L"Resuming partial download instead of a zip delta: "
+               << url << std::endl;
+    return false;
+  }
+
+  std::map<std::string, const Member *> cached;
+  for (const auto &m : local.Members)
+    cached[m.Name] = &m;
+
+  // Lay out the new file exactly like the origin's. Everything from
+  // tailOffset on is already in memory.
+  std::vector<LocalCopy> copies;
+  std::vector<std::pair<UINT64, UINT64>> ranges;
+  UINT64 rangeBytes = 0;
+  auto addRemote = [&](UINT64 offset, UINT64 length) {
+    if (offset >= tailOffset)
+      return;
+    length = (std::min)(length, tailOffset - offset);
+    if (!ranges.empty() &&
+        ranges.back().first + ranges.back().second == offset)
+      ranges.back().second += length;
+    else
+      ranges.push_back({offset, length});
+    rangeBytes += length;
+  };
+
+  size_t changed = 0;
+  UINT64 pos = 0;
+  for (const auto &m : remote.Members) {
+    if (m.LocalOffset > pos)
+      addRemote(pos, m.LocalOffset - pos);
+    auto it = cached.find(m.Name);
+    if (it != cached.end() && Unchanged(*it->second, m)) {
+      if (m.LocalOffset < tailOffset)
+        copies.push_back({m.LocalOffset,
+                          (std::min)(m.Span, tailOffset - m.LocalOffset),
+                          it->second->LocalOffset});
+    } else {
+      changed++;
+      addRemote(m.LocalOffset, m.Span);
+    }
+    pos = m.LocalOffset + m.Span;
+  }
+  if (pos < remote.Offset)
+    addRemote(pos, remote.Offset - pos);
+
+  if (changed == remote.Members.size() ||
+      fetched + rangeBytes > remote.FileSize * kMaxDeltaFraction) {
+    CloseHandle(hLocal);
+    std::wcout << L"Zip delta would fetch " << (fetched + rangeBytes) / 1024
+               << L" of " << remote.FileSize / 1024
+               << L" KB, downloading whole file: " << url << std::endl;
+    return false;
+  }
+
+  std::wstring partPath = destination + L".part";
+  // Any journal left here is for another origin file, so its bytes are of
+  // no use; left in place it would let a later full download resume from
+  // ours as if they were its own.
+  DeleteFileW((partPath + L".journal").c_str());
+  HANDLE hOut = CreateFileW(
+      partPath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+      CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (hOut == INVALID_HANDLE_VALUE) {
+    CloseHandle(hLocal);
+    return false;
+  }
+
+  std::vector<BYTE> buffer(1024 * 1024);
+  for (const auto &copy : copies) {
+    for (UINT64 done = 0; ok && done < copy.Length;) {
+      DWORD chunk =
+          (DWORD)(std::min)((UINT64)buffer.size(), copy.Length - done);
+      ok = ReadAt(hLocal, copy.LocalOffset + done, buffer.data(), chunk) &&
+           WriteAt(hOut, copy.Offset + done, buffer.data(), chunk);
+      done += chunk;
+    }
+  }
+  CloseHandle(hLocal);
+
+  ok = ok &&
+       Downloader::FetchRanges(
+           url, ranges, validator,
+           [hOut](UINT64 offset, const BYTE *data, DWORD size) {
+             return WriteAt(hOut, offset, data, size);
+           },
+           priority) &&
+       WriteAt(hOut, tailOffset, tail.data(), (DWORD)tail.size());
+  FlushFileBuffers(hOut);
+  // Every member has to match the origin's central directory, data CRC
+  // included, before the rebuilt file replaces a good one.
+  bool verified = ok && VerifyMembers(hOut, remote);
+  CloseHandle(hOut);
+  if (ok && !verified)
+    std::wcerr << L"Zip delta member check failed: " << partPath << std::endl;
+  ok = verified && (!compressed || TestArchive(partPath));
+
+  UINT32 crc = 0;
+  ok = ok && Crc32File(partPath, crc) &&
+       Downloader::SwapIntoPlace(partPath, destination);
+  if (!ok) {
+    DeleteFileW(partPath.c_str());
+    std::wcerr << L"Zip delta update failed, downloading whole file: " << url
+               << std::endl;
+    return false;
+  }
+
+  if (info) {
+    info->Validator = validator;
+    info->Crc32 = crc;
+  }
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  std::wcout << L"Zip delta update: " << changed << L" of "
+             << remote.Members.size() << L" members changed, fetched "
+             << (fetched + rangeBytes) / 1024 << L" of "
+             << remote.FileSize / 1024 << L" KB in " << ms
+             << L" ms: " << destination << std::endl;
+  return true;
+}
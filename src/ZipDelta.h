@@ -0,0 +1,64 @@
+#pragma once
+#include "Downloader.h"
+#include <string>
+#include <vector>
+
+// Member-level updates for cached zips. The origin's central directory is
+// read with a tail Range request; members whose entries match the cached
+// copy are reused from disk and only the rest are range-fetched. The new
+// file mirrors the origin's layout offset for offset, and every member is
+// checked against the origin's CRC before it is swapped in.
+class ZipDelta {
+public:
+  // Brings `destination` up to date with `url`. Returns false when a delta
+  // is not possible or not worth it; the caller then downloads everything.
+  static bool Update(const std::wstring &url, const std::wstring &destination,
+                     DownloadInfo *info, TransferPriority priority);
+
+  // The pieces Update is built from, public so they can be checked on
+  // their own.
+  struct Member {
+    std::string Name;
+    UINT16 Flags = 0;
+    UINT16 Method = 0;
+    UINT16 Time = 0;
+    UINT16 Date = 0;
+    UINT32 Crc32 = 0;
+    UINT64 CompressedSize = 0;
+    UINT64 UncompressedSize = 0;
+    UINT64 LocalOffset = 0;
+    UINT64 Span = 0; // local header to next member (or central directory)
+  };
+
+  struct Directory {
+    UINT64 FileSize = 0;
+    UINT64 Offset = 0; // of the central directory
+    UINT64 Size = 0;
+    std::vector<Member> Members; // sorted by LocalOffset
+  };
+
+  // Finds the end of central directory record in the last bytes of a file
+  // of `fileSize`, filling in the directory's offset and size.
+  static bool FindEndRecord(const std::string &tail, UINT64 fileSize,
+                            Directory &dir);
+  // Parses the central directory FindEndRecord located into dir.Members.
+  static bool ParseDirectory(const BYTE *data, size_t size, Directory &dir);
+  // Checks every local header in `hFile` against `dir`, and the data CRC of
+  // stored members.
+  static bool VerifyMembers(HANDLE hFile, const Directory &dir);
+
+private:
+  // Bytes of the rebuilt file that are copied from the cached copy.
+  struct LocalCopy {
+    UINT64 Offset;
+    UINT64 Length;
+    UINT64 LocalOffset;
+  };
+
+  static bool ReadLocalDirectory(HANDLE hFile, Directory &dir);
+  static bool Unchanged(const Member &a, const Member &b);
+  // True if a tar that can test zips is on the PATH. Looked up once.
+  static bool HaveTar();
+  // Inflates the whole archive, checking each member's CRC.
+  static bool TestArchive(const std::wstring &path);
+};
@@ -1,17 +1,77 @@
 #include "MameFs.h"
+#include "Trace.h"
+#include "TransferScheduler.h"
+#include <cstdlib>
 #include <iostream>
 #include <string>
 #include <vector>
 
 void print_usage() {
-  std::cout << "Usage: mcr -m <MountPoint> -c <CacheDir> -u <BaseUrl> [-7z]"
+  std::cout << "Usage: mcr -m <MountPoint> -c <CacheDir> -u <BaseUrl> [-7z] "
+               "[-rc <MB>]"
             << std::endl;
+  std::cout << "           [-j <N>] [-jo <N>] [-bw <KB/s>] [-bwbulk <KB/s>]"
+            << std::endl;
+  std::cout << "           [-norevalidate] [-revalidate-all]" << std::endl;
+  std::cout << "           [-prefetch <sets|listfile>] [-dat <file>] "
+               "[-noclones] [-verify]"
+            << std::endl;
+  std::cout << "           [-serve <port>] [-nomount] [-shard] [-chd <URL>]"
+            << std::endl;
+  std::cout << "           [-trace <dir>] [-trace-window <seconds>]"
+            << std::endl;
+  std::cout << "           [-warm <N>] [-favorites <file>]" << std::endl;
   std::cout << "\nOptions:" << std::endl;
   std::cout << "  -m   Mount point (e.g. Z:)" << std::endl;
   std::cout << "  -c   Cache directory (local storage)" << std::endl;
   std::cout << "  -u   Base URL (download source)" << std::endl;
   std::cout << "  -7z  Enable .7z file support (default: disabled)"
             << std::endl;
+  std::cout << "  -rc  Read cache size in MB (default: 64, 0 disables)"
+            << std::endl;
+  std::cout << "  -j   Max concurrent transfers (default: 4)" << std::endl;
+  std::cout << "  -jo  Max concurrent transfers per server (default: 2)"
+            << std::endl;
+  std::cout << "  -bw  Total bandwidth limit in KB/s (default: unlimited)"
+            << std::endl;
+  std::cout << "  -bwbulk  Bandwidth limit for background transfers in KB/s"
+            << std::endl;
+  std::cout << "  -norevalidate   Do not check cached archives for updates"
+            << std::endl;
+  std::cout << "  -revalidate-all Check every cached archive for updates, "
+               "then exit"
+            << std::endl;
+  std::cout << "  -prefetch Download sets (a,b,c or a file with one per line), "
+               "then exit"
+            << std::endl;
+  std::cout << "  -dat      MAME -listxml or DAT file; adds parents/BIOS, "
+               "alone selects every set"
+            << std::endl;
+  std::cout << "  -noclones With -dat and no -prefetch list, skip clones"
+            << std::endl;
+  std::cout << "  -verify   Check cached files against their recorded CRC"
+            << std::endl;
+  std::cout << "  -serve    Share the cache over HTTP on this port"
+            << std::endl;
+  std::cout << "  -nomount  With -serve, only run the server" << std::endl;
+  std::cout << "  -shard    Store archives in hashed subdirectories "
+               "(moves an existing cache once)"
+            << std::endl;
+  std::cout << "  -chd      Base URL for CHDs, streamed as MAME reads them"
+            << std::endl;
+  std::cout << "  -trace    Write a Chrome trace (chrome://tracing) of each "
+               "game launch here"
+            << std::endl;
+  std::cout << "  -trace-window With -trace, write one every N seconds "
+               "instead"
+            << std::endl;
+  std::cout << "  -warm     Keep the N most played sets cached, fetched in "
+               "the background"
+            << std::endl;
+  std::cout << "            (with -dat, their parents/BIOS too)" << std::endl;
+  std::cout << "  -favorites MAME favorites.ini; ranks those sets first for "
+               "-warm"
+            << std::endl;
   std::cout << "\nExample: mcr -m Z: -c C:\\MAME\\romcache -u "
                "https://mdk.cab/download/ -7z"
             << std::endl;
@@ -19,10 +79,13 @@ void print_usage() {
 
 int main(int argc, char *argv[]) {
   // Defines defaults
-  std::wstring mountPoint = L"Z:";
-  std::wstring cacheDir = L"C:\\MameCache";
-  std::wstring baseUrl = L"https://mdk.cab/download/";
-  bool enable7z = false;
+  MameFsOptions options;
+  TransferLimits limits;
+  bool revalidateAll = false;
+  PrefetchOptions prefetch;
+  bool prefetchMode = false;
+  std::wstring traceDir;
+  UINT32 traceWindow = 0;
 
   // Parse args
   // Since main gives char*, convert to wstring.
@@ -32,27 +95,97 @@ int main(int argc, char *argv[]) {
     std::string arg = argv[i];
     if (arg == "-m" && i + 1 < argc) {
       std::string val = argv[++i];
-      mountPoint = std::wstring(val.begin(), val.end());
+      options.MountPoint = std::wstring(val.begin(), val.end());
     } else if (arg == "-c" && i + 1 < argc) {
       std::string val = argv[++i];
-      cacheDir = std::wstring(val.begin(), val.end());
+      options.CacheDir = std::wstring(val.begin(), val.end());
     } else if (arg == "-u" && i + 1 < argc) {
       std::string val = argv[++i];
-      baseUrl = std::wstring(val.begin(), val.end());
+      options.BaseUrl = std::wstring(val.begin(), val.end());
     } else if (arg == "-7z") {
-      enable7z = true;
+      options.Enable7z = true;
+    } else if (arg == "-rc" && i + 1 < argc) {
+      options.ReadCacheMB = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-j" && i + 1 < argc) {
+      limits.MaxTransfers = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-jo" && i + 1 < argc) {
+      limits.MaxPerOrigin = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-bw" && i + 1 < argc) {
+      limits.BytesPerSecond = std::strtoull(argv[++i], nullptr, 10) * 1024;
+    } else if (arg == "-bwbulk" && i + 1 < argc) {
+      limits.BulkBytesPerSecond = std::strtoull(argv[++i], nullptr, 10) * 1024;
+    } else if (arg == "-norevalidate") {
+      options.Revalidate = false;
+    } else if (arg == "-revalidate-all") {
+      revalidateAll = true;
+    } else if (arg == "-prefetch" && i + 1 < argc) {
+      std::string val = argv[++i];
+      prefetch.Sets = std::wstring(val.begin(), val.end());
+      prefetchMode = true;
+    } else if (arg == "-dat" && i + 1 < argc) {
+      std::string val = argv[++i];
+      prefetch.DatPath = std::wstring(val.begin(), val.end());
+    } else if (arg == "-serve" && i + 1 < argc) {
+      options.ServePort = (UINT16)std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-nomount") {
+      options.Mount = false;
+    } else if (arg == "-shard") {
+      options.Shard = true;
+    } else if (arg == "-chd" && i + 1 < argc) {
+      std::string val = argv[++i];
+      options.ChdUrl = std::wstring(val.begin(), val.end());
+    } else if (arg == "-trace" && i + 1 < argc) {
+      std::string val = argv[++i];
+      traceDir = std::wstring(val.begin(), val.end());
+    } else if (arg == "-trace-window" && i + 1 < argc) {
+      traceWindow = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-warm" && i + 1 < argc) {
+      options.WarmSets = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-favorites" && i + 1 < argc) {
+      std::string val = argv[++i];
+      options.FavoritesPath = std::wstring(val.begin(), val.end());
+    } else if (arg == "-noclones") {
+      prefetch.NoClones = true;
+    } else if (arg == "-verify") {
+      prefetch.Verify = true;
     } else {
       print_usage();
       return 1;
     }
   }
+  // With -warm, a DAT on its own resolves the warmed sets' dependencies
+  // instead of selecting every set for -prefetch.
+  if (!prefetch.DatPath.empty() && options.WarmSets == 0)
+    prefetchMode = true;
+  options.WarmDatPath = prefetch.DatPath;
 
   std::wcout << L"Starting MameCloudRompath (MCR) v0.2..." << std::endl;
-  std::wcout << L"Mount Point: " << mountPoint << std::endl;
-  std::wcout << L"Cache Dir: " << cacheDir << std::endl;
-  std::wcout << L"Base URL: " << baseUrl << std::endl;
-  if (enable7z)
+  std::wcout << L"Mount Point: " << options.MountPoint << std::endl;
+  std::wcout << L"Cache Dir: " << options.CacheDir << std::endl;
+  std::wcout << L"Base URL: " << options.BaseUrl << std::endl;
+  if (options.Enable7z)
     std::wcout << L"7z Support: Enabled" << std::endl;
+  std::wcout << L"Read Cache: " << options.ReadCacheMB << L" MB" << std::endl;
+  std::wcout << L"Transfers: " << limits.MaxTransfers << L" total, "
+             << limits.MaxPerOrigin << L" per origin" << std::endl;
+  if (limits.BytesPerSecond)
+    std::wcout << L"Bandwidth Limit: " << limits.BytesPerSecond / 1024
+               << L" KB/s" << std::endl;
+  if (options.WarmSets)
+    std::wcout << L"Warm Sets: " << options.WarmSets << std::endl;
+  if (options.ServePort)
+    std::wcout << L"Serve Port: " << options.ServePort << std::endl;
+  if (limits.BulkBytesPerSecond)
+    std::wcout << L"Background Bandwidth Limit: "
+               << limits.BulkBytesPerSecond / 1024 << L" KB/s" << std::endl;
+  TransferScheduler::Configure(limits);
+  if (!traceDir.empty() && Trace::Start(traceDir, traceWindow))
+    std::wcout << L"Trace: " << traceDir << std::endl;
+
+  if (revalidateAll)
+    return MameFs::RevalidateAll(options);
+  if (prefetchMode)
+    return MameFs::Prefetch(options, prefetch);
 
-  return MameFs::Run(mountPoint, cacheDir, baseUrl, enable7z);
+  return MameFs::Run(options);
 }
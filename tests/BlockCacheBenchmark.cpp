@@ -0,0 +1,154 @@
+// Replays the reads MAME makes while loading a set from a zip against a
+// real file, once straight through as an uncached handle would, and once
+// through BlockCache and AccessPattern the way SRead does, counting reads
+// per second and the read syscalls each costs. Every read's bytes are
+// checked against the file.
+#include "AsyncFileIo.h"
+#include "BlockCache.h"
+#include "TestUtil.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+static const UINT64 kFileSize = 24 * 1024 * 1024 + 12345;
+static const UINT32 kMembers = 48;
+static const UINT32 kInflateChunk = 16 * 1024; // zlib input buffer
+
+struct TraceRead {
+  UINT64 Offset;
+  ULONG Length;
+};
+
+// What unzip does: the end of the file for the end-of-central-directory
+// record, the central directory in one read, then for each member its local
+// header followed by the data in inflate-sized chunks. Members are loaded
+// in ROM order, which is mostly but not entirely file order.
+static std::vector<TraceRead> MakeTrace() {
+  const UINT64 cdSize = kMembers * 80;
+  const UINT64 dataEnd = kFileSize - 22 - cdSize;
+  std::vector<TraceRead> trace;
+  trace.push_back({kFileSize - 65557, 65557});
+  trace.push_back({dataEnd, (ULONG)cdSize});
+
+  std::vector<UINT64> starts;
+  for (UINT32 m = 0; m <= kMembers; ++m)
+    starts.push_back(dataEnd * m / kMembers);
+  std::vector<UINT32> order;
+  for (UINT32 m = 0; m < kMembers; ++m)
+    order.push_back(m);
+  for (UINT32 m = 0; m + 3 < kMembers; m += 7)
+    std::swap(order[m], order[m + 3]);
+
+  for (UINT32 m : order) {
+    trace.push_back({starts[m], 30});
+    trace.push_back({starts[m] + 30, 12}); // file name
+    for (UINT64 pos = starts[m] + 42; pos < starts[m + 1];
+         pos += kInflateChunk)
+      trace.push_back(
+          {pos, (ULONG)(std::min)((UINT64)kInflateChunk, starts[m + 1] - pos)});
+  }
+  return trace;
+}
+
+struct ReplayStats {
+  UINT64 Syscalls = 0;
+  UINT64 BytesFromDisk = 0;
+  double ReadsPerSecond = 0;
+};
+
+static bool ReadFromDisk(HANDLE file, UINT64 offset, BYTE *buffer,
+                         DWORD length, ReplayStats &stats) {
+  stats.Syscalls++;
+  AsyncFileIo::ReadResult result = AsyncFileIo::ReadSync(
+      (AsyncFileIo::NativeFile)file, offset, buffer, length);
+  stats.BytesFromDisk += result.Bytes;
+  return result.Ok() && result.Bytes == length;
+}
+
+// SRead's cached path, minus WinFsp and the overlapped variant.
+static bool CachedRead(HANDLE file, BlockCache &cache, AccessPattern &pattern,
+                       UINT64 fileKey, const TraceRead &read, BYTE *buffer,
+                       ReplayStats &stats) {
+  UINT32 readAhead = pattern.Update(read.Offset, read.Length);
+  if (cache.Read(fileKey, read.Offset, buffer, read.Length))
+    return true;
+  UINT64 spanStart, spanEnd;
+  cache.SpanFor(fileKey, kFileSize, read.Offset, read.Length, readAhead,
+                spanStart, spanEnd);
+  std::vector<BYTE> span((size_t)(spanEnd - spanStart));
+  if (!ReadFromDisk(file, spanStart, span.data(), (DWORD)span.size(), stats))
+    return false;
+  cache.InsertSpan(fileKey, kFileSize, spanStart, span.data(),
+                   (DWORD)span.size());
+  memcpy(buffer, span.data() + (read.Offset - spanStart), read.Length);
+  return true;
+}
+
+static ReplayStats Replay(HANDLE file, const std::string &contents,
+                          const std::vector<TraceRead> &trace,
+                          BlockCache *cache) {
+  ReplayStats stats;
+  AccessPattern pattern;
+  std::vector<BYTE> buffer(65557);
+  size_t wrong = 0;
+  Stopwatch watch;
+  for (const TraceRead &read : trace) {
+    bool ok = cache ? CachedRead(file, *cache, pattern, 1, read,
+                                 buffer.data(), stats)
+                    : ReadFromDisk(file, read.Offset, buffer.data(),
+                                   read.Length, stats);
+    if (!ok ||
+        memcmp(buffer.data(), contents.data() + read.Offset, read.Length))
+      wrong++;
+  }
+  stats.ReadsPerSecond = trace.size() / watch.Seconds();
+  CHECK(wrong == 0);
+  return stats;
+}
+
+static void Report(const char *what, size_t reads, const ReplayStats &s) {
+  std::cout << what << ": " << reads << " reads, " << s.Syscalls
+            << " syscalls, " << s.BytesFromDisk / 1024 << " KB from disk, "
+            << (UINT64)s.ReadsPerSecond << " reads/s" << std::endl;
+}
+
+int main() {
+  ScratchDir dir(L"block-cache");
+  std::wstring path = dir.Path() + L"\\set.zip";
+  std::string contents((size_t)kFileSize, '\0');
+  for (size_t i = 0; i < contents.size(); ++i)
+    contents[i] = (char)((i * 131 + (i >> 16)) & 0xFF);
+  CHECK(WriteWholeFile(path, contents));
+  HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+  CHECK(file != INVALID_HANDLE_VALUE);
+  if (file == INVALID_HANDLE_VALUE)
+    return TestResult("BlockCacheBenchmark");
+
+  std::vector<TraceRead> trace = MakeTrace();
+  ReplayStats plain = Replay(file, contents, trace, nullptr);
+  Report("Uncached", trace.size(), plain);
+
+  BlockCache cache;
+  cache.SetCapacity(64 * 1024 * 1024);
+  ReplayStats first = Replay(file, contents, trace, &cache);
+  Report("Cached, first load", trace.size(), first);
+  ReplayStats again = Replay(file, contents, trace, &cache);
+  Report("Cached, reloaded", trace.size(), again);
+
+  // A cache too small for the set still gets read-ahead, and evicts rather
+  // than growing.
+  BlockCache small;
+  small.SetCapacity(2 * 1024 * 1024);
+  ReplayStats tight = Replay(file, contents, trace, &small);
+  Report("Cached in 2 MB", trace.size(), tight);
+  CloseHandle(file);
+
+  // Read-ahead turns the inflate-sized reads into a few large ones, and
+  // every byte comes off the disk about once.
+  CHECK(first.Syscalls * 5 < plain.Syscalls);
+  CHECK(first.BytesFromDisk < kFileSize + kFileSize / 4);
+  CHECK(again.Syscalls == 0);
+  CHECK(tight.Syscalls * 4 < plain.Syscalls);
+  return TestResult("BlockCacheBenchmark");
+}
@@ -0,0 +1,114 @@
+// Startup and open costs of the catalog at 50k archives, about a full
+// collection of sets: the first start with no catalog, which rebuilds it
+// from a directory scan, a restart that maps the saved one, and cached
+// opens (Lookup then Touch, as SOpen does) from one thread and from many.
+// The probe SOpen would otherwise make for each open, GetFileAttributesW,
+// is timed for comparison. The archives are empty files.
+#include "CacheCatalog.h"
+#include "TestUtil.h"
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+static const size_t kArchives = 50000;
+static const size_t kOpensPerThread = 200000;
+static const size_t kProbes = 5000;
+
+static std::wstring ArchiveName(size_t i) {
+  wchar_t name[32];
+  swprintf(name, 32, L"\\set%05zu.zip", i);
+  return name;
+}
+
+int main() {
+  ScratchDir cacheDir(L"catalog");
+  const std::wstring &dir = cacheDir.Path();
+  std::vector<std::wstring> names;
+  std::vector<UINT64> hashes;
+  for (size_t i = 0; i < kArchives; ++i) {
+    names.push_back(ArchiveName(i));
+    hashes.push_back(CacheCatalog::HashName(names[i].c_str()));
+    HANDLE h = CreateFileW((dir + names[i]).c_str(), GENERIC_WRITE, 0, NULL,
+                           CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    CHECK(h != INVALID_HANDLE_VALUE);
+    if (h != INVALID_HANDLE_VALUE)
+      CloseHandle(h);
+  }
+
+  CacheCatalog catalog;
+  Stopwatch watch;
+  CHECK(catalog.Open(dir));
+  double rebuildMs = watch.Ms();
+  CHECK(catalog.Count() == kArchives);
+  catalog.Close();
+
+  watch.Reset();
+  CHECK(catalog.Open(dir));
+  double reopenMs = watch.Ms();
+  CHECK(catalog.Count() == kArchives);
+  std::cout << kArchives << " archives: first start " << rebuildMs
+            << " ms rebuilding the catalog, restart " << reopenMs
+            << " ms mapping it" << std::endl;
+
+  // Touch moves LastAccess forward without disturbing the rest.
+  CatalogEntry before, after;
+  CHECK(catalog.Lookup(names[7].c_str(), &before, hashes[7]));
+  catalog.Touch(names[7].c_str(), hashes[7]);
+  CHECK(catalog.Lookup(names[7].c_str(), &after, hashes[7]));
+  CHECK(after.LastAccess >= before.LastAccess && after.LastAccess != 0);
+  CHECK(after.State == CatalogState::Complete);
+
+  // One thread's share of opens; returns how many found the archive.
+  auto opens = [&](size_t first) {
+    size_t hits = 0;
+    for (size_t k = 0; k < kOpensPerThread; ++k) {
+      size_t i = (first + k * 7919) % kArchives;
+      CatalogEntry entry;
+      if (catalog.Lookup(names[i].c_str(), &entry, hashes[i]) &&
+          entry.State == CatalogState::Complete) {
+        catalog.Touch(names[i].c_str(), hashes[i]);
+        hits++;
+      }
+    }
+    return hits;
+  };
+
+  watch.Reset();
+  CHECK(opens(0) == kOpensPerThread);
+  double single = kOpensPerThread / watch.Seconds();
+
+  UINT32 threads = (std::max)(2u, std::thread::hardware_concurrency());
+  std::vector<size_t> hits(threads);
+  std::vector<std::thread> workers;
+  watch.Reset();
+  for (UINT32 t = 0; t < threads; ++t)
+    workers.emplace_back([&, t]() { hits[t] = opens(t * 101); });
+  for (auto &w : workers)
+    w.join();
+  double total = threads * kOpensPerThread / watch.Seconds();
+  for (size_t h : hits)
+    CHECK(h == kOpensPerThread);
+
+  watch.Reset();
+  size_t found = 0;
+  for (size_t k = 0; k < kProbes; ++k)
+    if (GetFileAttributesW((dir + names[k * 7919 % kArchives]).c_str()) !=
+        INVALID_FILE_ATTRIBUTES)
+      found++;
+  double probeUs = watch.Seconds() * 1e6 / kProbes;
+  CHECK(found == kProbes);
+  catalog.Close();
+
+  std::cout << "Cached opens: " << (UINT64)single << "/s on one thread, "
+            << (UINT64)total << "/s in all on " << threads
+            << " threads; a filesystem probe takes " << probeUs << " us"
+            << std::endl;
+  // Loose bounds. Restarting maps the file instead of scanning, and opens
+  // share the lock, so more threads get more done than one. Touch taking
+  // the lock exclusively serializes every open and fails the last check.
+  CHECK(reopenMs < rebuildMs);
+  CHECK(single > 1e6 / probeUs);
+  CHECK(total > single * 1.2);
+  return TestResult("CacheCatalogBenchmark");
+}
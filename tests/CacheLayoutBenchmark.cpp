@@ -0,0 +1,168 @@
+// Open and listing latency of the flat and sharded cache layouts at 10k, 50k
+// and 100k archives, the sizes the sharded layout is meant for, and the time
+// to migrate the largest flat cache. The archives are empty files; what is
+// measured is the directory work, which is all the layout changes.
+#include "CacheCatalog.h"
+#include "CacheLayout.h"
+#include "TestUtil.h"
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+static const size_t kSizes[] = {10000, 50000, 100000};
+static const size_t kOpens = 2000;
+
+static std::wstring ArchiveName(size_t i) {
+  wchar_t name[32];
+  swprintf(name, 32, L"\\set%06zu.zip", i);
+  return name;
+}
+
+static std::wstring PathOf(const std::wstring &dir, bool sharded,
+                           const std::wstring &name) {
+  return sharded ? dir + CacheLayout::ShardDir(name.c_str()) + name
+                 : dir + name;
+}
+
+static bool CreateArchives(const std::wstring &dir, bool sharded,
+                           size_t from, size_t to) {
+  for (size_t i = from; i < to; ++i) {
+    HANDLE h = CreateFileW(PathOf(dir, sharded, ArchiveName(i)).c_str(),
+                           GENERIC_WRITE, 0, NULL, CREATE_NEW,
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+      return false;
+    CloseHandle(h);
+  }
+  return true;
+}
+
+// Microseconds per open of a cached archive, alternating with a probe for
+// one that is not cached, as SOpen sees for a set's missing parent.
+static double OpenMicros(const std::wstring &dir, bool sharded, size_t count) {
+  UINT32 seed = 12345;
+  size_t opened = 0;
+  Stopwatch watch;
+  for (size_t k = 0; k < kOpens; ++k) {
+    seed = seed * 1103515245 + 12345;
+    HANDLE h = CreateFileW(
+        PathOf(dir, sharded, ArchiveName(seed % count)).c_str(),
+        GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h != INVALID_HANDLE_VALUE) {
+      opened++;
+      CloseHandle(h);
+    }
+    GetFileAttributesW(PathOf(dir, sharded, ArchiveName(count + k)).c_str());
+  }
+  double us = watch.Seconds() * 1e6 / kOpens;
+  CHECK(opened == kOpens);
+  return us;
+}
+
+static size_t ListFlat(const std::wstring &dir) {
+  size_t files = 0;
+  WIN32_FIND_DATAW fd;
+  HANDLE h = FindFirstFileExW((dir + L"\\*").c_str(), FindExInfoBasic, &fd,
+                              FindExSearchNameMatch, NULL,
+                              FIND_FIRST_EX_LARGE_FETCH);
+  if (h == INVALID_HANDLE_VALUE)
+    return 0;
+  do {
+    if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+      files++;
+  } while (FindNextFileW(h, &fd));
+  FindClose(h);
+  return files;
+}
+
+// What the sharded root listing does: collect names and sort them.
+static size_t SortNames(std::vector<std::wstring> &names) {
+  std::sort(names.begin(), names.end(),
+            [](const std::wstring &a, const std::wstring &b) {
+              return _wcsicmp(a.c_str(), b.c_str()) < 0;
+            });
+  return names.size();
+}
+
+static size_t ListCatalog(CacheCatalog &catalog) {
+  std::vector<std::wstring> names;
+  catalog.ForEach(
+      [&](const CatalogEntry &e) { names.push_back(e.Name + 1); });
+  return SortNames(names);
+}
+
+static size_t ListScan(CacheCatalog &catalog) {
+  std::vector<CatalogEntry> found;
+  catalog.Scan(found);
+  std::vector<std::wstring> names;
+  for (const auto &e : found)
+    names.push_back(e.Name + 1);
+  return SortNames(names);
+}
+
+int main() {
+  ScratchDir flatDir(L"layout-flat");
+  ScratchDir shardedDir(L"layout-sharded");
+  const std::wstring &flat = flatDir.Path();
+  const std::wstring &sharded = shardedDir.Path();
+  // Migrating an empty cache creates the shards and records the layout.
+  CHECK(CacheLayout::MigrateToShards(sharded, 4));
+  CHECK(CacheLayout::IsSharded(sharded));
+  CHECK(CacheLayout::IsLayoutDir(sharded));
+  CHECK(CacheLayout::IsLayoutDir(sharded + CacheLayout::ShardDir(0x73f)));
+  CHECK(!CacheLayout::IsLayoutDir(flat + L"\\pacman"));
+
+  CacheCatalog flatCatalog, shardedCatalog;
+  double shardedOpenUs = 0, catalogListMs = 0;
+  size_t created = 0;
+  for (size_t count : kSizes) {
+    CHECK(CreateArchives(flat, false, created, count));
+    CHECK(CreateArchives(sharded, true, created, count));
+    created = count;
+
+    double flatOpenUs = OpenMicros(flat, false, count);
+    shardedOpenUs = OpenMicros(sharded, true, count);
+
+    Stopwatch watch;
+    CHECK(ListFlat(flat) == count);
+    double flatListMs = watch.Ms();
+
+    // A fresh catalog each round, so it is rebuilt at this size.
+    shardedCatalog.Close();
+    DeleteFileW((sharded + L"\\mcr.catalog").c_str());
+    watch.Reset();
+    CHECK(shardedCatalog.Open(sharded, true));
+    double rebuildMs = watch.Ms();
+    watch.Reset();
+    CHECK(ListCatalog(shardedCatalog) == count);
+    catalogListMs = watch.Ms();
+    watch.Reset();
+    CHECK(ListScan(shardedCatalog) == count);
+    double scanListMs = watch.Ms();
+
+    std::cout << count << " archives: open " << flatOpenUs << " us flat, "
+              << shardedOpenUs << " us sharded; list " << flatListMs
+              << " ms flat, " << catalogListMs << " ms from the catalog, "
+              << scanListMs << " ms walking the shards; catalog rebuilt in "
+              << rebuildMs << " ms" << std::endl;
+  }
+  shardedCatalog.Close();
+
+  Stopwatch watch;
+  CHECK(CacheLayout::MigrateToShards(
+      flat, (std::max)(1u, std::thread::hardware_concurrency())));
+  std::cout << "Migrated " << created << " archives in " << watch.Ms()
+            << " ms" << std::endl;
+  CHECK(flatCatalog.Open(flat, true));
+  CHECK(flatCatalog.Count() == created);
+  CHECK(ListScan(flatCatalog) == created);
+  flatCatalog.Close();
+
+  // Loose ceilings: a regression to a linear scan per open, or a listing
+  // that stops using the catalog, blows well past these.
+  CHECK(shardedOpenUs < 2000);
+  CHECK(catalogListMs < 2000);
+  return TestResult("CacheLayoutBenchmark");
+}
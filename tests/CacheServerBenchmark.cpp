@@ -0,0 +1,164 @@
+// Several LAN clients sharing one cache server, run on localhost: a
+// CacheServer in front of an empty cache whose misses are filled with
+// Downloader from a LocalOrigin standing in for the upstream, as -serve
+// does. Each client fetches archives picked with a skewed popularity, so
+// clients ask for the same sets at the same time. Reports throughput and
+// hit ratio for a cold cache and then a warm one, and checks that every
+// archive went upstream once however many clients asked for it at once.
+#include "Crc32.h"
+#include "Downloader.h"
+#include "LocalOrigin.h"
+#include "TestUtil.h"
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+static const size_t kArchives = 200;
+static const size_t kArchiveBytes = 256 * 1024;
+static const UINT32 kClients = 8;
+static const size_t kRequestsPerClient = 100;
+
+static std::wstring ArchiveName(size_t i) {
+  wchar_t name[32];
+  swprintf(name, 32, L"set%03zu.zip", i);
+  return name;
+}
+
+// Archive i is picked with weight 1 / (i + 1).
+static size_t PickArchive(UINT32 &seed,
+                          const std::vector<double> &cumulative) {
+  seed = seed * 1103515245 + 12345;
+  double r = (seed >> 8) / (double)(1 << 24) * cumulative.back();
+  return std::lower_bound(cumulative.begin(), cumulative.end(), r) -
+         cumulative.begin();
+}
+
+struct RoundStats {
+  double Seconds = 0;
+  UINT64 Bytes = 0;
+  size_t Wrong = 0;
+  std::vector<double> Ms; // per request, sorted
+};
+
+// Every client makes its requests one after another, each for a whole
+// archive, and checks the bytes against the archive's CRC. Each round makes
+// the same requests.
+static RoundStats RunClients(CacheServer &server,
+                             const std::vector<UINT32> &crcs,
+                             const std::vector<double> &cumulative,
+                             std::set<size_t> &asked) {
+  RoundStats stats;
+  std::mutex lock;
+  std::vector<std::thread> clients;
+  Stopwatch watch;
+  for (UINT32 c = 0; c < kClients; ++c) {
+    clients.emplace_back([&, c]() {
+      UINT32 seed = 7919 + c;
+      std::wstring base =
+          L"http://127.0.0.1:" + std::to_wstring(server.Port()) + L"/split/";
+      for (size_t k = 0; k < kRequestsPerClient; ++k) {
+        size_t a = PickArchive(seed, cumulative);
+        UINT32 crc = 0;
+        UINT64 got = 0;
+        HttpValidator validator;
+        Stopwatch request;
+        bool ok = Downloader::FetchRanges(
+            base + ArchiveName(a), {{0, kArchiveBytes}}, validator,
+            [&](UINT64, const BYTE *data, DWORD size) {
+              crc = Crc32Update(crc, data, size);
+              got += size;
+              return true;
+            },
+            TransferPriority::Interactive);
+        double ms = request.Ms();
+        std::lock_guard<std::mutex> guard(lock);
+        asked.insert(a);
+        stats.Ms.push_back(ms);
+        stats.Bytes += got;
+        if (!ok || got != kArchiveBytes || crc != crcs[a])
+          stats.Wrong++;
+      }
+    });
+  }
+  for (auto &t : clients)
+    t.join();
+  stats.Seconds = watch.Seconds();
+  std::sort(stats.Ms.begin(), stats.Ms.end());
+  return stats;
+}
+
+static void Report(const char *what, const RoundStats &s, UINT64 hits,
+                   UINT64 fills) {
+  double ratio = (hits + fills) ? 100.0 * hits / (hits + fills) : 0;
+  std::cout << what << ": " << s.Ms.size() / s.Seconds << " requests/s, "
+            << s.Bytes / s.Seconds / (1024 * 1024) << " MB/s, median "
+            << s.Ms[s.Ms.size() / 2] << " ms, p99 "
+            << s.Ms[s.Ms.size() * 99 / 100] << " ms, " << ratio << "% hits"
+            << std::endl;
+}
+
+int main() {
+  // Every client gets its own connection, as separate machines would.
+  TransferLimits limits;
+  limits.MaxTransfers = 2 * kClients;
+  limits.MaxPerOrigin = 2 * kClients;
+  TransferScheduler::Configure(limits);
+
+  ScratchDir upstreamDir(L"serve-upstream");
+  ScratchDir cacheDir(L"serve-cache");
+  static LocalOrigin upstream(upstreamDir.Path());
+  CHECK(upstream.Start());
+
+  std::vector<UINT32> crcs;
+  std::vector<double> cumulative;
+  double total = 0;
+  for (size_t i = 0; i < kArchives; ++i) {
+    std::string data(kArchiveBytes, '\0');
+    for (size_t j = 0; j < data.size(); ++j)
+      data[j] = (char)(i * 131 + j * 17 + (j >> 12));
+    CHECK(WriteWholeFile(upstream.Path(ArchiveName(i)), data));
+    crcs.push_back(Crc32Update(0, data.data(), data.size()));
+    cumulative.push_back(total += 1.0 / (i + 1));
+  }
+
+  // What -serve attaches, minus the catalog: the cache directory, filled
+  // from upstream by Downloader so concurrent misses share one transfer.
+  std::wstring cache = cacheDir.Path();
+  static CacheServer server;
+  server.Attach(
+      [cache](const std::wstring &name) { return cache + name; },
+      [cache](const std::wstring &name) {
+        return Downloader::Download(upstream.Url(name.substr(1)),
+                                    cache + name, nullptr,
+                                    TransferPriority::Interactive);
+      },
+      nullptr);
+  CHECK(server.Start(0));
+
+  std::set<size_t> asked;
+  RoundStats cold = RunClients(server, crcs, cumulative, asked);
+  UINT64 coldHits = server.Hits(), coldFills = server.Fills();
+  Report("Cold cache", cold, coldHits, coldFills);
+  UINT64 upstreamRequests = upstream.Requests();
+  std::cout << asked.size() << " archives asked for, " << upstreamRequests
+            << " fetched upstream" << std::endl;
+
+  // The same requests again, all of them for archives cached now.
+  std::set<size_t> askedWarm;
+  RoundStats warm = RunClients(server, crcs, cumulative, askedWarm);
+  Report("Warm cache", warm, server.Hits() - coldHits,
+         server.Fills() - coldFills);
+
+  CHECK(cold.Wrong == 0);
+  CHECK(warm.Wrong == 0);
+  // Misses that arrive together share one upstream transfer.
+  CHECK(upstreamRequests == asked.size());
+  CHECK(coldHits + coldFills == kClients * kRequestsPerClient);
+  CHECK(server.Fills() == coldFills);
+  // Loose floor: localhost serves a warm cache far faster than this.
+  CHECK(warm.Bytes / warm.Seconds > 10.0 * 1024 * 1024);
+  return TestResult("CacheServerBenchmark");
+}
@@ -0,0 +1,94 @@
+// Checks how the cache server reads Range headers and maps request targets
+// to cache names, without opening a socket. Run through ctest; exits
+// non-zero on failure.
+#include "CacheServer.h"
+#include "TestUtil.h"
+
+// ParseRange's result, with the range it gave if usable.
+struct Range {
+  int Result;
+  UINT64 First;
+  UINT64 Length;
+};
+
+static Range Parse(const std::string &spec, UINT64 size) {
+  Range r = {0, 0, 0};
+  r.Result = CacheServer::ParseRange(spec, size, r.First, r.Length);
+  return r;
+}
+
+static bool Is(const Range &r, UINT64 first, UINT64 length) {
+  return r.Result == 1 && r.First == first && r.Length == length;
+}
+
+static void TestParseRange() {
+  CHECK(Is(Parse("bytes=0-99", 1000), 0, 100));
+  CHECK(Is(Parse("bytes=500-", 1000), 500, 500));
+  CHECK(Is(Parse("bytes=999-999", 1000), 999, 1));
+  // The end is clamped to the file, and the unit is case-insensitive.
+  CHECK(Is(Parse("bytes=900-5000", 1000), 900, 100));
+  CHECK(Is(Parse("BYTES= 5 - 9 ", 1000), 5, 5));
+
+  // Suffix ranges ask for the last bytes, as ZipDelta's tail fetch does.
+  CHECK(Is(Parse("bytes=-100", 1000), 900, 100));
+  CHECK(Is(Parse("bytes=-5000", 1000), 0, 1000));
+  CHECK(Parse("bytes=-0", 1000).Result == -1);
+  CHECK(Parse("bytes=-10", 0).Result == -1);
+
+  // Starting at or past the end cannot be satisfied.
+  CHECK(Parse("bytes=1000-", 1000).Result == -1);
+  CHECK(Parse("bytes=2000-3000", 1000).Result == -1);
+
+  // Anything else is ignored and the whole file sent, which is always a
+  // valid answer.
+  CHECK(Parse("bytes=10-5", 1000).Result == 0);
+  CHECK(Parse("bytes=0-1,5-9", 1000).Result == 0);
+  CHECK(Parse("items=0-5", 1000).Result == 0);
+  CHECK(Parse("bytes=abc-5", 1000).Result == 0);
+  CHECK(Parse("bytes=5", 1000).Result == 0);
+  CHECK(Parse("bytes=-", 1000).Result == 0);
+  CHECK(Parse("", 1000).Result == 0);
+}
+
+static bool Maps(const std::string &target, const std::wstring &expected) {
+  std::wstring name;
+  return CacheServer::MapTarget(target, name) && name == expected;
+}
+
+static bool Rejects(const std::string &target) {
+  std::wstring name;
+  return !CacheServer::MapTarget(target, name);
+}
+
+static void TestMapTarget() {
+  CHECK(Maps("/split/pacman.zip", L"\\pacman.zip"));
+  CHECK(Maps("/standalone/pacman.7z", L"\\pacman.7z"));
+  CHECK(Maps("/split/PACMAN.ZIP", L"\\PACMAN.ZIP"));
+  CHECK(Maps("/split/sub/kinst.zip", L"\\sub\\kinst.zip"));
+  // Query strings are dropped and escapes decoded, as UTF-8.
+  CHECK(Maps("/split/pacman.zip?v=2", L"\\pacman.zip"));
+  CHECK(Maps("/split/a%20b.zip", L"\\a b.zip"));
+  CHECK(Maps("/split/caf%C3%A9.zip", L"\\caf\u00e9.zip"));
+
+  // Only the origin's layout: zips under split/, 7z under standalone/.
+  CHECK(Rejects("/split/pacman.7z"));
+  CHECK(Rejects("/standalone/pacman.zip"));
+  CHECK(Rejects("/other/pacman.zip"));
+  CHECK(Rejects("/split/pacman.zip.part"));
+  CHECK(Rejects("/split/.zip"));
+  CHECK(Rejects("/"));
+
+  // Nothing that could reach outside the cache directory, escaped or not.
+  CHECK(Rejects("/split/../mcr.zip"));
+  CHECK(Rejects("/split/%2E%2E/mcr.zip"));
+  CHECK(Rejects("/split/a//b.zip"));
+  CHECK(Rejects("/split/a%5Cb.zip"));
+  CHECK(Rejects("/split/c:pacman.zip"));
+  CHECK(Rejects("/split/pac%00man.zip"));
+}
+
+int main() {
+  TestParseRange();
+  TestMapTarget();
+  return TestResult("CacheServerTest");
+}
@@ -0,0 +1,132 @@
+// Checks ChdFormat's header parsing and .hunks encoding without touching
+// the network or WinFsp. Run through ctest; exits non-zero on failure.
+#include "ChdFormat.h"
+#include "TestUtil.h"
+#include <cstring>
+
+static void WriteBE32(BYTE *p, UINT32 value) {
+  p[0] = (BYTE)(value >> 24);
+  p[1] = (BYTE)(value >> 16);
+  p[2] = (BYTE)(value >> 8);
+  p[3] = (BYTE)value;
+}
+
+static void WriteBE64(BYTE *p, UINT64 value) {
+  WriteBE32(p, (UINT32)(value >> 32));
+  WriteBE32(p + 4, (UINT32)value);
+}
+
+// A header of `length` bytes with the magic, length and version filled in.
+static std::vector<BYTE> MakeHeader(UINT32 version, UINT32 length) {
+  std::vector<BYTE> header(length, 0);
+  memcpy(header.data(), "MComprHD", 8);
+  WriteBE32(&header[8], length);
+  WriteBE32(&header[12], version);
+  return header;
+}
+
+static void TestV3AndV4() {
+  // v3 and v4 differ past the fields used here; only the length changes.
+  const UINT32 lengths[] = {120, 108};
+  for (UINT32 version = 3; version <= 4; ++version) {
+    UINT32 length = lengths[version - 3];
+    std::vector<BYTE> header = MakeHeader(version, length);
+    WriteBE32(&header[24], 1000);         // total hunks
+    WriteBE64(&header[36], 0x123456789A); // metadata offset
+
+    ChdFormat::Layout layout;
+    CHECK(ChdFormat::ParseHeader(header.data(), header.size(), layout));
+    CHECK(layout.Version == version);
+    CHECK(layout.MapOffset == length);
+    CHECK(layout.MapBytes == 1000 * 16);
+    CHECK(!layout.MapLengthInMap);
+    CHECK(layout.MetaOffset == 0x123456789A);
+  }
+}
+
+static void TestV5() {
+  std::vector<BYTE> header = MakeHeader(5, 124);
+  WriteBE64(&header[32], 10 * 4096 + 1); // logical bytes
+  WriteBE64(&header[40], 0x10000);       // map offset
+  WriteBE64(&header[48], 0x20000);       // metadata offset
+  WriteBE32(&header[56], 4096);          // hunk bytes
+
+  // No compressor: a four-byte entry per hunk, rounding up.
+  ChdFormat::Layout layout;
+  CHECK(ChdFormat::ParseHeader(header.data(), header.size(), layout));
+  CHECK(layout.Version == 5);
+  CHECK(layout.MapOffset == 0x10000);
+  CHECK(layout.MapBytes == 11 * 4);
+  CHECK(!layout.MapLengthInMap);
+  CHECK(layout.MetaOffset == 0x20000);
+
+  // Compressed: the length comes from the map header.
+  memcpy(&header[16], "zlib", 4);
+  CHECK(ChdFormat::ParseHeader(header.data(), header.size(), layout));
+  CHECK(layout.MapLengthInMap);
+  CHECK(layout.MapBytes == 0);
+  BYTE mapHeader[ChdFormat::kMapHeaderBytes];
+  WriteBE32(mapHeader, 5000);
+  CHECK(ChdFormat::CompressedMapBytes(mapHeader) == 16 + 5000);
+}
+
+static void TestRejected() {
+  ChdFormat::Layout layout;
+  std::vector<BYTE> header = MakeHeader(5, 124);
+
+  // Cut short of its own length.
+  CHECK(!ChdFormat::ParseHeader(header.data(), 100, layout));
+  CHECK(layout.Version == 0);
+  CHECK(!ChdFormat::ParseHeader(header.data(), 8, layout));
+
+  header[0] = 'X';
+  CHECK(!ChdFormat::ParseHeader(header.data(), header.size(), layout));
+  CHECK(layout.Version == 0);
+
+  std::vector<BYTE> v2 = MakeHeader(2, 80);
+  CHECK(!ChdFormat::ParseHeader(v2.data(), v2.size(), layout));
+  CHECK(layout.Version == 2);
+
+  // A v5 length too short to hold the map and metadata offsets.
+  std::vector<BYTE> shortV5 = MakeHeader(5, 48);
+  CHECK(!ChdFormat::ParseHeader(shortV5.data(), shortV5.size(), layout));
+}
+
+static void TestHunks() {
+  const UINT32 kBlock = 256 * 1024;
+  ChdFormat::Hunks hunks;
+  hunks.BlockSize = kBlock;
+  hunks.Size = 20 * (UINT64)kBlock + 1; // 21 blocks, three bitmap bytes
+  hunks.ETag = L"\"abc\"";
+  hunks.LastModified = L"Mon, 01 Jan 2024 00:00:00 GMT";
+  hunks.Bitmap = {0x01, 0x80, 0x10};
+  CHECK(ChdFormat::BitmapBytes(hunks.Size, kBlock) == 3);
+
+  std::vector<BYTE> data = ChdFormat::EncodeHunks(hunks);
+  ChdFormat::Hunks loaded;
+  CHECK(ChdFormat::DecodeHunks(data, kBlock, loaded));
+  CHECK(loaded.BlockSize == kBlock);
+  CHECK(loaded.Size == hunks.Size);
+  CHECK(loaded.ETag == hunks.ETag);
+  CHECK(loaded.LastModified == hunks.LastModified);
+  CHECK(loaded.Bitmap == hunks.Bitmap);
+
+  // Written for another block size, or with the bitmap cut off.
+  CHECK(!ChdFormat::DecodeHunks(data, kBlock / 2, loaded));
+  data.pop_back();
+  CHECK(!ChdFormat::DecodeHunks(data, kBlock, loaded));
+  CHECK(!ChdFormat::DecodeHunks(std::vector<BYTE>(8, 0), kBlock, loaded));
+
+  // Long validators are clipped, not overflowed.
+  hunks.ETag.assign(100, L'e');
+  CHECK(ChdFormat::DecodeHunks(ChdFormat::EncodeHunks(hunks), kBlock, loaded));
+  CHECK(loaded.ETag == std::wstring(ChdFormat::kMaxETag, L'e'));
+}
+
+int main() {
+  TestV3AndV4();
+  TestV5();
+  TestRejected();
+  TestHunks();
+  return TestResult("ChdFormat");
+}
@@ -0,0 +1,162 @@
+// Streams a synthetic v5 CHD from a LocalOrigin and checks, block by block,
+// what ChdStream fetched, what it recorded in the .hunks bitmap, how it
+// resumes from that bitmap, and how it recovers when the origin's copy
+// changes under it.
+#include "ChdFormat.h"
+#include "ChdStream.h"
+#include "LocalOrigin.h"
+#include "TestUtil.h"
+#include <cstring>
+#include <set>
+#include <thread>
+#include <vector>
+
+static const UINT64 kBlock = ChdStream::kBlockSize;
+static const UINT64 kMapOffset = 12 * kBlock + 100;
+static const UINT32 kMapLength = (UINT32)kBlock + 1000; // into block 13
+static const UINT64 kMetaOffset = 24 * kBlock + 50;
+
+static void WriteBE32(char *p, UINT32 value) {
+  p[0] = (char)(value >> 24);
+  p[1] = (char)(value >> 16);
+  p[2] = (char)(value >> 8);
+  p[3] = (char)value;
+}
+
+static void WriteBE64(char *p, UINT64 value) {
+  WriteBE32(p, (UINT32)(value >> 32));
+  WriteBE32(p + 4, (UINT32)value);
+}
+
+// A v5 CHD with a compressed hunk map, `blocks` blocks long. `seed` varies
+// the filler so two versions differ everywhere but in the header.
+static std::string MakeChd(UINT64 blocks, UINT32 seed) {
+  std::string chd((size_t)(blocks * kBlock), '\0');
+  for (size_t i = 0; i < chd.size(); ++i)
+    chd[i] = (char)((i * 31 + (i >> 12) + seed) & 0xFF);
+
+  char *p = &chd[0];
+  memcpy(p, "MComprHD", 8);
+  WriteBE32(p + 8, 124);
+  WriteBE32(p + 12, 5);
+  memcpy(p + 16, "zlib", 4);
+  WriteBE64(p + 32, 1000 * 4096); // logical bytes
+  WriteBE64(p + 40, kMapOffset);
+  WriteBE64(p + 48, kMetaOffset);
+  WriteBE32(p + 56, 4096); // hunk bytes
+  WriteBE32(p + (size_t)kMapOffset, kMapLength);
+  return chd;
+}
+
+static std::set<UINT64> PresentBlocks(const std::wstring &localPath) {
+  std::string file = ReadWholeFile(localPath + L".hunks");
+  ChdFormat::Hunks hunks;
+  std::set<UINT64> present;
+  if (!ChdFormat::DecodeHunks(std::vector<BYTE>(file.begin(), file.end()),
+                              (UINT32)kBlock, hunks))
+    return present;
+  for (UINT64 block = 0; block < hunks.Bitmap.size() * 8; ++block)
+    if ((hunks.Bitmap[(size_t)(block / 8)] >> (block % 8)) & 1)
+      present.insert(block);
+  return present;
+}
+
+// The local copy holds the origin's bytes in every block listed.
+static bool BlocksMatch(const std::wstring &localPath,
+                        const std::string &origin,
+                        const std::set<UINT64> &blocks) {
+  std::string local = ReadWholeFile(localPath);
+  if (local.size() != origin.size())
+    return false;
+  for (UINT64 block : blocks) {
+    size_t at = (size_t)(block * kBlock);
+    size_t length = (size_t)(std::min)(kBlock, (UINT64)origin.size() - at);
+    if (local.compare(at, length, origin, at, length) != 0)
+      return false;
+  }
+  return true;
+}
+
+int main() {
+  ScratchDir originDir(L"chd-origin");
+  ScratchDir cacheDir(L"chd-cache");
+  static LocalOrigin origin(originDir.Path());
+  CHECK(origin.Start());
+
+  std::string chd = MakeChd(32, 0);
+  CHECK(WriteWholeFile(origin.Path(L"disk.zip"), chd));
+  std::wstring url = origin.Url(L"disk.zip");
+  std::wstring localPath = cacheDir.Path() + L"\\disk.chd";
+
+  // Concurrent opens share one load: the header block, the map header, the
+  // rest of the map and the first metadata entry, one request each.
+  std::vector<std::shared_ptr<ChdStream>> opened(4);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < opened.size(); ++i)
+    threads.emplace_back(
+        [&, i] { opened[i] = ChdStream::Open(url, localPath); });
+  for (auto &t : threads)
+    t.join();
+  std::shared_ptr<ChdStream> stream = opened[0];
+  CHECK(stream != nullptr);
+  for (const auto &other : opened)
+    CHECK(other == stream);
+  CHECK(origin.Requests() == 4);
+  std::set<UINT64> expected = {0, 12, 13, 24};
+  CHECK(PresentBlocks(localPath) == expected);
+  CHECK(BlocksMatch(localPath, chd, expected));
+  if (!stream)
+    return TestResult("ChdStream");
+
+  // A scattered read fetches just its block; one continuing it adds a
+  // block of read-ahead, in the same request.
+  UINT64 before = origin.Requests();
+  CHECK(stream->Ensure(5 * kBlock + 10, 100));
+  CHECK(origin.Requests() == before + 1);
+  CHECK(stream->Ensure(5 * kBlock + 110, kBlock));
+  CHECK(origin.Requests() == before + 2);
+  expected.insert({5, 6, 7});
+  CHECK(PresentBlocks(localPath) == expected);
+  CHECK(BlocksMatch(localPath, chd, expected));
+  // Cached and out-of-range reads cost nothing.
+  CHECK(stream->Ensure(12 * kBlock, 2 * kBlock));
+  CHECK(stream->Ensure(chd.size() + 10, 10));
+  CHECK(origin.Requests() == before + 2);
+
+  // A later session resumes from the bitmap: only the header block is
+  // fetched again, to check the origin copy is the same one.
+  std::wstring resumedPath = cacheDir.Path() + L"\\resumed.chd";
+  CHECK(WriteWholeFile(resumedPath, ReadWholeFile(localPath)));
+  CHECK(WriteWholeFile(resumedPath + L".hunks",
+                       ReadWholeFile(localPath + L".hunks")));
+  before = origin.Requests();
+  std::shared_ptr<ChdStream> resumed = ChdStream::Open(url, resumedPath);
+  CHECK(resumed != nullptr && resumed != stream);
+  CHECK(origin.Requests() == before + 1);
+  CHECK(resumed && resumed->Ensure(6 * kBlock, kBlock));
+  CHECK(origin.Requests() == before + 1);
+  CHECK(PresentBlocks(resumedPath) == expected);
+
+  // The origin copy changes: If-Range gets a 200, the stream drops its
+  // blocks and bitmap, and the next open starts on the new copy.
+  std::string changed = MakeChd(33, 7);
+  CHECK(WriteWholeFile(origin.Path(L"disk.zip"), changed));
+  CHECK(!stream->Ensure(20 * kBlock, 10));
+  CHECK(GetFileAttributesW((localPath + L".hunks").c_str()) ==
+        INVALID_FILE_ATTRIBUTES);
+  before = origin.Requests();
+  CHECK(!stream->Ensure(21 * kBlock, 10));
+  CHECK(origin.Requests() == before);
+
+  std::shared_ptr<ChdStream> reopened = ChdStream::Open(url, localPath);
+  CHECK(reopened != nullptr && reopened != stream);
+  CHECK(origin.Requests() == before + 4);
+  std::set<UINT64> fresh = {0, 12, 13, 24};
+  CHECK(PresentBlocks(localPath) == fresh);
+  CHECK(BlocksMatch(localPath, changed, fresh));
+
+  // Nothing to stream.
+  CHECK(ChdStream::Open(origin.Url(L"missing.zip"),
+                        cacheDir.Path() + L"\\missing.chd") == nullptr);
+  return TestResult("ChdStream");
+}
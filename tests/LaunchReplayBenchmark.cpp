@@ -0,0 +1,196 @@
+// Replays a month of launches on a simulated clock and measures what cache
+// warming from the usage history buys: each day starts from an empty cache
+// warmed with the top sets and their dependencies, as a new cabinet would,
+// and a launch waits for every archive it needs that is not cached. Usage
+// is counted with LaunchDetector, and for comparison by counting every
+// archive open, which ranks shared BIOS and parents above the games.
+#include "UsageHistory.h"
+#include "TestUtil.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <set>
+#include <vector>
+
+static const size_t kGames = 300;
+static const size_t kParents = 40;
+static const int kDays = 30;
+static const int kLaunchesPerDay = 8;
+static const size_t kWarmSets = 20;
+static const double kBytesPerMs = 10.0 * 1024 * 1024 / 1000;
+static const double kRequestMs = 50;
+
+struct Game {
+  std::wstring Name;
+  std::vector<size_t> Needs; // archives opened after the game's own
+  UINT64 Size;
+};
+
+// Games, then the archives they depend on and that are never launched
+// themselves: a BIOS shared by a fifth of the games, and the parents of a
+// third, which are clones of a version nobody plays.
+static std::vector<Game> MakeArchives() {
+  std::vector<Game> archives;
+  wchar_t name[16];
+  for (size_t i = 0; i < kGames; ++i) {
+    swprintf(name, 16, L"game%03zu", i);
+    archives.push_back({name, {}, (2 + i * 7919 % 38) * 1024 * 1024});
+  }
+  size_t bios = archives.size();
+  archives.push_back({L"neogeo", {}, 1024 * 1024});
+  size_t parents = archives.size();
+  for (size_t i = 0; i < kParents; ++i) {
+    swprintf(name, 16, L"parent%02zu", i);
+    archives.push_back({name, {}, (2 + i * 104729 % 30) * 1024 * 1024});
+  }
+  for (size_t i = 0; i < kGames; ++i) {
+    if (i % 5 == 1)
+      archives[i].Needs.push_back(bios);
+    else if (i % 3 == 2)
+      archives[i].Needs.push_back(parents + i * 31 % kParents);
+  }
+  return archives;
+}
+
+// Game i is picked with weight 1 / (i + 1)^1.1, scattered over the list.
+static size_t PickGame(UINT32 &seed, const std::vector<double> &cumulative) {
+  seed = seed * 1103515245 + 12345;
+  double r = (seed >> 8) / (double)(1 << 24) * cumulative.back();
+  size_t rank = std::lower_bound(cumulative.begin(), cumulative.end(), r) -
+                cumulative.begin();
+  return rank * 37 % kGames;
+}
+
+struct Outcome {
+  size_t WarmLaunches = 0;
+  std::vector<double> ColdMs;
+  std::vector<std::wstring> Top;
+};
+
+// One way of counting launches, fed the same opens as the others.
+struct Counter {
+  UsageHistory History;
+  LaunchDetector Detector;
+  std::vector<std::atomic<UINT64>> LastOpened;
+  bool EveryOpen;
+  Outcome Result;
+
+  Counter(size_t archives, bool everyOpen)
+      : LastOpened(archives), EveryOpen(everyOpen) {
+    for (auto &last : LastOpened)
+      last = 0;
+  }
+
+  void Open(const std::vector<Game> &archives, size_t a, UINT64 nowMs) {
+    std::wstring name = L"\\" + archives[a].Name + L".zip";
+    if (EveryOpen) {
+      UINT64 last = LastOpened[a].exchange(nowMs);
+      if (last == 0 || nowMs - last >= LaunchDetector::kLaunchGapMs)
+        History.RecordLaunch(name);
+    } else if (Detector.IsLaunch(LastOpened[a], nowMs)) {
+      History.RecordLaunch(name);
+    }
+  }
+};
+
+static void WarmAndLaunch(const std::vector<Game> &archives,
+                          const std::vector<std::wstring> &top, size_t game,
+                          Outcome &result) {
+  std::set<size_t> cached;
+  for (const auto &set : top) {
+    for (size_t a = 0; a < archives.size(); ++a) {
+      if (archives[a].Name != set)
+        continue;
+      cached.insert(a);
+      cached.insert(archives[a].Needs.begin(), archives[a].Needs.end());
+    }
+  }
+  double ms = 0;
+  std::vector<size_t> needed = archives[game].Needs;
+  needed.push_back(game);
+  for (size_t a : needed)
+    if (!cached.count(a))
+      ms += kRequestMs + archives[a].Size / kBytesPerMs;
+  if (ms == 0)
+    result.WarmLaunches++;
+  else
+    result.ColdMs.push_back(ms);
+}
+
+static void Report(const char *what, const Outcome &o, size_t launches) {
+  std::vector<double> cold = o.ColdMs;
+  std::sort(cold.begin(), cold.end());
+  double mean = 0;
+  for (double ms : cold)
+    mean += ms / launches;
+  std::cout << what << ": " << o.WarmLaunches << " of " << launches
+            << " launches fully cached, mean first-launch wait " << mean
+            << " ms";
+  if (!cold.empty())
+    std::cout << ", worst " << cold.back() << " ms";
+  std::cout << std::endl;
+}
+
+int main() {
+  std::vector<Game> archives = MakeArchives();
+  std::vector<double> cumulative;
+  double total = 0;
+  for (size_t i = 0; i < kGames; ++i)
+    cumulative.push_back(total += 1 / std::pow(i + 1.0, 1.1));
+
+  Counter detected(archives.size(), false);
+  Counter everyOpen(archives.size(), true);
+  Outcome unwarmed;
+  UINT32 seed = 4242;
+  UINT64 now = 1;
+  size_t launches = 0;
+  for (int day = 0; day < kDays; ++day) {
+    std::vector<std::wstring> detectedTop = detected.History.Top(kWarmSets);
+    std::vector<std::wstring> everyTop = everyOpen.History.Top(kWarmSets);
+    for (int l = 0; l < kLaunchesPerDay; ++l, ++launches) {
+      size_t game = PickGame(seed, cumulative);
+      WarmAndLaunch(archives, detectedTop, game, detected.Result);
+      WarmAndLaunch(archives, everyTop, game, everyOpen.Result);
+      WarmAndLaunch(archives, {}, game, unwarmed);
+
+      // MAME opens the game's archive, then its dependencies, and goes back
+      // to the game's archive for the rest of its ROMs.
+      std::vector<size_t> opens = {game, game};
+      opens.insert(opens.end(), archives[game].Needs.begin(),
+                   archives[game].Needs.end());
+      opens.push_back(game);
+      for (size_t a : opens) {
+        detected.Open(archives, a, now);
+        everyOpen.Open(archives, a, now);
+        now += 15;
+      }
+      now += 45 * 60 * 1000; // a game's worth of play
+    }
+    now += 12 * 60 * 60 * 1000;
+  }
+  detected.Result.Top = detected.History.Top(kWarmSets);
+  everyOpen.Result.Top = everyOpen.History.Top(kWarmSets);
+
+  Report("No warming", unwarmed, launches);
+  Report("Warmed, counting every archive open", everyOpen.Result, launches);
+  Report("Warmed, counting launches", detected.Result, launches);
+
+  // The BIOS and parents are opened by many games but never launched.
+  auto dependencies = [](const Outcome &o) {
+    size_t count = 0;
+    for (const auto &set : o.Top)
+      if (set == L"neogeo" || set.compare(0, 6, L"parent") == 0)
+        count++;
+    return count;
+  };
+  std::cout << "Dependencies among the top " << kWarmSets << ": "
+            << dependencies(everyOpen.Result) << " counting every open, "
+            << dependencies(detected.Result) << " counting launches"
+            << std::endl;
+  CHECK(dependencies(everyOpen.Result) > 0);
+  CHECK(dependencies(detected.Result) == 0);
+  CHECK(detected.Result.WarmLaunches > everyOpen.Result.WarmLaunches);
+  CHECK(detected.Result.WarmLaunches > unwarmed.WarmLaunches + launches / 4);
+  return TestResult("LaunchReplayBenchmark");
+}
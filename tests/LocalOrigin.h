@@ -0,0 +1,40 @@
+#pragma once
+// A Range-capable origin on localhost for tests and benchmarks: CacheServer
+// serving a directory as /split/<name>.zip, with no upstream behind it.
+// CacheServer keeps serving until the process exits, so a LocalOrigin is
+// meant to live that long too.
+#include "CacheServer.h"
+#include <atomic>
+#include <string>
+
+class LocalOrigin {
+public:
+  explicit LocalOrigin(const std::wstring &root) : m_Root(root) {
+    m_Server.Attach(
+        [this](const std::wstring &name) { return m_Root + name; },
+        [](const std::wstring &) { return false; },
+        [this](const std::wstring &) { m_Requests++; });
+  }
+  LocalOrigin(const LocalOrigin &) = delete;
+  LocalOrigin &operator=(const LocalOrigin &) = delete;
+
+  bool Start() { return m_Server.Start(0); }
+
+  // CacheServer only routes .zip names under split/; the bytes behind the
+  // name can be anything.
+  std::wstring Url(const std::wstring &zipName) const {
+    return L"http://127.0.0.1:" + std::to_wstring(m_Server.Port()) +
+           L"/split/" + zipName;
+  }
+  std::wstring Path(const std::wstring &zipName) const {
+    return m_Root + L"\\" + zipName;
+  }
+  // Requests answered from a file that exists, ranged or not.
+  UINT64 Requests() const { return m_Requests; }
+  UINT64 BytesSent() const { return m_Server.BytesSent(); }
+
+private:
+  std::wstring m_Root;
+  CacheServer m_Server;
+  std::atomic<UINT64> m_Requests{0};
+};
@@ -0,0 +1,123 @@
+// Opens per second per core on the cached-archive fast path, the part of
+// SOpen that is ours rather than the kernel's: classifying the name, the
+// PathTable and catalog lookups, and the catalog touch. Also checks that
+// none of it allocates, and that Classify agrees with the hashes it stands
+// in for.
+#include "CacheCatalog.h"
+#include "PathTable.h"
+#include "TestUtil.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <vector>
+
+static const size_t kArchives = 20000;
+static const size_t kOpensPerThread = 500000;
+
+static std::atomic<UINT64> g_Allocations{0};
+
+void *operator new(size_t size) {
+  g_Allocations++;
+  if (void *p = malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static std::wstring ArchiveName(size_t i) {
+  wchar_t name[32];
+  swprintf(name, 32, L"\\set%05zu.zip", i);
+  return name;
+}
+
+static void TestClassify(const std::wstring &cacheDir) {
+  UINT64 dirHash = PathTable::HashPath(cacheDir);
+  CHECK(PathTable::Classify(L"\\", dirHash).Kind == PathKind::Root);
+  CHECK(PathTable::Classify(L"\\pacman.zip", dirHash).Kind == PathKind::Zip);
+  CHECK(PathTable::Classify(L"\\pacman.7z", dirHash).Kind ==
+        PathKind::SevenZip);
+  CHECK(PathTable::Classify(L"\\kinst\\kinst.chd", dirHash).Kind ==
+        PathKind::Chd);
+  CHECK(PathTable::Classify(L"\\pacman\\pacman.6e", dirHash).Kind ==
+        PathKind::Other);
+  // Extensions are case-sensitive, hashes are not.
+  CHECK(PathTable::Classify(L"\\PACMAN.ZIP", dirHash).Kind ==
+        PathKind::Other);
+
+  const wchar_t *name = L"\\Pacman.zip";
+  PathClass cls = PathTable::Classify(name, dirHash);
+  CHECK(cls.Length == wcslen(name));
+  CHECK(cls.NameHash == CacheCatalog::HashName(name));
+  CHECK(cls.NameHash ==
+        PathTable::Classify(L"\\PACMAN.zip", dirHash).NameHash);
+  CHECK(cls.PathHash == PathTable::HashPath(cacheDir + name));
+}
+
+int main() {
+  ScratchDir cacheDir(L"open-path");
+  TestClassify(cacheDir.Path());
+
+  CacheCatalog catalog;
+  CHECK(catalog.Open(cacheDir.Path()));
+  PathTable paths;
+  UINT64 dirHash = PathTable::HashPath(cacheDir.Path());
+  std::vector<std::wstring> names;
+  for (size_t i = 0; i < kArchives; ++i) {
+    names.push_back(ArchiveName(i));
+    DownloadInfo info;
+    info.Validator.Size = 1000 + i;
+    catalog.Commit(names[i].c_str(), info);
+    PathClass cls = PathTable::Classify(names[i].c_str(), dirHash);
+    paths.Intern(names[i].c_str(), cls.Length, cls.NameHash,
+                 cacheDir.Path() + names[i], cls.PathHash);
+  }
+
+  // One thread's share of opens; returns how many found everything cached.
+  auto opens = [&](size_t first) {
+    size_t hits = 0;
+    for (size_t k = 0; k < kOpensPerThread; ++k) {
+      PCWSTR name = names[(first + k * 7919) % kArchives].c_str();
+      PathClass cls = PathTable::Classify(name, dirHash);
+      PathEntry *path = paths.Find(name, cls.Length, cls.NameHash);
+      CatalogEntry entry;
+      if (path && catalog.Lookup(name, &entry, cls.NameHash) &&
+          entry.State == CatalogState::Complete) {
+        catalog.Touch(name, cls.NameHash);
+        hits++;
+      }
+    }
+    return hits;
+  };
+
+  UINT64 allocations = g_Allocations;
+  Stopwatch watch;
+  CHECK(opens(0) == kOpensPerThread);
+  double single = kOpensPerThread / watch.Seconds();
+  CHECK(g_Allocations == allocations);
+
+  UINT32 threads = (std::max)(2u, std::thread::hardware_concurrency());
+  std::vector<size_t> hits(threads);
+  std::vector<std::thread> workers;
+  watch.Reset();
+  for (UINT32 t = 0; t < threads; ++t)
+    workers.emplace_back([&, t]() { hits[t] = opens(t * 101); });
+  for (auto &w : workers)
+    w.join();
+  // Every thread does kOpensPerThread, so this is the rate of each.
+  double parallel = kOpensPerThread / watch.Seconds();
+  for (size_t h : hits)
+    CHECK(h == kOpensPerThread);
+
+  std::cout << "Cached opens: " << (UINT64)single << "/s on one core, "
+            << (UINT64)parallel << "/s per core with " << threads
+            << " threads" << std::endl;
+  // Loose floor: a few microseconds per open. Locking or allocating per
+  // open shows up well below it.
+  CHECK(single > 200000);
+  catalog.Close();
+  return TestResult("OpenPathBenchmark");
+}
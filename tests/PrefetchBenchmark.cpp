@@ -0,0 +1,130 @@
+// Aggregate throughput of the prefetch mode against a LocalOrigin standing
+// in for the archive origin: the same sets fetched into an empty cache with
+// 1 to 8 workers, then again into the full one, which only checks what is
+// cached. Every downloaded archive is checked against its CRC, and every
+// set must go upstream exactly once per empty cache.
+#include "Crc32.h"
+#include "LocalOrigin.h"
+#include "Prefetcher.h"
+#include "TestUtil.h"
+#include <cstdio>
+#include <vector>
+
+static const size_t kSets = 120;
+static const size_t kArchiveBytes = 1024 * 1024;
+static const UINT32 kWorkers[] = {1, 2, 4, 8};
+static const UINT32 kMaxWorkers = 8;
+
+static std::wstring SetName(size_t i) {
+  wchar_t name[32];
+  swprintf(name, 32, L"set%03zu", i);
+  return name;
+}
+
+struct RunStats {
+  double Seconds = 0;
+  size_t Failed = 0;
+  UINT64 Requests = 0; // upstream
+  UINT64 Bytes = 0;    // upstream
+};
+
+// One Run over every set into `cacheDir`, as -prefetch does with a
+// catalog of its own.
+static RunStats Prefetch(LocalOrigin &origin, const std::wstring &cacheDir,
+                         UINT32 workers) {
+  CacheCatalog catalog;
+  CHECK(catalog.Open(cacheDir));
+  Prefetcher prefetcher;
+  // The origin only serves zips, so .7z names have no URL and are skipped.
+  prefetcher.Attach(
+      &catalog,
+      [&origin](const std::wstring &name) {
+        bool zip = name.size() > 4 &&
+                   name.compare(name.size() - 4, 4, L".zip") == 0;
+        return zip ? origin.Url(name.substr(1)) : std::wstring();
+      },
+      [cacheDir](const std::wstring &name) { return cacheDir + name; });
+
+  PrefetchOptions options;
+  for (size_t i = 0; i < kSets; ++i)
+    options.Names.push_back(SetName(i));
+
+  RunStats stats;
+  UINT64 requests = origin.Requests(), bytes = origin.BytesSent();
+  Stopwatch watch;
+  stats.Failed = prefetcher.Run(options, workers);
+  stats.Seconds = watch.Seconds();
+  stats.Requests = origin.Requests() - requests;
+  stats.Bytes = origin.BytesSent() - bytes;
+  catalog.Close();
+  return stats;
+}
+
+// Sets in `cacheDir` whose bytes differ from the origin's.
+static size_t WrongArchives(const std::wstring &cacheDir,
+                            const std::vector<UINT32> &crcs) {
+  size_t wrong = 0;
+  for (size_t i = 0; i < kSets; ++i) {
+    UINT32 crc = 0;
+    if (!Crc32File(cacheDir + L"\\" + SetName(i) + L".zip", crc) ||
+        crc != crcs[i])
+      wrong++;
+  }
+  return wrong;
+}
+
+int main() {
+  // Every worker gets its own transfer, as an origin with no per-client
+  // limit would allow.
+  TransferLimits limits;
+  limits.MaxTransfers = kMaxWorkers;
+  limits.MaxPerOrigin = kMaxWorkers;
+  TransferScheduler::Configure(limits);
+
+  ScratchDir originDir(L"prefetch-origin");
+  static LocalOrigin origin(originDir.Path());
+  CHECK(origin.Start());
+  std::vector<UINT32> crcs;
+  for (size_t i = 0; i < kSets; ++i) {
+    std::string data(kArchiveBytes, '\0');
+    for (size_t j = 0; j < data.size(); ++j)
+      data[j] = (char)(i * 131 + j * 17 + (j >> 12));
+    CHECK(WriteWholeFile(origin.Path(SetName(i) + L".zip"), data));
+    crcs.push_back(Crc32Update(0, data.data(), data.size()));
+  }
+
+  std::vector<std::pair<UINT32, RunStats>> results;
+  RunStats rerun;
+  for (UINT32 workers : kWorkers) {
+    ScratchDir cacheDir(L"prefetch-cache-" + std::to_wstring(workers));
+    RunStats stats = Prefetch(origin, cacheDir.Path(), workers);
+    CHECK(stats.Failed == 0);
+    CHECK(stats.Requests == kSets);
+    CHECK(WrongArchives(cacheDir.Path(), crcs) == 0);
+    results.push_back({workers, stats});
+    // Resuming a finished prefetch fetches nothing.
+    if (workers == kMaxWorkers) {
+      rerun = Prefetch(origin, cacheDir.Path(), workers);
+      CHECK(rerun.Failed == 0);
+      CHECK(rerun.Requests == 0);
+    }
+  }
+
+  for (const auto &r : results)
+    std::cout << r.first << " workers: "
+              << r.second.Bytes / r.second.Seconds / (1024 * 1024)
+              << " MB/s, " << kSets / r.second.Seconds << " sets/s"
+              << std::endl;
+  std::cout << "Rerun into the full cache: " << kSets / rerun.Seconds
+            << " sets/s checked, " << rerun.Requests << " fetched"
+            << std::endl;
+
+  // Loose bounds. Localhost has no round trips to overlap, so more workers
+  // need not be faster here, but the pool must not make things worse, and
+  // checking a full cache must beat fetching into an empty one.
+  double first = results.front().second.Seconds;
+  double widest = results.back().second.Seconds;
+  CHECK(widest < first * 2);
+  CHECK(rerun.Seconds < widest);
+  return TestResult("PrefetchBenchmark");
+}
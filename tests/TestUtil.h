@@ -0,0 +1,84 @@
+#pragma once
+// Shared by the tests and benchmarks: failure counting, a scratch directory
+// and a stopwatch. Each test is its own executable; ctest fails it on a
+// non-zero exit.
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <windows.h>
+
+inline int &TestFailures() {
+  static int failures = 0;
+  return failures;
+}
+
+#define CHECK(expr)                                                            \
+  do {                                                                         \
+    if (!(expr)) {                                                             \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #expr ") failed"  \
+                << std::endl;                                                  \
+      TestFailures()++;                                                        \
+    }                                                                          \
+  } while (0)
+
+// What main returns.
+inline int TestResult(const char *name) {
+  if (TestFailures() == 0)
+    std::cout << name << ": all checks passed" << std::endl;
+  else
+    std::cout << name << ": " << TestFailures() << " checks failed"
+              << std::endl;
+  return TestFailures() == 0 ? 0 : 1;
+}
+
+// A fresh directory under %TEMP%, removed with its contents at the end.
+class ScratchDir {
+public:
+  explicit ScratchDir(const std::wstring &name) {
+    wchar_t temp[MAX_PATH];
+    GetTempPathW(MAX_PATH, temp);
+    m_Path = std::wstring(temp) + L"mcr-" + name + L"-" +
+             std::to_wstring(GetCurrentProcessId());
+    std::error_code ec;
+    std::filesystem::remove_all(m_Path, ec);
+    std::filesystem::create_directories(m_Path);
+  }
+  ~ScratchDir() {
+    std::error_code ec;
+    std::filesystem::remove_all(m_Path, ec);
+  }
+  const std::wstring &Path() const { return m_Path; }
+
+private:
+  std::wstring m_Path;
+};
+
+class Stopwatch {
+public:
+  Stopwatch() : m_Start(std::chrono::steady_clock::now()) {}
+  void Reset() { m_Start = std::chrono::steady_clock::now(); }
+  double Seconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         m_Start)
+        .count();
+  }
+  double Ms() const { return Seconds() * 1000; }
+
+private:
+  std::chrono::steady_clock::time_point m_Start;
+};
+
+inline bool WriteWholeFile(const std::wstring &path, const std::string &data) {
+  std::ofstream out(std::filesystem::path(path),
+                    std::ios::binary | std::ios::trunc);
+  out.write(data.data(), (std::streamsize)data.size());
+  return out.good();
+}
+
+inline std::string ReadWholeFile(const std::wstring &path) {
+  std::ifstream in(std::filesystem::path(path), std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
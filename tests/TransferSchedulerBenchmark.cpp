@@ -0,0 +1,147 @@
+// Interactive download latency with and without background load, run
+// against simulated links instead of the network: each origin is a link of
+// fixed bandwidth that the transfers reading from it share. Transfers go
+// through TransferScheduler exactly as Downloader's do, Acquire and then
+// Throttle after every chunk, so what is measured is the scheduler's
+// admission and pausing.
+#include "TransferScheduler.h"
+#include "TestUtil.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+static const UINT64 kChunk = 64 * 1024;
+static const double kLinkBytesPerSecond = 64.0 * 1024 * 1024;
+static const UINT64 kInteractiveBytes = 2 * 1024 * 1024;
+static const UINT64 kBulkBytes = 8 * 1024 * 1024;
+static const int kLaunches = 12;
+
+// One origin's link: chunks are sent one after another at the link rate,
+// so concurrent readers split the bandwidth.
+class Link {
+public:
+  void Receive(UINT64 bytes) {
+    std::chrono::steady_clock::time_point done;
+    {
+      std::lock_guard<std::mutex> guard(m_Lock);
+      auto now = std::chrono::steady_clock::now();
+      if (m_NextFree < now)
+        m_NextFree = now;
+      m_NextFree += std::chrono::microseconds(
+          (long long)(bytes / kLinkBytesPerSecond * 1e6));
+      done = m_NextFree;
+    }
+    std::this_thread::sleep_until(done);
+    m_Bytes += bytes;
+  }
+  UINT64 Bytes() const { return m_Bytes; }
+
+private:
+  std::mutex m_Lock;
+  std::chrono::steady_clock::time_point m_NextFree;
+  std::atomic<UINT64> m_Bytes{0};
+};
+
+static void Transfer(Link &link, const std::wstring &origin,
+                     const TransferScheduler::SharedPriority &priority,
+                     UINT64 bytes) {
+  TransferScheduler::Slot slot = TransferScheduler::Acquire(origin, priority);
+  for (UINT64 got = 0; got < bytes; got += kChunk) {
+    link.Receive(kChunk);
+    slot.Throttle(kChunk);
+  }
+}
+
+static void Transfer(Link &link, const std::wstring &origin,
+                     TransferPriority priority, UINT64 bytes) {
+  TransferScheduler::SharedPriority shared(priority);
+  Transfer(link, origin, shared, bytes);
+}
+
+// Milliseconds from asking for each launch's archive to having all of it,
+// one launch after another, sorted.
+static std::vector<double> Launches(Link &link, const std::wstring &origin) {
+  std::vector<double> ms;
+  for (int i = 0; i < kLaunches; ++i) {
+    Stopwatch watch;
+    Transfer(link, origin, TransferPriority::Interactive, kInteractiveBytes);
+    ms.push_back(watch.Ms());
+  }
+  std::sort(ms.begin(), ms.end());
+  return ms;
+}
+
+static void Report(const char *what, const std::vector<double> &ms) {
+  std::cout << what << ": median " << ms[ms.size() / 2] << " ms, worst "
+            << ms.back() << " ms" << std::endl;
+}
+
+int main() {
+  TransferLimits limits;
+  limits.MaxTransfers = 8;
+  limits.MaxPerOrigin = 3;
+  TransferScheduler::Configure(limits);
+  const std::wstring origin = L"origin.example";
+  const std::wstring upstream = L"upstream.lan";
+  Link originLink, upstreamLink;
+
+  std::vector<double> idle = Launches(originLink, origin);
+  Report("Interactive, idle link", idle);
+
+  // Background and prefetch transfers fill every slot they are allowed on
+  // the origin, and revalidation keeps a second origin busy.
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> load;
+  auto keepBusy = [&](Link *link, std::wstring host, TransferPriority p) {
+    while (!stop)
+      Transfer(*link, host, p, kBulkBytes);
+  };
+  for (UINT32 i = 0;
+       i < TransferScheduler::Capacity(TransferPriority::Background); ++i) {
+    load.emplace_back(keepBusy, &originLink, origin,
+                      TransferPriority::Background);
+    load.emplace_back(keepBusy, &originLink, origin,
+                      TransferPriority::Prefetch);
+    load.emplace_back(keepBusy, &upstreamLink, upstream,
+                      TransferPriority::Background);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  UINT64 upstreamBefore = upstreamLink.Bytes();
+  Stopwatch busyWatch;
+  std::vector<double> busy = Launches(originLink, origin);
+  double upstreamMBps = (upstreamLink.Bytes() - upstreamBefore) /
+                        busyWatch.Seconds() / (1024 * 1024);
+  Report("Interactive, under background load", busy);
+  std::cout << "Other origin kept " << upstreamMBps
+            << " MB/s meanwhile" << std::endl;
+
+  // A prefetch MAME starts waiting for is raised and finishes at
+  // interactive speed rather than behind the rest of the bulk transfers.
+  TransferScheduler::SharedPriority raised(TransferPriority::Prefetch);
+  Stopwatch raiseWatch;
+  std::thread prefetch([&]() {
+    Transfer(originLink, origin, raised, kInteractiveBytes);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  TransferScheduler::Raise(raised, TransferPriority::Interactive);
+  prefetch.join();
+  double raisedMs = raiseWatch.Ms();
+  std::cout << "Raised prefetch: " << raisedMs << " ms" << std::endl;
+
+  stop = true;
+  for (auto &t : load)
+    t.join();
+
+  // The link alone takes kInteractiveBytes / kLinkBytesPerSecond, about
+  // 31 ms. Sharing it evenly with the load would take several times that;
+  // the scheduler should keep an interactive launch near the idle time,
+  // give or take the chunks already in flight when it starts.
+  double idleMedian = idle[idle.size() / 2];
+  double linkMs = kInteractiveBytes / kLinkBytesPerSecond * 1000;
+  CHECK(busy[busy.size() / 2] < 2 * idleMedian + linkMs);
+  CHECK(raisedMs < 3 * idleMedian + linkMs);
+  CHECK(upstreamMBps > 1);
+  return TestResult("TransferSchedulerBenchmark");
+}
@@ -0,0 +1,120 @@
+// Bytes fetched and time taken to bring a cached zip up to date when some
+// of its members change at the origin, by zip delta and by downloading the
+// whole file again, against a LocalOrigin on localhost. Members are stored,
+// so the rebuilt file is checked by VerifyMembers alone and tar is not
+// needed.
+#include "LocalOrigin.h"
+#include "TestUtil.h"
+#include "ZipDelta.h"
+#include "ZipWriter.h"
+#include <cstdio>
+#include <functional>
+
+static const size_t kMembers = 64;
+static const size_t kMemberBytes = 256 * 1024;
+static const size_t kChanged[] = {1, 4, 16};
+// Past half the file a delta is not attempted.
+static const size_t kMostChanged = 48;
+
+static std::vector<ZipEntry> MakeEntries() {
+  std::vector<ZipEntry> entries;
+  char name[16];
+  for (size_t i = 0; i < kMembers; ++i) {
+    snprintf(name, sizeof(name), "rom%02zu.bin", i);
+    std::string data(kMemberBytes, '\0');
+    for (size_t j = 0; j < data.size(); ++j)
+      data[j] = (char)(i * 31 + j * 7 + (j >> 10));
+    entries.push_back({name, data});
+  }
+  return entries;
+}
+
+// The origin's new version: `count` members spread over the set get new
+// contents of the same size, as a ROM fix usually does.
+static std::vector<ZipEntry> Change(std::vector<ZipEntry> entries,
+                                    size_t count) {
+  for (size_t k = 0; k < count; ++k) {
+    std::string &data = entries[k * kMembers / count].Data;
+    for (size_t j = 0; j < data.size(); j += 97)
+      data[j] = (char)~data[j];
+  }
+  return entries;
+}
+
+struct Fetch {
+  bool Ok = false;
+  UINT64 Bytes = 0;
+  double Ms = 0;
+};
+
+int main() {
+  ScratchDir originDir(L"zip-delta-origin");
+  ScratchDir cacheDir(L"zip-delta-cache");
+  static LocalOrigin origin(originDir.Path());
+  CHECK(origin.Start());
+  std::wstring url = origin.Url(L"set.zip");
+  std::wstring cached = cacheDir.Path() + L"\\set.zip";
+  std::wstring whole = cacheDir.Path() + L"\\whole.zip";
+
+  std::vector<ZipEntry> entries = MakeEntries();
+  std::string old = MakeZip(entries);
+
+  auto measure = [&](const std::function<bool()> &update) {
+    Fetch f;
+    UINT64 before = origin.BytesSent();
+    Stopwatch watch;
+    f.Ok = update();
+    f.Ms = watch.Ms();
+    f.Bytes = origin.BytesSent() - before;
+    return f;
+  };
+
+  for (size_t count : kChanged) {
+    std::string current = MakeZip(Change(entries, count));
+    CHECK(WriteWholeFile(origin.Path(L"set.zip"), current));
+    CHECK(WriteWholeFile(cached, old));
+    DeleteFileW(whole.c_str());
+
+    DownloadInfo deltaInfo, wholeInfo;
+    Fetch delta = measure([&] {
+      return ZipDelta::Update(url, cached, &deltaInfo,
+                              TransferPriority::Background);
+    });
+    Fetch full = measure([&] {
+      return Downloader::Download(url, whole, &wholeInfo,
+                                  TransferPriority::Background);
+    });
+    CHECK(delta.Ok && full.Ok);
+    CHECK(ReadWholeFile(cached) == current);
+    CHECK(ReadWholeFile(whole) == current);
+    UINT32 crc = Crc32Update(0, current.data(), current.size());
+    CHECK(deltaInfo.Crc32 == crc);
+    CHECK(wholeInfo.Crc32 == crc);
+
+    std::cout << count << " of " << kMembers << " members changed: delta "
+              << delta.Bytes / 1024 << " KB in " << delta.Ms
+              << " ms, whole file " << full.Bytes / 1024 << " KB in "
+              << full.Ms << " ms" << std::endl;
+    // The changed members, plus the tail with the central directory.
+    CHECK(delta.Bytes < current.size() * count / kMembers + 128 * 1024);
+    CHECK(full.Bytes == current.size());
+  }
+
+  // With most members changed the delta gives up after the tail, leaving
+  // the cached copy as it was for a whole-file download.
+  CHECK(WriteWholeFile(origin.Path(L"set.zip"),
+                       MakeZip(Change(entries, kMostChanged))));
+  CHECK(WriteWholeFile(cached, old));
+  Fetch refused = measure([&] {
+    return ZipDelta::Update(url, cached, nullptr,
+                            TransferPriority::Background);
+  });
+  std::cout << kMostChanged << " of " << kMembers
+            << " members changed: delta refused after "
+            << refused.Bytes / 1024 << " KB in " << refused.Ms << " ms"
+            << std::endl;
+  CHECK(!refused.Ok);
+  CHECK(refused.Bytes < 128 * 1024);
+  CHECK(ReadWholeFile(cached) == old);
+  return TestResult("ZipDeltaBenchmark");
+}
@@ -0,0 +1,155 @@
+// Checks the zip parsing and member verification ZipDelta::Update relies on
+// to decide what to reuse and whether a rebuilt file may be swapped in.
+// Run through ctest; exits non-zero on failure.
+#include "ZipDelta.h"
+#include "TestUtil.h"
+#include "ZipWriter.h"
+
+static std::vector<ZipEntry> SampleEntries() {
+  return {{"pacman.6e", std::string(4096, 'a')},
+          {"pacman.6f", std::string(1000, 'b')},
+          {"82s123.7f", "", 0},
+          {"pacman.5e", std::string(300, 'c'), 8}};
+}
+
+// Runs FindEndRecord and ParseDirectory on a whole file, as Update does on
+// the tail and central directory it fetched.
+static bool Parse(const std::string &zip, ZipDelta::Directory &dir) {
+  return ZipDelta::FindEndRecord(zip, zip.size(), dir) &&
+         ZipDelta::ParseDirectory((const BYTE *)zip.data() + dir.Offset,
+                                  (size_t)dir.Size, dir);
+}
+
+static void TestFindEndRecord() {
+  ZipLayout layout;
+  std::string zip = MakeZip(SampleEntries(), &layout, false, "a comment");
+  ZipDelta::Directory dir;
+  CHECK(ZipDelta::FindEndRecord(zip, zip.size(), dir));
+  CHECK(dir.FileSize == zip.size());
+  CHECK(dir.Offset == layout.CentralOffset);
+  CHECK(dir.Size == layout.CentralSize);
+
+  // Only the end of the file is fetched; offsets stay file offsets.
+  std::string tail = zip.substr(zip.size() - 40);
+  CHECK(ZipDelta::FindEndRecord(tail, zip.size(), dir));
+  CHECK(dir.Offset == layout.CentralOffset);
+
+  // Bytes after the comment mean the record found is not the last thing
+  // in the file.
+  CHECK(!ZipDelta::FindEndRecord(zip + "x", zip.size() + 1, dir));
+  CHECK(!ZipDelta::FindEndRecord(zip, zip.size() - 1, dir));
+  CHECK(!ZipDelta::FindEndRecord(zip.substr(0, 21), zip.size(), dir));
+
+  // Zip64 archives are left to a full download.
+  std::string zip64 = zip;
+  size_t end = zip.size() - 22 - 9;
+  zip64.replace(end + 16, 4, "\xFF\xFF\xFF\xFF");
+  CHECK(!ZipDelta::FindEndRecord(zip64, zip64.size(), dir));
+}
+
+static void TestParseDirectory() {
+  std::vector<ZipEntry> entries = SampleEntries();
+  ZipLayout layout;
+  // Central directory order need not be file order.
+  std::string zip = MakeZip(entries, &layout, true);
+  ZipDelta::Directory dir;
+  CHECK(Parse(zip, dir));
+  CHECK(dir.Members.size() == entries.size());
+  if (dir.Members.size() != entries.size())
+    return;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const ZipDelta::Member &m = dir.Members[i];
+    CHECK(m.Name == entries[i].Name);
+    CHECK(m.Method == entries[i].Method);
+    CHECK(m.LocalOffset == layout.LocalOffsets[i]);
+    CHECK(m.CompressedSize == entries[i].Data.size());
+    CHECK(m.Crc32 == Crc32Update(0, entries[i].Data.data(),
+                                 entries[i].Data.size()));
+    UINT64 next = i + 1 < entries.size() ? layout.LocalOffsets[i + 1]
+                                         : layout.CentralOffset;
+    CHECK(m.Span == next - m.LocalOffset);
+  }
+
+  const BYTE *central = (const BYTE *)zip.data() + dir.Offset;
+  CHECK(ZipDelta::ParseDirectory(central, 0, dir));
+  CHECK(dir.Members.empty());
+  // A record cut short, or anything but records in the directory.
+  CHECK(!ZipDelta::ParseDirectory(central, (size_t)dir.Size - 1, dir));
+  std::string padded = zip.substr((size_t)layout.CentralOffset,
+                                  (size_t)layout.CentralSize) +
+                       "junk";
+  CHECK(!ZipDelta::ParseDirectory((const BYTE *)padded.data(),
+                                  padded.size(), dir));
+
+  // Two members at one offset leave no bytes for the first.
+  std::string overlap = MakeZip({entries[0], entries[1]}, &layout);
+  size_t second = (size_t)layout.CentralOffset + 46 + entries[0].Name.size();
+  overlap.replace(second + 42, 4, std::string(4, '\0'));
+  CHECK(!Parse(overlap, dir));
+
+  // Zip64 sizes are left to a full download.
+  std::string zip64 = MakeZip({entries[0]}, &layout);
+  zip64.replace((size_t)layout.CentralOffset + 20, 4, "\xFF\xFF\xFF\xFF");
+  CHECK(!Parse(zip64, dir));
+}
+
+// Writes `zip` and runs VerifyMembers on it against `dir`.
+static bool Verify(const std::wstring &path, const std::string &zip,
+                   const ZipDelta::Directory &dir) {
+  if (!WriteWholeFile(path, zip))
+    return false;
+  HANDLE h = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (h == INVALID_HANDLE_VALUE)
+    return false;
+  bool ok = ZipDelta::VerifyMembers(h, dir);
+  CloseHandle(h);
+  return ok;
+}
+
+static void TestVerifyMembers() {
+  ScratchDir scratch(L"zip-delta-test");
+  std::wstring path = scratch.Path() + L"\\set.zip";
+  ZipLayout layout;
+  std::string zip = MakeZip(SampleEntries(), &layout);
+  ZipDelta::Directory dir;
+  CHECK(Parse(zip, dir));
+  CHECK(Verify(path, zip, dir));
+
+  // A flipped byte in a stored member fails its CRC.
+  std::string bad = zip;
+  bad[(size_t)layout.LocalOffsets[1] + 30 + 9 + 10] ^= 1;
+  CHECK(!Verify(path, bad, dir));
+
+  // Compressed members' data is left to the archive test.
+  bad = zip;
+  bad[(size_t)layout.LocalOffsets[3] + 30 + 9 + 10] ^= 1;
+  CHECK(Verify(path, bad, dir));
+
+  // The local header has to repeat the central directory's fields.
+  bad = zip;
+  bad[(size_t)layout.LocalOffsets[0] + 10] ^= 1; // time
+  CHECK(!Verify(path, bad, dir));
+  bad = zip;
+  bad[(size_t)layout.LocalOffsets[2] + 30] = 'X'; // name
+  CHECK(!Verify(path, bad, dir));
+  bad = zip;
+  bad[(size_t)layout.LocalOffsets[1]] = 'Q'; // signature
+  CHECK(!Verify(path, bad, dir));
+
+  // Data that would run into the next member.
+  ZipDelta::Directory shorter = dir;
+  shorter.Members[0].Span -= 1;
+  CHECK(!Verify(path, zip, shorter));
+
+  // A file cut short in a stored member.
+  CHECK(!Verify(path, zip.substr(0, (size_t)layout.LocalOffsets[1] + 40),
+                dir));
+}
+
+int main() {
+  TestFindEndRecord();
+  TestParseDirectory();
+  TestVerifyMembers();
+  return TestResult("ZipDeltaTest");
+}
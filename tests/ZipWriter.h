@@ -0,0 +1,95 @@
+#pragma once
+// Builds zip files in memory for the ZipDelta tests and benchmark. Members
+// are stored rather than deflated, so each one's CRC covers exactly the
+// bytes written; Method only changes what the headers claim.
+#include "Crc32.h"
+#include <string>
+#include <vector>
+
+struct ZipEntry {
+  std::string Name;
+  std::string Data;
+  UINT16 Method = 0;
+};
+
+struct ZipLayout {
+  std::vector<UINT64> LocalOffsets; // one per entry, in order
+  UINT64 CentralOffset = 0;
+  UINT64 CentralSize = 0;
+};
+
+inline void AppendLE(std::string &out, UINT32 value, int bytes) {
+  for (int i = 0; i < bytes; ++i)
+    out += (char)(value >> (8 * i));
+}
+
+// Local headers and data in entry order, then the central directory in the
+// same order or reversed, then the end record with `comment`.
+inline std::string MakeZip(const std::vector<ZipEntry> &entries,
+                           ZipLayout *layout = nullptr,
+                           bool reverseCentral = false,
+                           const std::string &comment = "") {
+  const UINT16 time = 0x6000, date = 0x5A21;
+  std::string zip;
+  std::vector<UINT64> offsets;
+  for (const auto &e : entries) {
+    offsets.push_back(zip.size());
+    UINT32 crc = Crc32Update(0, e.Data.data(), e.Data.size());
+    AppendLE(zip, 0x04034b50, 4);
+    AppendLE(zip, 10, 2); // version needed
+    AppendLE(zip, 0, 2);  // flags
+    AppendLE(zip, e.Method, 2);
+    AppendLE(zip, time, 2);
+    AppendLE(zip, date, 2);
+    AppendLE(zip, crc, 4);
+    AppendLE(zip, (UINT32)e.Data.size(), 4);
+    AppendLE(zip, (UINT32)e.Data.size(), 4);
+    AppendLE(zip, (UINT32)e.Name.size(), 2);
+    AppendLE(zip, 0, 2); // extra length
+    zip += e.Name;
+    zip += e.Data;
+  }
+
+  UINT64 central = zip.size();
+  for (size_t k = 0; k < entries.size(); ++k) {
+    size_t i = reverseCentral ? entries.size() - 1 - k : k;
+    const ZipEntry &e = entries[i];
+    UINT32 crc = Crc32Update(0, e.Data.data(), e.Data.size());
+    AppendLE(zip, 0x02014b50, 4);
+    AppendLE(zip, 20, 2); // version made by
+    AppendLE(zip, 10, 2); // version needed
+    AppendLE(zip, 0, 2);  // flags
+    AppendLE(zip, e.Method, 2);
+    AppendLE(zip, time, 2);
+    AppendLE(zip, date, 2);
+    AppendLE(zip, crc, 4);
+    AppendLE(zip, (UINT32)e.Data.size(), 4);
+    AppendLE(zip, (UINT32)e.Data.size(), 4);
+    AppendLE(zip, (UINT32)e.Name.size(), 2);
+    AppendLE(zip, 0, 2); // extra length
+    AppendLE(zip, 0, 2); // comment length
+    AppendLE(zip, 0, 2); // disk
+    AppendLE(zip, 0, 2); // internal attributes
+    AppendLE(zip, 0, 4); // external attributes
+    AppendLE(zip, (UINT32)offsets[i], 4);
+    zip += e.Name;
+  }
+  UINT64 centralSize = zip.size() - central;
+
+  AppendLE(zip, 0x06054b50, 4);
+  AppendLE(zip, 0, 2); // disk
+  AppendLE(zip, 0, 2); // disk with the central directory
+  AppendLE(zip, (UINT32)entries.size(), 2);
+  AppendLE(zip, (UINT32)entries.size(), 2);
+  AppendLE(zip, (UINT32)centralSize, 4);
+  AppendLE(zip, (UINT32)central, 4);
+  AppendLE(zip, (UINT32)comment.size(), 2);
+  zip += comment;
+
+  if (layout) {
+    layout->LocalOffsets = offsets;
+    layout->CentralOffset = central;
+    layout->CentralSize = centralSize;
+  }
+  return zip;
+}